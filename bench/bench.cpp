@@ -0,0 +1,262 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "AssemblerContext.h"
+#include "Document.h"
+#include "Generator.h"
+#include "BatchEncoder.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Scan.h"
+
+/*
+ * Builds a large synthetic source out of the kind of lines our generated
+ * ROMs are made of: labels, register and hex operands, comments and
+ * sprite tables. Every '#' in the block becomes the repeat index so each
+ * copy defines its own labels, and every '@' the index of one of the first
+ * copies, whose labels a 12 bit address can still reach.
+ */
+static std::string make_source(size_t repeats)
+{
+    static const std::string block = R"(
+; sprite drawing loop
+loop_start_#
+    ILOAD sprite_table_@ ; point I at the sprite
+    LOAD r0, $A
+    LOAD r1, $5
+    DRAW r0, r1, $5
+    ADD r0, $8
+    SKNE r0, $40
+    JMP loop_start_@
+    CALL ADDRESS_helper_@
+ADDRESS_helper_#
+    RADD rA, rB
+    IDUMP rF
+sprite_table_#
+    LB $F0
+    LB $90
+    LB $F0
+)";
+    /* 128 copies of 23 bytes end well before $FFF */
+    constexpr size_t IN_REACH = 128;
+    std::string text;
+    for (size_t i = 0; i < repeats; ++i) {
+        const std::string index = std::to_string(i);
+        const std::string reached = std::to_string(i % IN_REACH);
+        for (const char c : block) {
+            if (c == '#') {
+                text += index;
+            } else if (c == '@') {
+                text += reached;
+            } else {
+                text += c;
+            }
+        }
+    }
+    return text;
+}
+
+/* Sprite tables where most of every line is a comment */
+static std::string make_commented_source(size_t repeats)
+{
+    static const char* const block = R"(
+;------------------------------------------------------------------------------
+; sprite: glyph table entry, drawn 8 pixels wide and 5 rows high by DRAW
+;------------------------------------------------------------------------------
+glyph_table
+    LB $F0          ; ****....    top row of the glyph, all four pixels lit
+    LB $90          ; *..*....    the sides of the glyph, middle pixels clear
+    LB $90          ; *..*....    the sides of the glyph, middle pixels clear
+    LB $90          ; *..*....    the sides of the glyph, middle pixels clear
+    LB $F0          ; ****....    bottom row of the glyph, all four pixels lit
+)";
+    std::string text;
+    for (size_t i = 0; i < repeats; ++i) {
+        text += block;
+    }
+    return text;
+}
+
+static void bench_lexer(const char* name, const std::string& text, int iterations)
+{
+    using clock = std::chrono::steady_clock;
+
+    size_t tokens = 0;
+    const auto begin = clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        c8::Lexer lexer(text);
+        while (!lexer.get_next_token()._str.empty()) {
+            ++tokens;
+        }
+    }
+    const std::chrono::duration<double> elapsed = clock::now() - begin;
+
+    const double mb = static_cast<double>(text.size()) * iterations / (1024.0 * 1024.0);
+    std::printf("lexer (%s): %zu tokens in %.3f s -> %.2f Mtokens/s, %.1f MB/s\n",
+        name, tokens, elapsed.count(), tokens / elapsed.count() / 1e6, mb / elapsed.count());
+
+    for (unsigned threads : { 1u, 0u }) {
+        const auto start = clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            c8::Lexer{ text }.tokenize(threads);
+        }
+        const std::chrono::duration<double> took = clock::now() - start;
+        std::printf("tokenize (%s, %s): %.1f MB/s\n", name, threads == 1 ? "1 thread" : "all cores", mb / took.count());
+    }
+}
+
+static void bench_parser(const std::string& text, int iterations)
+{
+    using clock = std::chrono::steady_clock;
+
+    std::chrono::duration<double> pulled{}, lexed{}, parsed{}, parallel{};
+    size_t statements = 0;
+    for (int i = 0; i < iterations; ++i) {
+        auto begin = clock::now();
+        c8::Parser puller(c8::Lexer{ text });
+        statements = puller.parse().code.size();
+        pulled += clock::now() - begin;
+
+        begin = clock::now();
+        const auto tokens = c8::Lexer{ text }.tokenize();
+        const auto middle = clock::now();
+        c8::Parser walker(tokens);
+        walker.parse();
+        lexed += middle - begin;
+        parsed += clock::now() - middle;
+
+        begin = clock::now();
+        c8::parse_parallel(tokens, 0);
+        parallel += clock::now() - begin;
+    }
+
+    std::printf("parser (pull): %zu statements in %.3f s\n", statements * iterations, pulled.count());
+    std::printf("parser (token buffer): tokenize %.3f s + parse %.3f s\n", lexed.count(), parsed.count());
+    std::printf("parser (parallel, threads: %u): %.3f s\n", c8::parallel_parse_threads(c8::Lexer{ text }.tokenize(), 0), parallel.count());
+}
+
+/* Parse then generate against parsing and encoding in one pass over the same tokens */
+static void bench_assemble(const std::string& text, int iterations)
+{
+    using clock = std::chrono::steady_clock;
+
+    const auto tokens = c8::Lexer{ text }.tokenize();
+    std::chrono::duration<double> twoPass{}, onePass{};
+    size_t bytes = 0;
+    for (int i = 0; i < iterations; ++i) {
+        auto begin = clock::now();
+        c8::Parser parser(tokens);
+        bytes = c8::generate(parser.parse().code).size();
+        twoPass += clock::now() - begin;
+
+        begin = clock::now();
+        c8::Parser assembler(tokens);
+        c8::assemble(assembler);
+        onePass += clock::now() - begin;
+    }
+
+    std::printf("assemble: %zu bytes, parse+generate %.3f s, one pass %.3f s\n", bytes * iterations, twoPass.count(), onePass.count());
+}
+
+/* Generating a parsed program's ROM a record at a time against packing it into columns and encoding those in batches */
+static void bench_generate(const std::string& text, int iterations)
+{
+    using clock = std::chrono::steady_clock;
+
+    const auto tokens = c8::Lexer{ text }.tokenize();
+    const auto program = c8::Parser(tokens).parse();
+    auto begin = clock::now();
+    size_t bytes = 0;
+    for (int i = 0; i < iterations; ++i) {
+        bytes += c8::generate(program.code).size();
+    }
+    const std::chrono::duration<double> records = clock::now() - begin;
+
+    begin = clock::now();
+    const c8::IrColumns columns(program.code);
+    const std::chrono::duration<double> packed = clock::now() - begin;
+    std::printf("generate: %zu bytes, records %.3f s, packing %.3f s", bytes, records.count(), packed.count());
+    for (auto level : { c8::scan::Level::SCALAR, c8::scan::Level::SSE2, c8::scan::Level::AVX2 }) {
+        const auto kernel = c8::batch::kernel(level);
+        std::vector<uint8_t> out(2 * columns.size());
+        begin = clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            kernel(columns, 0, columns.size(), out.data());
+        }
+        const std::chrono::duration<double> encoded = clock::now() - begin;
+        std::printf(", %s %.3f s", c8::scan::level_name(level), encoded.count());
+    }
+    std::printf("\n");
+}
+
+/* Many small ROMs, each assembled from scratch against one reused context */
+static void bench_context(const std::string& text, int roms)
+{
+    using clock = std::chrono::steady_clock;
+
+    auto begin = clock::now();
+    for (int i = 0; i < roms; ++i) {
+        const auto tokens = c8::Lexer{ text }.tokenize();
+        c8::Parser parser(tokens);
+        c8::assemble(parser);
+    }
+    const std::chrono::duration<double> fresh = clock::now() - begin;
+
+    c8::AssemblerContext context;
+    begin = clock::now();
+    for (int i = 0; i < roms; ++i) {
+        context.assemble(text);
+    }
+    const std::chrono::duration<double> reused = clock::now() - begin;
+
+    std::printf("context: %d roms of %zu bytes, fresh %.3f s, reused %.3f s\n", roms, context.rom().size(), fresh.count(), reused.count());
+}
+
+/* Types a character and deletes it again in the middle and near the start of the source */
+static void bench_document(const std::string& text, int edits)
+{
+    using clock = std::chrono::steady_clock;
+
+    auto begin = clock::now();
+    c8::Document doc(text);
+    const std::chrono::duration<double, std::milli> opened = clock::now() - begin;
+
+    const size_t operand = doc.text().find("$A", doc.text().size() / 2) + 1;
+    const size_t line = doc.text().find("    LOAD r1");
+    begin = clock::now();
+    for (int i = 0; i < edits; ++i) {
+        doc.edit(operand, 1, i % 2 ? "A" : "B");
+    }
+    const std::chrono::duration<double, std::micro> retyped = clock::now() - begin;
+
+    begin = clock::now();
+    for (int i = 0; i < edits; ++i) {
+        if (i % 2) {
+            doc.edit(line, 12, "");
+        } else {
+            doc.edit(line, 0, "    CLR ; x\n");
+        }
+    }
+    const std::chrono::duration<double, std::micro> inserted = clock::now() - begin;
+
+    std::printf("document: open %.3f ms, operand edit %.2f us, line insert/delete near the start %.2f us\n",
+        opened.count(), retyped.count() / edits, inserted.count() / edits);
+}
+
+int main()
+{
+    std::printf("scanner: %s\n", c8::scan::level_name(c8::scan::detected_level()));
+    const std::string text = make_source(20000);
+    std::printf("source: %zu bytes\n", text.size());
+    bench_lexer("code", text, 10);
+    bench_parser(text, 5);
+    bench_assemble(text, 5);
+    bench_generate(text, 20);
+    bench_context(make_source(2), 200000);
+    /* About 100k lines */
+    bench_document(make_source(6500), 200);
+
+    const std::string commented = make_commented_source(20000);
+    std::printf("source: %zu bytes\n", commented.size());
+    bench_lexer("comments", commented, 10);
+}
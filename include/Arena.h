@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace c8 {
+    /*
+     * A monotonic allocator: memory is handed out by bumping a pointer
+     * through a list of blocks and only given back all at once by reset().
+     * reset() keeps the blocks, so a run that needs no more than the one
+     * before it doesn't touch the heap at all.
+     *
+     * Nothing allocated in an arena has its destructor run, so it only holds
+     * plain bytes like names.
+     */
+    class Arena {
+    public:
+        static constexpr size_t DEFAULT_BLOCK_SIZE = 4096;
+
+        explicit Arena(size_t blockSize = DEFAULT_BLOCK_SIZE);
+
+        /* Memory handed out points into the blocks */
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+        Arena(Arena&&) = default;
+        Arena& operator=(Arena&&) = default;
+
+        void* allocate(size_t size, size_t align = alignof(std::max_align_t));
+        /* A copy of text that lives until the next reset() */
+        std::string_view copy(std::string_view text);
+
+        /* Frees everything that was allocated. The blocks are kept for reuse. */
+        void reset();
+
+        /* The bytes held in blocks, used or not */
+        size_t capacity() const;
+
+    private:
+        struct Block {
+            std::unique_ptr<char[]> data;
+            size_t size;
+        };
+
+        size_t _blockSize;
+        std::vector<Block> _blocks;
+        /* The block being bumped through and how much of it is used */
+        size_t _current;
+        size_t _used;
+    };
+}
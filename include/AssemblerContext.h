@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "Diagnostics.h"
+#include "Ir.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "SymbolTable.h"
+
+namespace c8 {
+    /*
+     * Everything one assembly needs, kept from one run to the next for hosts
+     * that assemble many sources in a row.
+     *
+     * The tokens, records, fixups, symbol table and image are buffers that
+     * reset() empties without giving back their memory, and label names are
+     * copied into the symbol table's arena. Once a context has assembled a
+     * source at least as large as the next one, assembling it makes no heap
+     * allocations at all, short of recording an error.
+     */
+    class AssemblerContext {
+    public:
+        explicit AssemblerContext(Diagnostics diagnostics = Diagnostics());
+
+        AssemblerContext(const AssemblerContext&) = delete;
+        AssemblerContext& operator=(const AssemblerContext&) = delete;
+
+        /*
+         * Assembles a whole source after a reset(). The source only needs to
+         * live for the call. Returns whether there were no errors.
+         */
+        bool assemble(std::string_view source);
+
+        /* Lets the sources given to assemble() include files, as Parser::set_includes() does */
+        void set_includes(ModuleCache& modules, std::string directory);
+        /* The machine the sources given to assemble() are for, as Parser::set_target() sets */
+        void set_target(Target target) { _target = target; }
+
+        /*
+         * Assembles whatever the parser parses, in one pass: each statement is
+         * encoded as soon as it is parsed and then dropped. A jump to a label
+         * that isn't defined yet is written with a zero address and queued on
+         * the label, and the queue is patched when the label turns up. The
+         * code is assembled for the parser's target.
+         */
+        bool assemble(Parser& parser);
+
+        /* Forgets the last run and keeps every buffer's capacity */
+        void reset();
+
+        /* The image of the last run, only usable if it had no errors */
+        const std::vector<uint8_t>& rom() const { return _rom; }
+        const Diagnostics& diagnostics() const { return _diagnostics; }
+        /* The labels of the last run. The names are the context's own copies. */
+        const SymbolTable& symbols() const { return _symbols; }
+
+        /* Hands over the image and diagnostics of the last run; the context has to grow new ones */
+        Result<std::vector<uint8_t>> release();
+
+    private:
+        /* A forward reference, threaded into a list per label through next. The operand is the address of the label plus addend. */
+        struct Fixup {
+            uint32_t at;
+            uint32_t offset;
+            uint32_t next;
+            uint16_t file;
+            uint16_t addend;
+            /* Which field the address goes in */
+            Op op;
+        };
+
+        TokenBuffer _tokens;
+        SymbolTable _symbols;
+        /* Holds the statement being assembled */
+        std::vector<Ir> _code;
+        std::vector<Fixup> _fixups;
+        /* The first fixup waiting on each symbol */
+        std::vector<uint32_t> _pending;
+        /* The fixups whose label is undefined or out of reach, reported in source order at the end */
+        std::vector<std::pair<uint32_t, SymbolId>> _unresolved;
+        std::vector<uint8_t> _rom;
+        Diagnostics _diagnostics;
+        ModuleCache* _modules;
+        std::string _directory;
+        Target _target;
+
+        void patch(SymbolId label);
+        void patch_all();
+        void report_unresolved();
+    };
+}
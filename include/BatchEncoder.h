@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "Ir.h"
+#include "Scan.h"
+
+namespace c8 {
+    /*
+     * Records packed a field per array so that many can be encoded at once.
+     * Packing looks up each record's opcode pattern and puts its operands
+     * into the fields of the opcode they go to, so every instruction encodes
+     * the same way: pattern | x << 8 | y << 4 | value. A 4 byte opcode
+     * keeps its first 2 bytes that way and its last 2 in value. SYS takes up
+     * no space, so it is left out and every record packed has a size of
+     * 1, 2 or 4.
+     *
+     * Label operands have to be resolved before the records are packed.
+     */
+    struct IrColumns {
+        std::vector<uint16_t> patterns;
+        /* The register at bits 8 - 11, or 0 */
+        std::vector<uint8_t> xs;
+        /* The register at bits 4 - 7, or 0 */
+        std::vector<uint8_t> ys;
+        /* The NNN, NN or N in the low bits, or 0. The NNNN of a 4 byte opcode. */
+        std::vector<uint16_t> values;
+        /* The bytes each one takes up in the ROM */
+        std::vector<uint8_t> sizes;
+
+        IrColumns() = default;
+        explicit IrColumns(const std::vector<Ir>& code);
+
+        size_t size() const { return patterns.size(); }
+
+        void clear();
+        void reserve(size_t n);
+        void push_back(const Ir& ir);
+    };
+
+    /*
+     * Encoders of packed 2 byte records. Each writes the opcodes of
+     * [first, first + n) as 2 big endian bytes apiece to out, with a scalar version and, on x86,
+     * SSE2 and AVX2 versions that do 8 and 16 at a time. The best one the CPU
+     * supports is picked once, as for the scanners.
+     */
+    namespace batch {
+        using Kernel = void (*)(const IrColumns& code, size_t first, size_t n, uint8_t* out);
+
+        /* The kernel for a level. Levels above scan::detected_level() fall back to the detected one. */
+        Kernel kernel(scan::Level level);
+
+        void encode(const IrColumns& code, size_t first, size_t n, uint8_t* out);
+    }
+
+    /* The ROM image of packed records. LB writes only its low byte and LLOAD all 4. */
+    std::vector<uint8_t> generate(const IrColumns& code);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include "LineIndex.h"
+#include "ParseException.h"
+
+namespace c8 {
+    enum class Severity {
+        WARNING,
+        ERROR
+    };
+
+    struct Diagnostic {
+        Severity severity;
+        std::string message;
+        /* Where the offending token is in the source or ParseException::NO_OFFSET */
+        size_t offset;
+        /* The file the offset is in: 0 for the source itself, otherwise an included file */
+        uint16_t file;
+        /* Only known if the diagnostics have a locator, otherwise line 0 */
+        SourceLocation location;
+    };
+
+    /*
+     * Collects the errors and warnings of a run so that one run reports all
+     * of them. Whoever finds a problem records it and picks up again where it
+     * can. Once the error limit is reached the collector is full and the run
+     * should stop.
+     *
+     * Nothing is thrown, so the success path costs nothing beyond checking
+     * a return value.
+     */
+    class Diagnostics {
+    public:
+        static constexpr size_t DEFAULT_ERROR_LIMIT = 20;
+
+        /* An error limit of 0 means there is none */
+        explicit Diagnostics(size_t errorLimit = DEFAULT_ERROR_LIMIT);
+
+        void error(std::string message, size_t offset = ParseException::NO_OFFSET, uint16_t file = 0);
+        void warning(std::string message, size_t offset = ParseException::NO_OFFSET, uint16_t file = 0);
+
+        /*
+         * Records the errors of another run, like the parse of an included file.
+         * Those of its own source are moved to file. Its warnings are dropped.
+         */
+        void add_errors(const Diagnostics& other, uint16_t file);
+
+        /*
+         * Locates every diagnostic of file 0 as it is recorded, for sources
+         * like a stream window whose offsets can't be looked up once the run
+         * is over.
+         */
+        void set_locator(std::function<SourceLocation(size_t)> locate) { _locate = std::move(locate); }
+
+        /* Forgets what was recorded, keeping the limit and the locator */
+        void clear();
+
+        bool ok() const { return _errors == 0; }
+        bool full() const { return _errorLimit != 0 && _errors >= _errorLimit; }
+        size_t errors() const { return _errors; }
+        size_t warnings() const { return _all.size() - _errors; }
+        size_t error_limit() const { return _errorLimit; }
+        /* Errors and warnings in the order they were found */
+        const std::vector<Diagnostic>& all() const { return _all; }
+
+        /* The first error as an exception, for callers that report errors by throwing */
+        ParseException first_error() const;
+
+    private:
+        size_t _errorLimit;
+        size_t _errors;
+        std::vector<Diagnostic> _all;
+        std::function<SourceLocation(size_t)> _locate;
+
+        void add(Severity severity, std::string message, size_t offset, uint16_t file);
+    };
+
+    /* What a run made of its input along with what went wrong. The value is only usable if ok(). */
+    template <typename T>
+    struct Result {
+        T value;
+        Diagnostics diagnostics;
+
+        bool ok() const { return diagnostics.ok(); }
+    };
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace c8 {
+    /*
+     * Assembler directives. They start with a '.' and tell the assembler what
+     * to do rather than encode anything. EQU is the exception, as it goes
+     * between a name and its value.
+     */
+    enum class Directive : uint8_t {
+        INCLUDE, /* .include "file" splices in the statements of another file */
+        MACRO,   /* .macro name a, b starts a macro definition              */
+        ENDM,    /* .endm ends it                                           */
+        REPT,    /* .rept $N repeats the statements up to the next .endr    */
+        ENDR,    /* .endr ends it                                           */
+        DEFINE,  /* .define NAME value defines a constant                   */
+        EQU,     /* NAME EQU value does the same                            */
+        COUNT
+    };
+
+    constexpr size_t DIRECTIVE_COUNT = static_cast<size_t>(Directive::COUNT);
+
+    constexpr std::array<std::string_view, DIRECTIVE_COUNT> DIRECTIVES = {{
+        ".include", ".macro", ".endm", ".rept", ".endr", ".define", "EQU"
+    }};
+
+    /* Classifies a whole word. Returns Directive::COUNT if the word is not a directive. */
+    constexpr Directive find_directive(std::string_view word)
+    {
+        if (word.empty() || (word[0] != '.' && word != "EQU")) {
+            return Directive::COUNT;
+        }
+        for (size_t i = 0; i < DIRECTIVE_COUNT; ++i) {
+            if (DIRECTIVES[i] == word) {
+                return static_cast<Directive>(i);
+            }
+        }
+        return Directive::COUNT;
+    }
+
+    constexpr std::string_view directive_name(Directive directive)
+    {
+        return DIRECTIVES[static_cast<size_t>(directive)];
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Lexer.h"
+#include "Parser.h"
+
+namespace c8 {
+    /*
+     * A source that is kept lexed and parsed while it is edited, for editors
+     * that check the code on every keystroke.
+     *
+     * An edit only lexes the lines it touches again. Parsing restarts at the
+     * statement the edit is in and stops as soon as the parser is back in
+     * step with the statements that were there before. Addresses, offsets and
+     * label fixups are then only updated from that point on, plus the
+     * statements that refer to a label that moved.
+     *
+     * When an edit doesn't parse the text and tokens still take it and the
+     * next edit parses the whole source again. So does every edit of a
+     * source with directives, as a macro or a constant makes a statement
+     * depend on everything before it, and of a source that folds the address
+     * of a label into an operand, which changes whenever the label moves.
+     */
+    class Document {
+    public:
+        explicit Document(std::string text);
+
+        /* The tokens view the document's own text */
+        Document(const Document&) = delete;
+        Document& operator=(const Document&) = delete;
+
+        /* Replaces length bytes at offset with text */
+        void edit(size_t offset, size_t length, std::string_view text);
+
+        const std::string& text() const { return _text; }
+        const TokenBuffer& tokens() const { return _tokens; }
+        /* The same records Parser::parse() gives for the text */
+        const std::vector<Ir>& code() const { return _code; }
+        /* The debug view of the code */
+        std::vector<Statement> statements() const;
+        /* Every label defined or referred to. Names stay interned after their label is deleted. */
+        const SymbolTable& symbols() const { return _symbols; }
+
+    private:
+        struct LabelDef {
+            size_t token;
+            SymbolId symbol;
+        };
+
+        std::string _text;
+        TokenBuffer _tokens;
+        std::vector<Ir> _code;
+        /* The token each statement starts at */
+        std::vector<size_t> _firsts;
+        SymbolTable _symbols;
+        /* Where each label is defined, in source order */
+        std::vector<LabelDef> _defs;
+        /* The statements with a label operand, in source order */
+        std::vector<size_t> _refs;
+        bool _stale;
+        /* The number of directive tokens, kept up to date with the tokens so an edit doesn't look through all of them */
+        size_t _directives;
+        /* Whether the last whole parse folded a label's address into an operand */
+        bool _foldsLabels;
+
+        void parse_whole();
+        void reparse(size_t first, size_t last, ptrdiff_t tokenShift, ptrdiff_t byteShift);
+    };
+}
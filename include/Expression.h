@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace c8 {
+    /* The operators and brackets of constant expressions */
+    enum class ArithOp : uint8_t {
+        ADD, SUB, MUL, DIV, MOD, SHL, SHR, AND, OR, XOR,
+        NOT,   /* Only unary, like '-' can also be */
+        OPEN,
+        CLOSE,
+        COUNT
+    };
+
+    constexpr size_t ARITH_OP_COUNT = static_cast<size_t>(ArithOp::COUNT);
+
+    constexpr std::array<std::string_view, ARITH_OP_COUNT> ARITH_OPS = {{
+        "+", "-", "*", "/", "%", "<<", ">>", "&", "|", "^", "~", "(", ")"
+    }};
+
+    /* Classifies the text of an operator. Returns ArithOp::COUNT if it is not one. */
+    constexpr ArithOp find_arith_op(std::string_view text)
+    {
+        for (size_t i = 0; i < ARITH_OP_COUNT; ++i) {
+            if (ARITH_OPS[i] == text) {
+                return static_cast<ArithOp>(i);
+            }
+        }
+        return ArithOp::COUNT;
+    }
+
+    constexpr std::string_view arith_op_name(ArithOp op)
+    {
+        return ARITH_OPS[static_cast<size_t>(op)];
+    }
+
+    /*
+     * How tightly a binary operator binds, as in C: * / % before + - before
+     * the shifts before & before ^ before |. 0 for the ones that aren't binary.
+     */
+    constexpr unsigned binary_precedence(ArithOp op)
+    {
+        switch (op) {
+        case ArithOp::MUL: case ArithOp::DIV: case ArithOp::MOD:
+            return 6;
+        case ArithOp::ADD: case ArithOp::SUB:
+            return 5;
+        case ArithOp::SHL: case ArithOp::SHR:
+            return 4;
+        case ArithOp::AND:
+            return 3;
+        case ArithOp::XOR:
+            return 2;
+        case ArithOp::OR:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    /*
+     * Applies a binary operator. Values are 32 bit and wrap around; the
+     * caller rules out dividing by 0 and shifting by anything but 0 to 31.
+     */
+    constexpr int32_t apply(ArithOp op, int32_t a, int32_t b)
+    {
+        const auto ua = static_cast<uint32_t>(a);
+        const auto ub = static_cast<uint32_t>(b);
+        switch (op) {
+        case ArithOp::ADD: return static_cast<int32_t>(ua + ub);
+        case ArithOp::SUB: return static_cast<int32_t>(ua - ub);
+        case ArithOp::MUL: return static_cast<int32_t>(ua * ub);
+        /* INT32_MIN / -1 is the only quotient that doesn't fit */
+        case ArithOp::DIV: return b == -1 ? static_cast<int32_t>(0u - ua) : a / b;
+        case ArithOp::MOD: return b == -1 ? 0 : a % b;
+        case ArithOp::SHL: return static_cast<int32_t>(ua << b);
+        case ArithOp::SHR: return a >> b;
+        case ArithOp::AND: return a & b;
+        case ArithOp::OR:  return a | b;
+        case ArithOp::XOR: return a ^ b;
+        default:           return 0;
+        }
+    }
+
+    static_assert(find_arith_op("<<") == ArithOp::SHL && find_arith_op("=") == ArithOp::COUNT,
+        "ARITH_OPS is out of step with the ArithOp enum.");
+    static_assert(apply(ArithOp::SUB, 2, 5) == -3 && apply(ArithOp::SHR, 0x1234, 8) == 0x12 && apply(ArithOp::DIV, -7, 2) == -3,
+        "Expressions work like C integers.");
+    static_assert(binary_precedence(ArithOp::MUL) > binary_precedence(ArithOp::ADD)
+        && binary_precedence(ArithOp::ADD) > binary_precedence(ArithOp::SHL) && binary_precedence(ArithOp::NOT) == 0,
+        "* binds tighter than + binds tighter than <<.");
+}
@@ -3,15 +3,50 @@
 #include "Parser.h"
 
 namespace c8 {
+    /* An encoded record. The opcode is stored as its big endian bytes read in host order, in the low half unless it takes 4. */
     struct Instruction {
-        Statement stmt;
-        uint16_t op;
+        /* The record in the program's code */
+        uint32_t index;
+        uint32_t op;
+        /* The bytes it takes up in the ROM */
+        uint8_t size;
 
-        Instruction(Statement stmt, uint16_t op);
+        Instruction(uint32_t index, uint32_t op, uint8_t size);
 
-        std::string toString() const;
+        /* The listing line of the instruction, given the program it was generated from */
+        std::string toString(const Program& program) const;
     };
 
-    std::vector<Instruction> generateInstructions(const std::vector<Statement>& statements);
+    std::vector<Instruction> generateInstructions(const std::vector<Ir>& code);
+
+    /*
+     * The ROM image of records whose label operands are resolved, written
+     * straight into a buffer of the right size. The records must have been
+     * parsed for target, whose instructions are the only ones it encodes.
+     */
+    std::vector<uint8_t> generate(const std::vector<Ir>& code, Target target = Target::CHIP8);
+    /* The listing of a whole program, a line per record. Only the listing needs the debug view of the records. */
+    std::string listing(const Program& program);
+
+    /* The opcode of a record whose label operand, if any, is resolved. LB gives its byte in the low byte and LLOAD all 4. */
+    uint32_t encode(const Ir& ir);
+    /* Appends an opcode from encode() to a ROM image */
+    void emit(std::vector<uint8_t>& rom, const Ir& ir, uint32_t op);
+
+    /*
+     * Parses and encodes in one pass, giving the ROM image.
+     *
+     * Each statement is encoded as soon as it is parsed and then dropped. A
+     * jump to a label that isn't defined yet is written with a zero address
+     * and queued on the label. The queue is patched when the label turns up,
+     * so no statement is ever looked at twice.
+     *
+     * Errors are recorded in the result's diagnostics. The image is only
+     * usable if there were none. This is AssemblerContext::assemble() with a
+     * context of its own.
+     */
+    Result<std::vector<uint8_t>> assemble(Parser& parser, Diagnostics diagnostics = Diagnostics());
+    /* The ROM image of already generated instructions */
+    std::vector<uint8_t> toRom(const std::vector<Instruction>& instructions);
 
 }
\ No newline at end of file
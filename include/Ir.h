@@ -0,0 +1,126 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "Isa.h"
+#include "SymbolTable.h"
+
+namespace c8 {
+    /*
+     * One parsed instruction. Records are trivially copyable and sit back to
+     * back in a single vector, so nothing per statement lives on the heap.
+     * Names are kept as symbol ids and the text of the operands is left in
+     * the source.
+     */
+    struct Ir {
+        /* Where the mnemonic is in the source */
+        uint32_t offset;
+        /* The label operand or NO_SYMBOL. It may be written label + offset, with the offset in operands[1]. */
+        SymbolId symbol;
+        /* The label the instruction falls under or NO_SYMBOL */
+        SymbolId label;
+        uint16_t addr;
+        /* Register indices, immediates and resolved addresses in source order */
+        std::array<uint16_t, 3> operands;
+        Op op;
+        /* Whether the statement came from a macro or .rept, so its operands as written may be parameters */
+        bool expanded;
+        /* The file the statement is in: 0 for the source itself, then the included files from 1 */
+        uint16_t file;
+    };
+
+    static_assert(std::is_trivially_copyable<Ir>::value, "Ir records are copied around as plain bytes.");
+    static_assert(sizeof(Ir) <= 24, "Ir records should stay small.");
+
+    namespace detail {
+        constexpr bool label_operands_stand_alone()
+        {
+            for (const auto& spec : SPECS) {
+                if (spec.takes_label && spec.arity > 1) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+
+    static_assert(detail::label_operands_stand_alone(), "The offset of a label operand is kept in the operand after it.");
+
+    /*
+     * The value of a record's label operand once its label is known to be at
+     * address. The offset is signed, so the value may be below zero or more
+     * than any operand holds until out_of_reach() says otherwise.
+     */
+    constexpr int32_t label_operand(const Ir& ir, uint16_t address)
+    {
+        return address + static_cast<int16_t>(ir.operands[1]);
+    }
+
+    /* Whether the value of a label operand is below zero or more than the operand can hold, which would spill into the opcode */
+    constexpr bool out_of_reach(Op op, int32_t operand)
+    {
+        return operand < 0 || operand > operand_max(spec(op).operands[0]);
+    }
+
+    /* The error for a label written with offset, which puts it at operand where op can't reach */
+    std::string out_of_reach_message(std::string_view label, uint16_t offset, int32_t operand, Op op);
+
+    /*
+     * A readable view of an Ir record for debugging, listings and tests.
+     * It costs a few allocations per statement so the assembler itself
+     * never builds one unless asked to.
+     */
+    struct Statement {
+        std::string label, op;
+        std::vector<std::string> args;
+        /* The decoded args with labels replaced by their address */
+        std::array<uint16_t, 3> operands;
+        uint16_t addr;
+        /* Where the operator is in the source */
+        size_t offset;
+        /* The label operand, if there is one */
+        SymbolId symbol;
+
+        Statement(const std::string& label, const std::string& op,
+            const std::vector<std::string>& args, const std::array<uint16_t, 3>& operands, uint16_t addr, size_t offset = 0,
+            SymbolId symbol = NO_SYMBOL) :
+            label(label), op(op), args(args), operands(operands), addr(addr), offset(offset), symbol(symbol)
+        {}
+    };
+
+    /*
+     * What the parser makes of a source. The symbols may be views into the
+     * source, which must then outlive the program. source is empty if the
+     * program was parsed from a stream.
+     *
+     * includes holds the text of every file a record's file can refer to,
+     * file 1 first. The texts belong to the ModuleCache that read them.
+     */
+    struct Program {
+        std::vector<Ir> code;
+        SymbolTable symbols;
+        std::string_view source;
+        std::vector<std::string_view> includes;
+        /* Whether a label's address was folded into some value, which would go stale if the code moved */
+        bool folds_labels = false;
+
+        /* The text of a record's file */
+        std::string_view text(uint16_t file) const { return file == 0 ? source : includes[file - 1]; }
+
+        /*
+         * The debug view of a record. The args are the operands as they were
+         * written, or as R1 and $1F when there is no source to take them from
+         * or the record came from a macro, with label operands given as their
+         * address.
+         */
+        Statement statement(const Ir& ir) const;
+        std::vector<Statement> statements() const;
+    };
+
+    /* The debug view of a record whose names are in symbols and whose text, if any, is in source */
+    Statement make_statement(const Ir& ir, const SymbolTable& symbols, std::string_view source);
+}
@@ -0,0 +1,386 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+namespace c8 {
+    /*
+     * Every mnemonic the assembler understands, in the order of opcodes.h.
+     * Each target adds to the one before it, so the instructions of a target
+     * are the ones before its last.
+     */
+    enum class Op : uint8_t {
+        SYS, CLR, RET, JMP, CALL, SKE, SKNE, SKRE, LOAD, ADD, ASN, OR,
+        AND, XOR, RADD, SUB, SHR, RSUB, SHL, SKRNE, ILOAD, ZJMP, RAND, DRAW,
+        SKK, SKNK, DELA, KEYW, DELR, SNDR, IADD, SILS, BCD, DUMP, IDUMP, LB,
+        /* SUPER-CHIP */
+        SCD, SCR, SCL, EXIT, LOW, HIGH, HSILS, RSAVE, RLOAD,
+        /* XO-CHIP */
+        SCU, SAVE, REST, LLOAD, PLANE, AUDIO, PITCH,
+        COUNT /* Not an operator. Also returned when a lookup fails. */
+    };
+
+    constexpr size_t OP_COUNT = static_cast<size_t>(Op::COUNT);
+
+    constexpr std::array<std::string_view, OP_COUNT> MNEMONICS = {{
+        "SYS", "CLR", "RET", "JMP", "CALL", "SKE", "SKNE", "SKRE", "LOAD", "ADD", "ASN", "OR",
+        "AND", "XOR", "RADD", "SUB", "SHR", "RSUB", "SHL", "SKRNE", "ILOAD", "ZJMP", "RAND", "DRAW",
+        "SKK", "SKNK", "DELA", "KEYW", "DELR", "SNDR", "IADD", "SILS", "BCD", "DUMP", "IDUMP", "LB",
+        "SCD", "SCR", "SCL", "EXIT", "LOW", "HIGH", "HSILS", "RSAVE", "RLOAD",
+        "SCU", "SAVE", "REST", "LLOAD", "PLANE", "AUDIO", "PITCH"
+    }};
+
+    namespace detail {
+        /*
+         * Mnemonics are at most 5 characters so a whole word fits in a 64 bit key.
+         * Multiplying the key by a constant and keeping the top bits gives a
+         * collision free slot for each of the mnemonics. The multiplier was found
+         * by a brute force search and the static_assert below keeps it honest if
+         * the mnemonic list ever changes.
+         */
+        constexpr size_t MAX_MNEMONIC_LENGTH = 5;
+        constexpr uint64_t MNEMONIC_HASH_MULTIPLIER = 0x453DA95B772A72AFull;
+        constexpr unsigned MNEMONIC_HASH_BITS = 7;
+        constexpr size_t MNEMONIC_TABLE_SIZE = size_t(1) << MNEMONIC_HASH_BITS;
+        constexpr uint8_t EMPTY_SLOT = 0xFF;
+
+        constexpr uint64_t pack_mnemonic(std::string_view s)
+        {
+            uint64_t key = 0;
+            for (size_t i = 0; i < s.size(); ++i) {
+                key |= static_cast<uint64_t>(static_cast<unsigned char>(s[i])) << (8 * i);
+            }
+            return key;
+        }
+
+        constexpr size_t hash_mnemonic(std::string_view s)
+        {
+            return static_cast<size_t>((pack_mnemonic(s) * MNEMONIC_HASH_MULTIPLIER) >> (64 - MNEMONIC_HASH_BITS));
+        }
+
+        constexpr std::array<uint8_t, MNEMONIC_TABLE_SIZE> make_mnemonic_table()
+        {
+            std::array<uint8_t, MNEMONIC_TABLE_SIZE> table{};
+            for (auto& slot : table) {
+                slot = EMPTY_SLOT;
+            }
+            for (size_t i = 0; i < MNEMONICS.size(); ++i) {
+                table[hash_mnemonic(MNEMONICS[i])] = static_cast<uint8_t>(i);
+            }
+            return table;
+        }
+
+        constexpr bool mnemonic_table_is_perfect()
+        {
+            std::array<bool, MNEMONIC_TABLE_SIZE> used{};
+            for (const auto m : MNEMONICS) {
+                if (m.size() > MAX_MNEMONIC_LENGTH || used[hash_mnemonic(m)]) {
+                    return false;
+                }
+                used[hash_mnemonic(m)] = true;
+            }
+            return true;
+        }
+
+        constexpr std::array<uint8_t, MNEMONIC_TABLE_SIZE> MNEMONIC_TABLE = make_mnemonic_table();
+    }
+
+    static_assert(detail::mnemonic_table_is_perfect(), "The mnemonic hash has collisions! Pick a new multiplier.");
+
+    /* Classifies a whole word. Returns Op::COUNT if the word is not a mnemonic. */
+    constexpr Op find_mnemonic(std::string_view word)
+    {
+        if (word.empty() || word.size() > detail::MAX_MNEMONIC_LENGTH) {
+            return Op::COUNT;
+        }
+        const uint8_t slot = detail::MNEMONIC_TABLE[detail::hash_mnemonic(word)];
+        if (slot == detail::EMPTY_SLOT || MNEMONICS[slot] != word) {
+            return Op::COUNT;
+        }
+        return static_cast<Op>(slot);
+    }
+
+    constexpr std::string_view mnemonic(Op op)
+    {
+        return MNEMONICS[static_cast<size_t>(op)];
+    }
+
+    /* What each operand of an instruction has to be */
+    enum class Operand : uint8_t {
+        NONE,
+        REGISTER, /* r0 - rF                   */
+        BYTE,     /* A hex value up to $FF     */
+        NIBBLE,   /* A hex value up to $F      */
+        ADDRESS,  /* A label or hex up to $FFF */
+        LONG      /* A label or hex up to $FFFF */
+    };
+
+    /* The largest value a hex operand of each kind can hold, 0 for the others */
+    constexpr uint16_t operand_max(Operand kind)
+    {
+        switch (kind) {
+        case Operand::BYTE: return 0xFF;
+        case Operand::NIBBLE: return 0xF;
+        case Operand::ADDRESS: return 0xFFF;
+        case Operand::LONG: return 0xFFFF;
+        default: return 0;
+        }
+    }
+
+    /* Whether an operand can be a label, which is replaced by its address */
+    constexpr bool is_address(Operand kind)
+    {
+        return kind == Operand::ADDRESS || kind == Operand::LONG;
+    }
+
+    /*
+     * The operands of an instruction, in source order. The operands are
+     * register indices, immediates and resolved addresses.
+     */
+    using Operands = std::array<uint16_t, 3>;
+
+    struct InstructionSpec {
+        std::array<Operand, 3> operands;
+        /* Where each operand goes in the opcode, as a left shift */
+        std::array<uint8_t, 3> shifts;
+        /* The opcode with every operand field 0, in the low size bytes */
+        uint32_t pattern;
+        /* The number of operands, which are separated by commas */
+        uint8_t arity;
+        /* The bytes the instruction takes up in the ROM. 0 for the ones that are parsed but not assembled. */
+        uint8_t size;
+        /* Whether the first operand may be a label that is replaced by its address */
+        bool takes_label;
+    };
+
+    namespace detail {
+        constexpr int hex_digit(char c)
+        {
+            return c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        }
+
+        /*
+         * Builds a spec from an opcode written as in the README, a nibble per
+         * character: hex digits are fixed, X and Y are registers and a run of
+         * N is a value whose kind follows from its length, up to the 4 of a
+         * 16 bit address. Operands are in the order they are written. Anything
+         * else makes the spec fail to compile.
+         */
+        constexpr InstructionSpec make_spec(uint8_t size, std::string_view opcode)
+        {
+            InstructionSpec spec{ { { Operand::NONE, Operand::NONE, Operand::NONE } }, {}, 0, 0, size, false };
+            for (size_t i = 0; i < opcode.size();) {
+                const auto shift = static_cast<uint8_t>(4 * (opcode.size() - 1 - i));
+                const char c = opcode[i];
+                if (hex_digit(c) >= 0) {
+                    spec.pattern |= static_cast<uint32_t>(hex_digit(c)) << shift;
+                    ++i;
+                    continue;
+                }
+                size_t length = 1;
+                Operand kind = Operand::REGISTER;
+                if (c == 'N') {
+                    while (i + length < opcode.size() && opcode[i + length] == 'N') {
+                        ++length;
+                    }
+                    kind = length == 1 ? Operand::NIBBLE : length == 2 ? Operand::BYTE : length == 3 ? Operand::ADDRESS : Operand::LONG;
+                } else if (c != 'X' && c != 'Y') {
+                    throw "Opcodes are written with hex digits, X, Y and N.";
+                }
+                spec.operands[spec.arity] = kind;
+                spec.shifts[spec.arity] = static_cast<uint8_t>(shift - 4 * (length - 1));
+                ++spec.arity;
+                i += length;
+            }
+            spec.takes_label = is_address(spec.operands[0]);
+            return spec;
+        }
+    }
+
+    /*
+     * The encoding, operands and size of every instruction, indexed by Op.
+     * SYS is not assembled, so it is written without its operand.
+     */
+    constexpr std::array<InstructionSpec, OP_COUNT> SPECS = {{
+        /* SYS   */ detail::make_spec(0, "0000"),
+        /* CLR   */ detail::make_spec(2, "00E0"),
+        /* RET   */ detail::make_spec(2, "00EE"),
+        /* JMP   */ detail::make_spec(2, "1NNN"),
+        /* CALL  */ detail::make_spec(2, "2NNN"),
+        /* SKE   */ detail::make_spec(2, "3XNN"),
+        /* SKNE  */ detail::make_spec(2, "4XNN"),
+        /* SKRE  */ detail::make_spec(2, "5XY0"),
+        /* LOAD  */ detail::make_spec(2, "6XNN"),
+        /* ADD   */ detail::make_spec(2, "7XNN"),
+        /* ASN   */ detail::make_spec(2, "8XY0"),
+        /* OR    */ detail::make_spec(2, "8XY1"),
+        /* AND   */ detail::make_spec(2, "8XY2"),
+        /* XOR   */ detail::make_spec(2, "8XY3"),
+        /* RADD  */ detail::make_spec(2, "8XY4"),
+        /* SUB   */ detail::make_spec(2, "8XY5"),
+        /* SHR   */ detail::make_spec(2, "8X06"),
+        /* RSUB  */ detail::make_spec(2, "8XY7"),
+        /* SHL   */ detail::make_spec(2, "8X0E"),
+        /* SKRNE */ detail::make_spec(2, "9XY0"),
+        /* ILOAD */ detail::make_spec(2, "ANNN"),
+        /* ZJMP  */ detail::make_spec(2, "BNNN"),
+        /* RAND  */ detail::make_spec(2, "CXNN"),
+        /* DRAW  */ detail::make_spec(2, "DXYN"),
+        /* SKK   */ detail::make_spec(2, "EX9E"),
+        /* SKNK  */ detail::make_spec(2, "EXA1"),
+        /* DELA  */ detail::make_spec(2, "FX07"),
+        /* KEYW  */ detail::make_spec(2, "FX0A"),
+        /* DELR  */ detail::make_spec(2, "FX15"),
+        /* SNDR  */ detail::make_spec(2, "FX18"),
+        /* IADD  */ detail::make_spec(2, "FX1E"),
+        /* SILS  */ detail::make_spec(2, "FX29"),
+        /* BCD   */ detail::make_spec(2, "FX33"),
+        /* DUMP  */ detail::make_spec(2, "FX55"),
+        /* IDUMP */ detail::make_spec(2, "FX65"),
+        /* LB    */ detail::make_spec(1, "NN"),
+        /* SCD   */ detail::make_spec(2, "00CN"),
+        /* SCR   */ detail::make_spec(2, "00FB"),
+        /* SCL   */ detail::make_spec(2, "00FC"),
+        /* EXIT  */ detail::make_spec(2, "00FD"),
+        /* LOW   */ detail::make_spec(2, "00FE"),
+        /* HIGH  */ detail::make_spec(2, "00FF"),
+        /* HSILS */ detail::make_spec(2, "FX30"),
+        /* RSAVE */ detail::make_spec(2, "FX75"),
+        /* RLOAD */ detail::make_spec(2, "FX85"),
+        /* SCU   */ detail::make_spec(2, "00DN"),
+        /* SAVE  */ detail::make_spec(2, "5XY2"),
+        /* REST  */ detail::make_spec(2, "5XY3"),
+        /* LLOAD */ detail::make_spec(4, "F000NNNN"),
+        /* PLANE */ detail::make_spec(2, "FN01"),
+        /* AUDIO */ detail::make_spec(2, "F002"),
+        /* PITCH */ detail::make_spec(2, "FX3A")
+    }};
+
+    constexpr const InstructionSpec& spec(Op op)
+    {
+        return SPECS[static_cast<size_t>(op)];
+    }
+
+    /* Puts the operands into the fields of the opcode. The parser has already checked that they fit. */
+    constexpr uint32_t encode(const InstructionSpec& spec, const Operands& args)
+    {
+        uint32_t op = spec.pattern;
+        for (size_t i = 0; i < spec.arity; ++i) {
+            op |= static_cast<uint32_t>(args[i]) << spec.shifts[i];
+        }
+        return op;
+    }
+
+    /* The encoder of one instruction. The spec is a constant, so this comes down to a few shifts and ORs. */
+    template <Op op>
+    constexpr uint32_t encoder(const Operands& args)
+    {
+        return encode(spec(op), args);
+    }
+
+    static_assert(spec(Op::LB).size == 1 && spec(Op::SYS).size == 0, "Only LB is a single byte and only SYS is skipped.");
+    static_assert(spec(Op::DRAW).arity == 3 && spec(Op::JMP).takes_label && !spec(Op::LOAD).takes_label,
+        "SPECS is out of step with the Op enum.");
+    static_assert(spec(Op::DRAW).shifts[0] == 8 && spec(Op::DRAW).shifts[1] == 4 && spec(Op::DRAW).shifts[2] == 0 && spec(Op::SHR).pattern == 0x8006
+        && spec(Op::RAND).operands[1] == Operand::BYTE, "Opcodes are split into fields as written.");
+    static_assert(spec(Op::LLOAD).pattern == 0xF0000000 && spec(Op::LLOAD).operands[0] == Operand::LONG && spec(Op::LLOAD).takes_label
+        && spec(Op::PLANE).shifts[0] == 8 && spec(Op::PLANE).operands[0] == Operand::NIBBLE, "Opcodes are split into fields as written.");
+
+    /* The machines a ROM can be assembled for. Each one runs everything the one before it does. */
+    enum class Target : uint8_t {
+        CHIP8,
+        SCHIP,  /* SUPER-CHIP 1.1   */
+        XOCHIP, /* XO-CHIP          */
+        COUNT
+    };
+
+    /*
+     * What a target has: its instructions, the last address of its memory
+     * and the longest instruction, so that code specialized for a target
+     * leaves out whatever the target doesn't need.
+     */
+    template <Target T>
+    struct TargetIsa;
+
+    template <>
+    struct TargetIsa<Target::CHIP8> {
+        static constexpr std::string_view NAME = "chip8";
+        static constexpr std::string_view TITLE = "chip 8";
+        static constexpr size_t OP_COUNT = static_cast<size_t>(Op::LB) + 1;
+        static constexpr uint16_t MEMORY_END = 0x0FFF;
+        static constexpr uint8_t MAX_SIZE = 2;
+    };
+
+    template <>
+    struct TargetIsa<Target::SCHIP> {
+        static constexpr std::string_view NAME = "schip";
+        static constexpr std::string_view TITLE = "SUPER-CHIP";
+        static constexpr size_t OP_COUNT = static_cast<size_t>(Op::RLOAD) + 1;
+        static constexpr uint16_t MEMORY_END = 0x0FFF;
+        static constexpr uint8_t MAX_SIZE = 2;
+    };
+
+    template <>
+    struct TargetIsa<Target::XOCHIP> {
+        static constexpr std::string_view NAME = "xochip";
+        static constexpr std::string_view TITLE = "XO-CHIP";
+        static constexpr size_t OP_COUNT = c8::OP_COUNT;
+        static constexpr uint16_t MEMORY_END = 0xFFFF;
+        static constexpr uint8_t MAX_SIZE = 4;
+    };
+
+    /* A target's TargetIsa, for code that only knows the target at run time */
+    struct TargetSpec {
+        std::string_view name;
+        std::string_view title;
+        size_t op_count;
+        uint16_t memory_end;
+    };
+
+    namespace detail {
+        template <Target T>
+        constexpr TargetSpec make_target_spec()
+        {
+            return { TargetIsa<T>::NAME, TargetIsa<T>::TITLE, TargetIsa<T>::OP_COUNT, TargetIsa<T>::MEMORY_END };
+        }
+    }
+
+    constexpr size_t TARGET_COUNT = static_cast<size_t>(Target::COUNT);
+
+    constexpr std::array<TargetSpec, TARGET_COUNT> TARGETS = {{
+        detail::make_target_spec<Target::CHIP8>(),
+        detail::make_target_spec<Target::SCHIP>(),
+        detail::make_target_spec<Target::XOCHIP>()
+    }};
+
+    constexpr const TargetSpec& target_spec(Target target)
+    {
+        return TARGETS[static_cast<size_t>(target)];
+    }
+
+    /* Returns Target::COUNT if there is no target of that name */
+    constexpr Target find_target(std::string_view name)
+    {
+        for (size_t i = 0; i < TARGET_COUNT; ++i) {
+            if (TARGETS[i].name == name) {
+                return static_cast<Target>(i);
+            }
+        }
+        return Target::COUNT;
+    }
+
+    /* The first target with an instruction */
+    constexpr Target first_target(Op op)
+    {
+        size_t i = 0;
+        while (i + 1 < TARGET_COUNT && TARGETS[i].op_count <= static_cast<size_t>(op)) {
+            ++i;
+        }
+        return static_cast<Target>(i);
+    }
+
+    static_assert(first_target(Op::LB) == Target::CHIP8 && first_target(Op::SCD) == Target::SCHIP && first_target(Op::PITCH) == Target::XOCHIP,
+        "Every target adds to the one before it.");
+}
@@ -1,34 +1,204 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "LineIndex.h"
 
 namespace c8 {
     enum class TokenType {
         OPERATOR, /* One of the recognized operators                 */
         LABEL,    /* A label                                         */
-        HEX,      /* Hexadecimal value starting with '$'             */
+        HEX,      /* Hexadecimal value starting with '$' or decimal  */
         REGISTER, /* Register starting with 'r' (case - insensitive) */
         COMMA,    /* A comma ','                                     */
+        DIRECTIVE,/* One of the directives starting with '.'         */
+        STRING,   /* Text in double quotes on a single line          */
+        ARITHMETIC,/* An operator or bracket of an expression        */
         UNKNOWN
     };
 
+    /*
+     * A token is a view into the buffer the lexer was constructed with
+     * so it is only valid as long as that buffer is alive.
+     *
+     * The lexer decodes the value of a token once so nothing downstream has
+     * to look at the text again: the Op of an OPERATOR, the Directive of a
+     * DIRECTIVE, the ArithOp of an ARITHMETIC, the number of a HEX and the
+     * index of a REGISTER. A STRING keeps its quotes.
+     *
+     * Tokens only know their byte offset in the input. Lines and columns are
+     * worked out from it with a LineIndex when a diagnostic needs them.
+     */
     struct Token {
         TokenType _type;
-        std::string _str;
-        Token(TokenType type, const std::string& str)
-            : _type(type), _str(str) {}
+        std::string_view _str;
+        uint16_t _value;
+        size_t _offset;
+        Token(TokenType type, std::string_view str, uint16_t value = 0, size_t offset = 0)
+            : _type(type), _str(str), _value(value), _offset(offset) {}
         Token()
             : Token(TokenType::UNKNOWN, "") {}
     };
 
+    /*
+     * The whole input tokenized up front and stored column by column so the
+     * parser walks contiguous arrays by index. The source must outlive the buffer.
+     *
+     * values holds each Token::_value.
+     */
+    struct TokenBuffer {
+        std::string_view source;
+        std::vector<TokenType> types;
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> lengths;
+        std::vector<uint16_t> values;
+
+        size_t size() const { return types.size(); }
+
+        /* Out of range indices give the empty end of input token */
+        Token token(size_t i) const
+        {
+            if (i >= size()) {
+                return { TokenType::LABEL, source.substr(source.size()), 0, source.size() };
+            }
+            return { types[i], source.substr(offsets[i], lengths[i]), values[i], offsets[i] };
+        }
+
+        void clear();
+        void reserve(size_t n);
+        void push_back(const Token& tok);
+        /* Appends tokens of the same source */
+        void append(const TokenBuffer& other);
+        /*
+         * Replaces the tokens [first, last) with those of another buffer of the
+         * same source and moves the tokens after them by shift bytes.
+         */
+        void splice(size_t first, size_t last, const TokenBuffer& with, ptrdiff_t shift);
+    };
+
+    /*
+     * A fixed size window over a stream that can't be seeked, like stdin, a
+     * pipe or a FIFO. Consumed bytes are dropped from the front of the window
+     * and the rest is moved down to make room for more input, so memory use
+     * does not depend on how long the stream is. Moving them changes what
+     * any view into the window sees.
+     */
+    class StreamBuffer {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+        explicit StreamBuffer(std::FILE* fp, size_t capacity = DEFAULT_CAPACITY);
+
+        /* The bytes read from the stream that haven't been dropped yet */
+        std::string_view window() const { return { _data.data(), _size }; }
+        /* The offset in the stream of the first byte of the window */
+        size_t dropped() const { return _dropped; }
+        size_t capacity() const { return _data.size(); }
+
+        /*
+         * The line and column of an offset that is still in the window or was
+         * remembered before it was dropped. Only the newlines of dropped bytes
+         * are counted as they go; the window itself is only looked at here.
+         */
+        SourceLocation locate(size_t offset) const;
+        /* Keeps the location of an offset in the window for locate() once it is dropped. The last few are kept. */
+        void remember(size_t offset);
+
+        /*
+         * Drops the first n bytes of the window and reads more input after
+         * what is left. Returns false if no more input could be read.
+         */
+        bool refill(size_t n);
+
+    private:
+        std::FILE* _fp;
+        std::vector<char> _data;
+        size_t _size;
+        size_t _dropped;
+        size_t _droppedLines;
+        size_t _droppedLineStart;
+        bool _eof;
+        std::array<std::pair<size_t, SourceLocation>, 8> _remembered;
+        size_t _rememberedNext;
+    };
+
+    /*
+     * The lexer does not own the source. The caller keeps the buffer alive
+     * for as long as the lexer and the tokens it hands out are in use, which
+     * makes copying a lexer as cheap as copying a pointer.
+     *
+     * A lexer over a StreamBuffer can only keep a window of the input, which
+     * moves under the tokens, so each token views a copy of its text instead.
+     * The copy stays valid for the next TOKEN_HISTORY - 1 calls to
+     * get_next_token(). That covers the longest statement the parser has to
+     * hold on to.
+     */
     class Lexer {
     public:
-        Lexer(const std::string& buf);
+        static constexpr size_t TOKEN_HISTORY = 8;
+
+        explicit Lexer(std::string_view buf);
+        /* Lexes buf from start on, which must not be inside a token or a comment */
+        Lexer(std::string_view buf, size_t start);
+        explicit Lexer(StreamBuffer& stream);
         Token get_next_token();
+        /* Skips to the end of the line the last token was on, to pick up after a bad statement */
+        void skip_line();
+        /* Whether the last token was the first on its line */
+        bool starts_line() const;
+        /* The same for the token before the last one, for a caller that has looked a token ahead */
+        bool previous_starts_line() const;
+
+        /* Tokenizes everything that is left in the input. Only for lexers over a buffer. */
+        TokenBuffer tokenize();
+        /* The same into a buffer that is emptied first, keeping its capacity */
+        void tokenize(TokenBuffer& tokens);
+
+        /*
+         * Tokenizes everything that is left in the input on up to the given
+         * number of threads, 0 meaning one per core. The input is cut into
+         * chunks at line boundaries and the result is identical to tokenize().
+         */
+        TokenBuffer tokenize(unsigned threads);
+
+        /* Whether the tokens only live as long as a stream window */
+        bool streaming() const { return _stream != nullptr; }
+        /* The whole input of a lexer over a buffer */
+        std::string_view source() const { return _buf; }
 
     private:
-        std::string _buf;
+        std::string_view _buf;
         size_t _cursor;
-        void skip_white_space();
+        StreamBuffer* _stream;
+        /* Stream offsets of the last tokens handed out, which stay in the window while they leave room to read more */
+        std::array<size_t, TOKEN_HISTORY> _recent;
+        size_t _recentNext;
+        /* The text of the last tokens of a stream, in the same order */
+        std::vector<std::string> _texts;
+        /* The input offsets of the end of the token before the last one and of the start of the last one, SIZE_MAX if there is none */
+        size_t _gapStart;
+        size_t _lastStart;
+        /* The same one token earlier */
+        size_t _prevGapStart;
+        size_t _prevStart;
+        /* For a stream, whether those gaps held a newline, as they may have been dropped by the time anyone asks */
+        bool _gapNewline;
+        bool _prevGapNewline;
+
+        Token lex_token();
+        void skip_white_space_and_comments();
+        Token get_string();
+        Token get_arithmetic();
+        bool line_gap(size_t gapStart, size_t start) const;
+        bool fill(size_t keep);
+        /* The input offset of the start of _buf */
+        size_t base_offset() const { return _stream ? _stream->dropped() : 0; }
+        void tokenize_into(TokenBuffer& tokens);
     };
-}
\ No newline at end of file
+}
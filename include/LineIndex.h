@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace c8 {
+    /* A 1 based line and column in the source. Line 0 means the position is unknown. */
+    struct SourceLocation {
+        size_t line;
+        size_t column;
+    };
+
+    /*
+     * The offset of the start of every line in a source. Tokens only carry byte
+     * offsets, so this is built only when a diagnostic needs a line and column
+     * and lexing and parsing never pay for it.
+     */
+    class LineIndex {
+    public:
+        explicit LineIndex(std::string_view source);
+
+        SourceLocation locate(size_t offset) const;
+
+        size_t line_count() const { return _starts.size(); }
+
+    private:
+        std::vector<size_t> _starts;
+    };
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "Arena.h"
+#include "Lexer.h"
+
+namespace c8 {
+    /*
+     * Tokens the parser reads again instead of the input, like the body of
+     * a macro. Offsets stay those of the file the tokens were written in.
+     */
+    struct TokenList {
+        std::vector<Token> tokens;
+        /* Whether each token is the first on its line, which is where a bad statement ends */
+        std::vector<uint8_t> lineStarts;
+        /* The file the tokens are from, as in Ir::file */
+        uint16_t file = 0;
+
+        size_t size() const { return tokens.size(); }
+        void push_back(const Token& tok, bool startsLine)
+        {
+            tokens.push_back(tok);
+            lineStarts.push_back(startsLine);
+        }
+    };
+
+    struct Macro {
+        std::string_view name;
+        std::vector<std::string_view> params;
+        TokenList body;
+    };
+
+    /*
+     * The macros of a source and their expansions. Every name and token is
+     * copied into the table's arena, as the tokens of a stream don't outlive
+     * its window.
+     *
+     * Expanding a macro substitutes its arguments for the parameters once per
+     * distinct tuple of arguments; expanding it again with the same ones
+     * hands back the same list. Repeated blocks are kept once per content.
+     */
+    class MacroTable {
+    public:
+        MacroTable() = default;
+
+        /* Tokens point into the arena */
+        MacroTable(const MacroTable&) = delete;
+        MacroTable& operator=(const MacroTable&) = delete;
+        MacroTable(MacroTable&&) = default;
+        MacroTable& operator=(MacroTable&&) = default;
+
+        /* A copy of a token whose text lives as long as the table */
+        Token own(const Token& tok);
+
+        /*
+         * Returns false if a macro of that name is already defined. The tokens
+         * of the body must live as long as the table, like those of own().
+         */
+        bool define(std::string_view name, const std::vector<std::string_view>& params, TokenList body);
+        /* Defines a copy of another table's macro, whose tokens are from file */
+        bool import(const Macro& macro, uint16_t file);
+        /* The index of a macro or SIZE_MAX if there is none of that name */
+        size_t find(std::string_view name) const;
+
+        const Macro& macro(size_t index) const { return _macros[index]; }
+        Macro& macro(size_t index) { return _macros[index]; }
+        size_t size() const { return _macros.size(); }
+        bool empty() const { return _macros.empty(); }
+
+        /* The body of a macro with each parameter replaced by the argument in its place */
+        const TokenList& expand(size_t index, const std::vector<Token>& args);
+        /* A list with the same tokens as body, whose tokens are the table's own, kept once per content */
+        const TokenList& keep(TokenList body);
+
+        /* How many expansions were made rather than found */
+        size_t expansions() const { return _expansions; }
+
+    private:
+        std::vector<Macro> _macros;
+        std::unordered_map<std::string_view, size_t> _names;
+        /* Expansions by macro and arguments, and kept lists by content */
+        std::unordered_map<std::string, TokenList> _lists;
+        /* The key being looked up, kept to reuse its memory */
+        std::string _key;
+        size_t _expansions = 0;
+        Arena _storage;
+
+        void append_key(const Token& tok);
+    };
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "Diagnostics.h"
+#include "Ir.h"
+#include "MacroTable.h"
+#include "SymbolTable.h"
+
+namespace c8 {
+    /*
+     * The parsed statements of an included file, ready to be placed at any
+     * address. Addresses start at 0 and label operands are left unresolved
+     * for the includer to resolve along with its own. Symbol ids are the
+     * module's own and the file of a record or macro is an index into files.
+     * The macros and constants it defines are defined in the includer too.
+     */
+    struct Module {
+        struct File {
+            /* Relative to the directory of the module's own file */
+            std::string path;
+            uint64_t hash;
+        };
+
+        std::vector<Ir> code;
+        /* Owns its names so the module outlives the text it was parsed from */
+        SymbolTable symbols{ true };
+        /* The bytes the module takes up */
+        uint16_t size = 0;
+        /* The last label the module defines, which the statements after the .include fall under */
+        SymbolId label = NO_SYMBOL;
+        /* What it was parsed for. Only an includer assembling for the same target can use it. */
+        Target target = Target::CHIP8;
+        MacroTable macros;
+        /* The module's own file, then every file it includes in turn */
+        std::vector<File> files;
+    };
+
+    /* A file read for an .include */
+    struct SourceFile {
+        std::string path;
+        std::string text;
+        uint64_t hash;
+    };
+
+    /*
+     * Parses included files into modules, at most once per content.
+     *
+     * Modules are looked up by the FNV-1a hash of their file's text, so a
+     * library included by many sources, or included again after it moved,
+     * is lexed and parsed once. A module that includes other files is only
+     * reused if those still hash the same, and any module only for the
+     * target it was parsed for. Given a directory, modules are
+     * also saved there and picked up by later runs; a file that can't be
+     * read or is from another build is parsed again.
+     *
+     * Records and diagnostics refer to the files read through the cache by
+     * id, starting from 1 as 0 is the includer's own source. The cache must
+     * outlive the programs parsed with it, whose symbols may view the names
+     * of its modules.
+     */
+    class ModuleCache {
+    public:
+        /* Bumped whenever the layout of a saved module changes */
+        static constexpr uint32_t DISK_VERSION = 4;
+
+        explicit ModuleCache(std::string directory = "");
+
+        ModuleCache(const ModuleCache&) = delete;
+        ModuleCache& operator=(const ModuleCache&) = delete;
+
+        /*
+         * The module of the file at path, relative to directory, parsed for
+         * target. files is set
+         * to the ids of the files the module's records refer to. Returns
+         * nullptr if the file can't be read, includes itself or doesn't parse,
+         * with the errors recorded in diagnostics; offset is where the
+         * .include is.
+         */
+        const Module* load(std::string_view directory, std::string_view path, Target target, size_t offset,
+            Diagnostics& diagnostics, std::vector<uint16_t>& files);
+
+        const SourceFile& file(uint16_t id) const { return *_files[id - 1]; }
+        size_t file_count() const { return _files.size(); }
+        /* The text of every file by id, starting at file 1 */
+        std::vector<std::string_view> texts() const;
+
+        /* How many includes were parsed, read back from the directory and found in memory */
+        size_t parsed() const { return _parsed; }
+        size_t loaded() const { return _loaded; }
+        size_t hits() const { return _hits; }
+
+    private:
+        std::string _directory;
+        /* Kept behind pointers so the texts the records' offsets point into never move */
+        std::vector<std::unique_ptr<SourceFile>> _files;
+        /* The latest file read from each path */
+        std::unordered_map<std::string, uint16_t> _paths;
+        /* Every module parsed from a content, one per set of included files */
+        std::unordered_map<uint64_t, std::vector<std::unique_ptr<Module>>> _modules;
+        /* The files being parsed, innermost last, and the files each has included so far */
+        std::vector<std::string> _loading;
+        std::vector<std::vector<uint16_t>> _used;
+        size_t _parsed;
+        size_t _loaded;
+        size_t _hits;
+
+        uint16_t read(const std::string& path);
+        bool resolve(const Module& module, const std::string& directory, uint16_t id, std::vector<uint16_t>& files);
+        std::unique_ptr<Module> parse(uint16_t id, const std::string& directory, Target target, Diagnostics& diagnostics);
+        std::string disk_path(uint64_t hash) const;
+        std::unique_ptr<Module> read_disk(uint64_t hash) const;
+        void write_disk(const Module& module) const;
+    };
+}
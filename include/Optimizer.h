@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include "Ir.h"
+
+namespace c8 {
+    /* What optimize() did to a program */
+    struct OptimizeStats {
+        /* Records rewritten in place, which keep their size */
+        size_t rewritten = 0;
+        /* Records dropped and the bytes they took up */
+        size_t instructions = 0;
+        size_t bytes = 0;
+    };
+
+    /*
+     * A peephole pass over a parsed program whose labels are resolved, run
+     * before it is generated. In place, it turns CALL x followed by RET into
+     * JMP x and sends a JMP or CALL to a JMP straight to where the chain ends.
+     *
+     * When the code can be moved it then folds ADD Rx, a followed by
+     * ADD Rx, b into ADD Rx, a + b, drops the RET after a tail call and a JMP
+     * to the next instruction, and moves the labels and records after them
+     * down. Code can't be moved if it has a ZJMP, whose targets are worked
+     * out at run time, an address written as a number or a label's address
+     * folded into a value.
+     *
+     * Nothing that a skip or a jump lands on is merged or dropped where that
+     * would change what runs.
+     */
+    OptimizeStats optimize(Program& program);
+}
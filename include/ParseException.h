@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <exception>
 #include <string>
 
@@ -7,9 +8,15 @@ class ParseException : public std::exception {
 
 private:
     const std::string msg;
+    const size_t off;
 
 public:
-    ParseException(const std::string& msg = "") : msg(msg) {}
+    static constexpr size_t NO_OFFSET = static_cast<size_t>(-1);
+
+    ParseException(const std::string& msg = "", size_t offset = NO_OFFSET) : msg(msg), off(offset) {}
 
     const char* what() const noexcept { return msg.c_str(); }
+
+    /* The offset in the source of the token that caused the error or NO_OFFSET */
+    size_t offset() const noexcept { return off; }
 };
@@ -1,34 +1,191 @@
 #pragma once
 
+#include <cstdint>
+#include <string>
 #include <vector>
-#include <map>
+#include "Diagnostics.h"
+#include "Directive.h"
+#include "Expression.h"
+#include "Ir.h"
 #include "Lexer.h"
+#include "MacroTable.h"
+#include "SymbolTable.h"
 
 namespace c8 {
-
-    struct Statement {
-        std::string label, op;
-        std::vector<std::string> args;
-        uint16_t addr;
-
-        Statement(const std::string& label, const std::string& op,
-            const std::vector<std::string>& args, uint16_t addr) :
-            label(label), op(op), args(args), addr(addr)
-        {}
-    };
+    class ModuleCache;
+    struct Module;
 
     class Parser {
     public:
+        /* How many macro expansions and repeated blocks can be read at once, which stops a macro that expands itself */
+        static constexpr size_t MAX_EXPANSION_DEPTH = 64;
+        /* How deeply brackets and unary operators can nest in an expression */
+        static constexpr unsigned MAX_EXPRESSION_DEPTH = 64;
+
+        /* Pulls tokens from the lexer one at a time as it parses */
         Parser(c8::Lexer lexer);
-        std::vector<Statement> parse();
+        /* Walks a buffer from Lexer::tokenize(). The buffer must outlive the parser. */
+        Parser(const TokenBuffer& tokens);
+        /*
+         * Resumes walking a buffer at the token that starts a label or a
+         * statement, with the address and label that were current there.
+         */
+        Parser(const TokenBuffer& tokens, size_t first, uint16_t address, SymbolId label);
+        /*
+         * Lets .include splice in other files, looked up relative to directory
+         * through modules, which must outlive the parser and what it parses.
+         * Without it an .include is an error.
+         */
+        void set_includes(ModuleCache& modules, std::string directory);
+        /*
+         * For code that is moved once it is parsed, like an included file. A
+         * label can then only be used as an address operand, plus or minus an
+         * offset; folding its address into any other value is an error.
+         */
+        void set_relocatable() { _relocatable = true; }
+        /*
+         * The machine the code is for, CHIP8 unless set. It decides which
+         * instructions can be used, where memory ends and whether a label can
+         * be out of reach of an address operand.
+         */
+        void set_target(Target target) { _target = target; }
+        Target target() const { return _target; }
+
+        /* Parses everything and throws the first error as a ParseException */
+        Program parse();
+        /*
+         * Parses everything, recording errors and warnings instead of
+         * throwing. A bad statement is dropped and parsing picks up again on
+         * the next line, until the error limit is reached.
+         */
+        Result<Program> parse(Diagnostics diagnostics);
+
+        /*
+         * Parses the label or the statement at the next token. Labels are
+         * defined in symbols at the current address and constants with their
+         * value. Label operands are interned in symbols and left for the
+         * caller to resolve, with any offset in the operand after them. Other
+         * operands are folded to a number, which needs the address of every
+         * label they use and the value of every constant. A resumed
+         * parser's label must be in symbols. An .include adds all the records
+         * and labels of the included file at once. A macro or .rept pushes its
+         * tokens, which the next units parse before going on with the input.
+         *
+         * A statement with an error is recorded in diagnostics and skipped
+         * along with the rest of its line. Returns false at the end of the
+         * input or once diagnostics is full.
+         */
+        bool parse_unit(SymbolTable& symbols, std::vector<Ir>& code, Diagnostics& diagnostics);
+
+        /* The index of the next token, the address of the next statement and the label it falls under */
+        size_t position() const { return _nextToken; }
+        uint16_t address() const { return _currAddress; }
+        SymbolId label() const { return _currLabel; }
+        /* Whether tokens only live as long as the lexer's window, so names must be copied */
+        bool streaming() const { return !_tokens && _lexer.streaming(); }
+        /* Whether the next unit may come from a macro expansion or a repeated block rather than the input */
+        bool expanding() const { return !_frames.empty(); }
+        /* The macros defined so far, including those of included files */
+        const MacroTable& macros() const { return _macros; }
+        MacroTable& macros() { return _macros; }
+        /* Whether the address of a label was used in an expression, which has to be worked out again if the label moves */
+        bool folds_labels() const { return _foldsLabels; }
 
     private:
         c8::Lexer _lexer;
-        std::string _currLabel;
+        const TokenBuffer* _tokens;
+        size_t _nextToken;
+        SymbolId _currLabel;
         uint16_t _currAddress;
+        ModuleCache* _modules;
+        std::string _directory;
+
+        /* A list of tokens being read instead of the input */
+        struct Frame {
+            const TokenList* list;
+            size_t next;
+            /* How many more times the list is read after this time */
+            size_t repeats;
+        };
+        MacroTable _macros;
+        /* Innermost last */
+        std::vector<Frame> _frames;
+        /* The file of the last token, whether it came from a frame and if so whether it started a line */
+        uint16_t _file;
+        bool _framed;
+        bool _frameLineStart;
+        /* The arguments of the macro being expanded and their text, which a stream doesn't keep long enough */
+        std::vector<Token> _args;
+        std::string _argText;
+        /* The next token of a lexer, once it has been peeked at */
+        Token _ahead;
+        bool _hasAhead;
+        /* The last token read from a lexer, and whether it was put back to be read again before _ahead */
+        Token _last;
+        bool _unread;
+        /* How many tokens have been read, and the count at the first token of the unit being parsed */
+        size_t _read;
+        size_t _unitStart;
+        bool _relocatable;
+        bool _foldsLabels;
+        Target _target;
 
-        void parse_label(const std::string& label, std::map<std::string, uint16_t>& labels);
-        void parse_operator(const std::string& op, std::vector<Statement>& statements);
-        void replaceLabelsWithAddress(std::vector<Statement>& statements, const std::map<std::string, uint16_t>& labels);
+        /* What an expression comes to: a number, plus the address of label if it isn't NO_SYMBOL, which is at offset */
+        struct Value {
+            int32_t number;
+            SymbolId label;
+            size_t offset;
+        };
+
+        Token next_token();
+        /* The token next_token() returns next */
+        Token peek_token();
+        /* Whether the next token is of type, in which case value is set to its value */
+        bool next_is(TokenType type, uint16_t& value);
+        bool starts_line() const;
+        void skip_line();
+        /* Makes the last token read the next one again */
+        void unread();
+        void parse_label(const Token& tok, SymbolTable& symbols, Diagnostics& diagnostics);
+        bool parse_operator(const Token& tok, SymbolTable& symbols, std::vector<Ir>& code, Diagnostics& diagnostics);
+        bool parse_operand(Operand kind, std::string_view after, size_t i, Ir& ir, Token& last, SymbolTable& symbols, Diagnostics& diagnostics);
+        bool parse_number(const Token& first, std::string_view after, int32_t& number, Token& last, SymbolTable& symbols,
+            Diagnostics& diagnostics);
+        bool parse_expression(Value& value, const Token& first, unsigned precedence, std::string_view after, Token& last, unsigned depth,
+            SymbolTable& symbols, Diagnostics& diagnostics);
+        bool parse_term(Value& value, const Token& tok, std::string_view after, Token& last, unsigned depth, SymbolTable& symbols,
+            Diagnostics& diagnostics);
+        bool combine(ArithOp op, Value& a, const Value& b, size_t offset, SymbolTable& symbols, Diagnostics& diagnostics);
+        bool fold(Value& value, const SymbolTable& symbols, Diagnostics& diagnostics);
+        bool parse_directive(const Token& tok, SymbolTable& symbols, std::vector<Ir>& code, Diagnostics& diagnostics);
+        bool parse_constant(const Token& name, const Token& tok, SymbolTable& symbols, Diagnostics& diagnostics);
+        bool parse_include(const Token& tok, SymbolTable& symbols, std::vector<Ir>& code, Diagnostics& diagnostics);
+        bool parse_macro(const Token& tok, Diagnostics& diagnostics);
+        bool parse_rept(const Token& tok, SymbolTable& symbols, Diagnostics& diagnostics);
+        bool collect_body(const Token& tok, Token next, Directive open, Directive close, TokenList& body, Diagnostics& diagnostics);
+        bool expand(const Token& tok, size_t macro, Diagnostics& diagnostics);
+        bool push_frame(const Token& tok, const TokenList& list, size_t repeats, Diagnostics& diagnostics);
+        void place(const Module& module, const std::vector<uint16_t>& files, const Token& tok, SymbolTable& symbols,
+            std::vector<Ir>& code, Diagnostics& diagnostics);
+        void replaceLabelsWithAddress(std::vector<Ir>& code, const SymbolTable& symbols, Diagnostics& diagnostics);
     };
+
+    /*
+     * Parses a token buffer on up to the given number of threads, 0 meaning
+     * one per core, giving exactly what Parser(tokens).parse(diagnostics)
+     * gives. The buffer and its source must outlive the program.
+     *
+     * The tokens are cut into chunks at statements and each chunk is parsed
+     * from address 0. A prefix sum over the chunk sizes gives each chunk its
+     * base address, the chunk symbol tables are merged in order and a last
+     * parallel pass rebases the records and resolves their labels. Sources
+     * with errors are parsed again serially so the diagnostics come out the
+     * same. So are sources with directives, as what a directive does depends
+     * on everything before it, and sources that fold a label's address into
+     * a value, which a chunk doesn't know.
+     */
+    Result<Program> parse_parallel(const TokenBuffer& tokens, unsigned threads, Diagnostics diagnostics = Diagnostics(),
+        Target target = Target::CHIP8);
+    /* The number of threads parse_parallel() would use, 1 meaning it would parse serially */
+    unsigned parallel_parse_threads(const TokenBuffer& tokens, unsigned threads);
 }
\ No newline at end of file
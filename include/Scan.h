@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+ * Byte scanners used by the lexer to skip over the parts of the source
+ * that do not produce tokens. Each scanner has a scalar version and, on
+ * x86, SSE2 and AVX2 versions. The best one the CPU supports is picked
+ * once at startup.
+ */
+namespace c8 {
+    namespace scan {
+        enum class Level {
+            SCALAR,
+            SSE2,
+            AVX2
+        };
+
+        struct Kernels {
+            /* Returns the index of the first byte in [p, p + n) that isn't white space or n if there is none */
+            size_t (*skip_space)(const char* p, size_t n);
+            /* Returns the index of the first '\n' in [p, p + n) or n if there is none */
+            size_t (*find_newline)(const char* p, size_t n);
+            /* Returns the number of '\n' in [p, p + n) */
+            size_t (*count_newlines)(const char* p, size_t n);
+        };
+
+        /* The highest level supported by this CPU */
+        Level detected_level();
+
+        /* The kernels for a level. Levels above detected_level() fall back to the detected one. */
+        const Kernels& kernels(Level level);
+
+        const char* level_name(Level level);
+
+        /* Same set of characters as isspace() in the "C" locale */
+        constexpr bool is_space(char c)
+        {
+            return c == ' ' || static_cast<unsigned char>(c - '\t') <= '\r' - '\t';
+        }
+
+        size_t skip_space(const char* p, size_t n);
+        size_t find_newline(const char* p, size_t n);
+        size_t count_newlines(const char* p, size_t n);
+    }
+}
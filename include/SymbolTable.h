@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "Arena.h"
+
+namespace c8 {
+    /* Symbols are numbered densely from 0 in the order they are first seen */
+    using SymbolId = uint32_t;
+    constexpr SymbolId NO_SYMBOL = UINT32_MAX;
+
+    /*
+     * The labels of a program, interned by name so that statements refer to
+     * them by id and defining or resolving one is a single hash lookup. A
+     * constant is a symbol whose address is its value rather than a place in
+     * the code, so it stays put when the code moves.
+     *
+     * Names are looked up in an open addressing table of ids with linear
+     * probing, kept at most half full. By default the names are views into
+     * the source, which must outlive the table. A table that owns its names
+     * copies them into an arena instead, for sources that don't stay put
+     * like a stream window or a document being edited.
+     *
+     * clear() keeps all the storage, so filling the table again with no more
+     * names than before doesn't allocate.
+     */
+    class SymbolTable {
+    public:
+        explicit SymbolTable(bool ownsNames = false);
+
+        /* Copies would keep views into the other table's names */
+        SymbolTable(const SymbolTable&) = delete;
+        SymbolTable& operator=(const SymbolTable&) = delete;
+        SymbolTable(SymbolTable&&) = default;
+        SymbolTable& operator=(SymbolTable&&) = default;
+
+        /* The id of a name, which is added if it is new */
+        SymbolId intern(std::string_view name);
+        /* The id of a name or NO_SYMBOL if it was never interned */
+        SymbolId find(std::string_view name) const;
+
+        /* Gives a symbol its address. Returns false if it already had one. */
+        bool define(SymbolId id, uint16_t address);
+        /* Makes a symbol a constant of the given value. Returns false if it already had one. */
+        bool define_constant(SymbolId id, uint16_t value);
+        /* Moves a defined symbol to another address */
+        void set_address(SymbolId id, uint16_t address) { _addresses[id] = address; }
+        /* Forgets the address of a symbol. The name stays interned. */
+        void undefine(SymbolId id)
+        {
+            _definedCount -= _defined[id] != UNDEFINED;
+            _defined[id] = UNDEFINED;
+        }
+
+        bool is_defined(SymbolId id) const { return _defined[id] != UNDEFINED; }
+        bool is_constant(SymbolId id) const { return _defined[id] == CONSTANT; }
+        uint16_t address(SymbolId id) const { return _addresses[id]; }
+        std::string_view name(SymbolId id) const { return _names[id]; }
+        size_t size() const { return _names.size(); }
+        /* The number of symbols that have an address */
+        size_t defined_count() const { return _definedCount; }
+
+        void clear();
+
+    private:
+        enum : uint8_t { UNDEFINED, LABEL, CONSTANT };
+
+        bool _ownsNames;
+        std::vector<std::string_view> _names;
+        std::vector<uint64_t> _hashes;
+        std::vector<uint16_t> _addresses;
+        /* UNDEFINED, LABEL or CONSTANT */
+        std::vector<uint8_t> _defined;
+        size_t _definedCount;
+        /* The hash table proper. The size is a power of two and empty slots hold NO_SYMBOL. */
+        std::vector<SymbolId> _slots;
+        /* Where copied names live */
+        Arena _storage;
+
+        void grow();
+    };
+}
@@ -1,238 +1,151 @@
 #pragma once
 
-#include <vector>
-#include <string>
-#include <functional>
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <utility>
 #include "utils.h"
-#include <map>
+#include "Isa.h"
+
+/* The operands of a statement, see c8::Operands */
+using Operands = c8::Operands;
 
 /*
- * Each opcode will have a function returning a 16 bit value
- * given a vector of arguments
+ * Each opcode will have a function returning its value given its
+ * operands, in the low 2 bytes or all 4 for the long ones. They are all
+ * generated from c8::SPECS.
  */
-using OpFxn = std::function<uint16_t(const std::vector<std::string>&)>;
-
-/* Unsupported */
-inline uint16_t fxnSYS(const std::vector<std::string>&)
-{
-    return 0x0;
-}
-
-inline uint16_t fxnCLR(const std::vector<std::string>&)
-{
-    return 0x00E0;
-}
-
-inline uint16_t fxnRET(const std::vector<std::string>&)
-{
-    return 0x00EE;
-}
-
-inline uint16_t fxnJMP(const std::vector<std::string>& args)
-{
-    return 0x1000 | to_hex(args[0]);
-}
-
-inline uint16_t fxnCALL(const std::vector<std::string>& args)
-{
-    return 0x2000 | to_hex(args[0]);
-}
-
-inline uint16_t fxnSKE(const std::vector<std::string>& args)
-{
-    return 0x3000 | to_hex(args[0]) << 8 | to_hex(args[1]);
-}
-
-inline uint16_t fxnSKNE(const std::vector<std::string>& args)
-{
-    return 0x4000 | to_hex(args[0]) << 8 | to_hex(args[1]);
-}
-
-inline uint16_t fxnSKRE(const std::vector<std::string>& args)
-{
-    return 0x5000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4;
-}
-
-inline uint16_t fxnLOAD(const std::vector<std::string>& args)
-{
-    return 0x6000 | to_hex(args[0]) << 8 | to_hex(args[1]);
-}
-
-inline uint16_t fxnADD(const std::vector<std::string>& args)
-{
-    return 0x7000 | to_hex(args[0]) << 8 | to_hex(args[1]);
-}
-
-inline uint16_t fxnASN(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4;
-}
-
-inline uint16_t fxnOR(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4 | 0x1;
-}
-
-inline uint16_t fxnAND(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4 | 0x2;
-}
-
-inline uint16_t fxnXOR(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4 | 0x3;
-}
-
-inline uint16_t fxnRADD(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4 | 0x4;
-}
-
-inline uint16_t fxnSUB(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4 | 0x5;
-}
-
-inline uint16_t fxnSHR(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | 0x6;
-}
-
-inline uint16_t fxnRSUB(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4 | 0x7;
-}
-
-inline uint16_t fxnSHL(const std::vector<std::string>& args)
-{
-    return 0x8000 | to_hex(args[0]) << 8 | 0xE;
-}
-
-inline uint16_t fxnSKRNE(const std::vector<std::string>& args)
-{
-    return 0x9000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4;
-}
-
-inline uint16_t fxnILOAD(const std::vector<std::string>& args)
-{
-    return 0xA000 | to_hex(args[0]);
-}
-
-inline uint16_t fxnZJMP(const std::vector<std::string>& args)
-{
-    return 0xB000 | to_hex(args[0]);
-}
-
-inline uint16_t fxnRAND(const std::vector<std::string>& args)
-{
-    return 0xC000 | to_hex(args[0]) << 8 | to_hex(args[0]);
-}
-
-inline uint16_t fxnDRAW(const std::vector<std::string>& args)
-{
-    return 0xD000 | to_hex(args[0]) << 8 | to_hex(args[1]) << 4 | to_hex(args[2]);
-}
-
-inline uint16_t fxnSKK(const std::vector<std::string>& args)
-{
-    return 0xE000 | to_hex(args[0]) << 8 | 0x009E;
-}
-
-inline uint16_t fxnSKNK(const std::vector<std::string>& args)
-{
-    return 0xE000 | to_hex(args[0]) << 8 | 0x00A1;
-}
-
-inline uint16_t fxnDELA(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x0007;
-}
-
-inline uint16_t fxnKEYW(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x000A;
+using OpFxn = uint32_t (*)(const Operands&);
+
+constexpr OpFxn fxnSYS = c8::encoder<c8::Op::SYS>;
+constexpr OpFxn fxnCLR = c8::encoder<c8::Op::CLR>;
+constexpr OpFxn fxnRET = c8::encoder<c8::Op::RET>;
+constexpr OpFxn fxnJMP = c8::encoder<c8::Op::JMP>;
+constexpr OpFxn fxnCALL = c8::encoder<c8::Op::CALL>;
+constexpr OpFxn fxnSKE = c8::encoder<c8::Op::SKE>;
+constexpr OpFxn fxnSKNE = c8::encoder<c8::Op::SKNE>;
+constexpr OpFxn fxnSKRE = c8::encoder<c8::Op::SKRE>;
+constexpr OpFxn fxnLOAD = c8::encoder<c8::Op::LOAD>;
+constexpr OpFxn fxnADD = c8::encoder<c8::Op::ADD>;
+constexpr OpFxn fxnASN = c8::encoder<c8::Op::ASN>;
+constexpr OpFxn fxnOR = c8::encoder<c8::Op::OR>;
+constexpr OpFxn fxnAND = c8::encoder<c8::Op::AND>;
+constexpr OpFxn fxnXOR = c8::encoder<c8::Op::XOR>;
+constexpr OpFxn fxnRADD = c8::encoder<c8::Op::RADD>;
+constexpr OpFxn fxnSUB = c8::encoder<c8::Op::SUB>;
+constexpr OpFxn fxnSHR = c8::encoder<c8::Op::SHR>;
+constexpr OpFxn fxnRSUB = c8::encoder<c8::Op::RSUB>;
+constexpr OpFxn fxnSHL = c8::encoder<c8::Op::SHL>;
+constexpr OpFxn fxnSKRNE = c8::encoder<c8::Op::SKRNE>;
+constexpr OpFxn fxnILOAD = c8::encoder<c8::Op::ILOAD>;
+constexpr OpFxn fxnZJMP = c8::encoder<c8::Op::ZJMP>;
+constexpr OpFxn fxnRAND = c8::encoder<c8::Op::RAND>;
+constexpr OpFxn fxnDRAW = c8::encoder<c8::Op::DRAW>;
+constexpr OpFxn fxnSKK = c8::encoder<c8::Op::SKK>;
+constexpr OpFxn fxnSKNK = c8::encoder<c8::Op::SKNK>;
+constexpr OpFxn fxnDELA = c8::encoder<c8::Op::DELA>;
+constexpr OpFxn fxnKEYW = c8::encoder<c8::Op::KEYW>;
+constexpr OpFxn fxnDELR = c8::encoder<c8::Op::DELR>;
+constexpr OpFxn fxnSNDR = c8::encoder<c8::Op::SNDR>;
+constexpr OpFxn fxnIADD = c8::encoder<c8::Op::IADD>;
+constexpr OpFxn fxnSILS = c8::encoder<c8::Op::SILS>;
+constexpr OpFxn fxnBCD = c8::encoder<c8::Op::BCD>;
+constexpr OpFxn fxnDUMP = c8::encoder<c8::Op::DUMP>;
+constexpr OpFxn fxnIDUMP = c8::encoder<c8::Op::IDUMP>;
+constexpr OpFxn fxnLB = c8::encoder<c8::Op::LB>;
+constexpr OpFxn fxnSCD = c8::encoder<c8::Op::SCD>;
+constexpr OpFxn fxnSCR = c8::encoder<c8::Op::SCR>;
+constexpr OpFxn fxnSCL = c8::encoder<c8::Op::SCL>;
+constexpr OpFxn fxnEXIT = c8::encoder<c8::Op::EXIT>;
+constexpr OpFxn fxnLOW = c8::encoder<c8::Op::LOW>;
+constexpr OpFxn fxnHIGH = c8::encoder<c8::Op::HIGH>;
+constexpr OpFxn fxnHSILS = c8::encoder<c8::Op::HSILS>;
+constexpr OpFxn fxnRSAVE = c8::encoder<c8::Op::RSAVE>;
+constexpr OpFxn fxnRLOAD = c8::encoder<c8::Op::RLOAD>;
+constexpr OpFxn fxnSCU = c8::encoder<c8::Op::SCU>;
+constexpr OpFxn fxnSAVE = c8::encoder<c8::Op::SAVE>;
+constexpr OpFxn fxnREST = c8::encoder<c8::Op::REST>;
+constexpr OpFxn fxnLLOAD = c8::encoder<c8::Op::LLOAD>;
+constexpr OpFxn fxnPLANE = c8::encoder<c8::Op::PLANE>;
+constexpr OpFxn fxnAUDIO = c8::encoder<c8::Op::AUDIO>;
+constexpr OpFxn fxnPITCH = c8::encoder<c8::Op::PITCH>;
+
+namespace detail {
+    template <size_t... I>
+    constexpr std::array<OpFxn, sizeof...(I)> make_operators(std::index_sequence<I...>)
+    {
+        return { { c8::encoder<static_cast<c8::Op>(I)>... } };
+    }
 }
 
-inline uint16_t fxnDELR(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x0015;
-}
-
-inline uint16_t fxnSNDR(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x0018;
-}
-
-inline uint16_t fxnIADD(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x001E;
-}
-
-inline uint16_t fxnSILS(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x0029;
-}
-
-inline uint16_t fxnBCD(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x0033;
-}
-
-inline uint16_t fxnDUMP(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x0055;
-}
-
-inline uint16_t fxnIDUMP(const std::vector<std::string>& args)
-{
-    return 0xF000 | to_hex(args[0]) << 8 | 0x0065;
-}
-
-inline uint16_t fxnLB(const std::vector<std::string>& args)
-{
-    return to_hex(args[0]);
-}
-
-static const std::map<std::string, OpFxn> OPERATORS = {
-    {"SYS", fxnSYS },
-    {"CLR", fxnCLR },
-    {"RET", fxnRET },
-    {"JMP", fxnJMP },
-    {"CALL", fxnCALL },
-    {"SKE", fxnSKE },
-    {"SKNE", fxnSKNE },
-    {"SKRE", fxnSKRE },
-    {"LOAD", fxnLOAD },
-    {"ADD", fxnADD },
-    {"ASN", fxnASN },
-    {"OR", fxnOR },
-    {"AND", fxnAND },
-    {"XOR", fxnXOR },
-    {"RADD", fxnRADD },
-    {"SUB", fxnSUB },
-    {"SHR", fxnSHR },
-    {"RSUB", fxnRSUB },
-    {"SHL", fxnSHL },
-    {"SKRNE", fxnSKRNE },
-    {"ILOAD", fxnILOAD },
-    {"ZJMP", fxnZJMP },
-    {"RAND", fxnRAND },
-    {"DRAW", fxnDRAW },
-    {"SKK", fxnSKK },
-    {"SKNK", fxnSKNK },
-    {"DELA", fxnDELA },
-    {"KEYW", fxnKEYW },
-    {"DELR", fxnDELR },
-    {"SNDR", fxnSNDR },
-    {"IADD", fxnIADD },
-    {"SILS", fxnSILS },
-    {"BCD", fxnBCD },
-    {"DUMP", fxnDUMP },
-    {"IDUMP", fxnIDUMP },
-    {"LB", fxnLB}
-};
-
-inline bool is_operator(const std::string& s)
-{
-    return OPERATORS.find(s) != OPERATORS.end();
+/*
+ * The encoder of every operator, indexed by c8::Op. A constexpr table needs
+ * no initialization at startup and encoding is a single indexed call.
+ */
+inline constexpr std::array<OpFxn, c8::OP_COUNT> OPERATORS = detail::make_operators(std::make_index_sequence<c8::OP_COUNT>{});
+
+/* The encoders of a target's instructions only, also indexed by c8::Op */
+template <c8::Target T>
+inline constexpr std::array<OpFxn, c8::TargetIsa<T>::OP_COUNT> OPERATORS_FOR
+    = detail::make_operators(std::make_index_sequence<c8::TargetIsa<T>::OP_COUNT>{});
+
+/* Every encoding, checked against the opcodes in the README */
+static_assert(fxnSYS({}) == 0x0000);
+static_assert(fxnCLR({}) == 0x00E0);
+static_assert(fxnRET({}) == 0x00EE);
+static_assert(fxnJMP({ 0xABC }) == 0x1ABC);
+static_assert(fxnCALL({ 0xABC }) == 0x2ABC);
+static_assert(fxnSKE({ 0xF, 0xAB }) == 0x3FAB);
+static_assert(fxnSKNE({ 0xF, 0xAB }) == 0x4FAB);
+static_assert(fxnSKRE({ 0xA, 0xB }) == 0x5AB0);
+static_assert(fxnLOAD({ 0x1, 0xAB }) == 0x61AB);
+static_assert(fxnADD({ 0x1, 0xAB }) == 0x71AB);
+static_assert(fxnASN({ 0xA, 0xB }) == 0x8AB0);
+static_assert(fxnOR({ 0xA, 0xB }) == 0x8AB1);
+static_assert(fxnAND({ 0xA, 0xB }) == 0x8AB2);
+static_assert(fxnXOR({ 0xA, 0xB }) == 0x8AB3);
+static_assert(fxnRADD({ 0xA, 0xB }) == 0x8AB4);
+static_assert(fxnSUB({ 0xA, 0xB }) == 0x8AB5);
+static_assert(fxnSHR({ 0x2 }) == 0x8206);
+static_assert(fxnRSUB({ 0xA, 0xB }) == 0x8AB7);
+static_assert(fxnSHL({ 0x2 }) == 0x820E);
+static_assert(fxnSKRNE({ 0xA, 0xB }) == 0x9AB0);
+static_assert(fxnILOAD({ 0xABC }) == 0xAABC);
+static_assert(fxnZJMP({ 0xABC }) == 0xBABC);
+static_assert(fxnRAND({ 0x8, 0xAB }) == 0xC8AB);
+static_assert(fxnDRAW({ 0x0, 0x1, 0x6 }) == 0xD016);
+static_assert(fxnSKK({ 0x3 }) == 0xE39E);
+static_assert(fxnSKNK({ 0x3 }) == 0xE3A1);
+static_assert(fxnDELA({ 0x3 }) == 0xF307);
+static_assert(fxnKEYW({ 0x3 }) == 0xF30A);
+static_assert(fxnDELR({ 0x3 }) == 0xF315);
+static_assert(fxnSNDR({ 0x3 }) == 0xF318);
+static_assert(fxnIADD({ 0x3 }) == 0xF31E);
+static_assert(fxnSILS({ 0x3 }) == 0xF329);
+static_assert(fxnBCD({ 0x3 }) == 0xF333);
+static_assert(fxnDUMP({ 0x3 }) == 0xF355);
+static_assert(fxnIDUMP({ 0x3 }) == 0xF365);
+static_assert(fxnLB({ 0xF0 }) == 0x00F0);
+static_assert(fxnSCD({ 0x4 }) == 0x00C4);
+static_assert(fxnSCR({}) == 0x00FB);
+static_assert(fxnSCL({}) == 0x00FC);
+static_assert(fxnEXIT({}) == 0x00FD);
+static_assert(fxnLOW({}) == 0x00FE);
+static_assert(fxnHIGH({}) == 0x00FF);
+static_assert(fxnHSILS({ 0x3 }) == 0xF330);
+static_assert(fxnRSAVE({ 0x3 }) == 0xF375);
+static_assert(fxnRLOAD({ 0x3 }) == 0xF385);
+static_assert(fxnSCU({ 0x4 }) == 0x00D4);
+static_assert(fxnSAVE({ 0xA, 0xB }) == 0x5AB2);
+static_assert(fxnREST({ 0xA, 0xB }) == 0x5AB3);
+static_assert(fxnLLOAD({ 0x1234 }) == 0xF0001234);
+static_assert(fxnPLANE({ 0x3 }) == 0xF301);
+static_assert(fxnAUDIO({}) == 0xF002);
+static_assert(fxnPITCH({ 0x3 }) == 0xF33A);
+static_assert(OPERATORS[static_cast<size_t>(c8::Op::JMP)] == fxnJMP && OPERATORS[static_cast<size_t>(c8::Op::LB)] == fxnLB,
+    "OPERATORS is out of step with the Op enum.");
+
+inline bool is_operator(std::string_view s)
+{
+    return c8::find_mnemonic(s) != c8::Op::COUNT;
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <cstdio>
 #include <string>
+#include <string_view>
 #include <initializer_list>
 #include <cctype>
 #include <vector>
@@ -37,8 +42,19 @@ inline uint16_t endi(uint16_t num)
     #endif
 }
 
+inline uint32_t endi(uint32_t num)
+{
+    #if (__BYTE_ORDER == __LITTLE_ENDIAN)
+        return (num & 0x000000FF) << 24 | (num & 0x0000FF00) << 8 | (num & 0x00FF0000) >> 8 | (num & 0xFF000000) >> 24;
+    #elif (__BYTE_ORDER == __BIG_ENDIAN)
+        return num;
+    #else
+        #error "Couldn't determine endianess!"
+    #endif
+}
+
 /* Given ^\$[0-9]+ string and return a hexadecimal representation */
-inline uint16_t to_hex(const std::string& s)
+inline uint16_t to_hex(std::string_view s)
 {
     if (s.empty()) {
         return 0;
@@ -57,6 +73,47 @@ inline uint16_t to_hex(const std::string& s)
     return val;
 }
 
+/*
+ * Parses up to 4 hex digits (no '$') into value, all four at once: the digits
+ * are packed into one 32 bit word, validated with carry-free byte compares
+ * and folded into nibbles with shifts and masks. Leading zeros don't count
+ * towards the 4 digits. Returns false if a character isn't a hex digit or
+ * the number doesn't fit in 16 bits.
+ */
+inline bool parse_hex(std::string_view digits, uint16_t* value)
+{
+    while (digits.size() > 4 && digits[0] == '0') {
+        digits.remove_prefix(1);
+    }
+    if (digits.empty() || digits.size() > 4) {
+        return false;
+    }
+
+    /* Right align the digits behind '0' padding. The first byte is the most significant digit. */
+    unsigned char b[4] = { '0', '0', '0', '0' };
+    for (size_t i = 0; i < digits.size(); ++i) {
+        b[4 - digits.size() + i] = static_cast<unsigned char>(digits[i]);
+    }
+    const uint32_t v = static_cast<uint32_t>(b[0]) | static_cast<uint32_t>(b[1]) << 8
+        | static_cast<uint32_t>(b[2]) << 16 | static_cast<uint32_t>(b[3]) << 24;
+
+    /* Adding 0x80 - c sets a byte's top bit iff the byte is >= c. Masking to 7 bits first keeps carries in their bytes. */
+    const uint32_t ascii = ~v & 0x80808080u;
+    const uint32_t x = v & 0x7F7F7F7Fu;
+    const uint32_t lower = x | 0x20202020u;
+    const uint32_t digit = (x + 0x50505050u) & ~(x + 0x46464646u);
+    const uint32_t letter = (lower + 0x1F1F1F1Fu) & ~(lower + 0x19191919u);
+    if (((digit | letter) & ascii) != 0x80808080u) {
+        return false;
+    }
+
+    /* '0'-'9' have 0-9 in the low nibble; letters have 1-6 and bit 6 set, so add 9 */
+    const uint32_t nibbles = (v & 0x0F0F0F0Fu) + ((v >> 6) & 0x01010101u) * 9;
+    const uint32_t pairs = ((nibbles & 0x000F000Fu) << 4) | ((nibbles & 0x0F000F00u) >> 8);
+    *value = static_cast<uint16_t>((pairs & 0xFF) << 8 | (pairs >> 16 & 0xFF));
+    return true;
+}
+
 inline std::string from_hex(uint16_t num)
 {
     char buf[] = { '0', '0', '0', '0' };
@@ -83,7 +140,7 @@ inline bool is_valid_hex_char(char c)
     return std::isdigit(lc) || (static_cast<char>(lc) >= 'a' && static_cast<char>(lc) <= 'f');
 }
 
-inline bool is_register(const std::string& s)
+inline bool is_register(std::string_view s)
 {
     if (s.size() != 2) {
         return false;
@@ -102,6 +159,21 @@ inline bool one_of(const T& t, std::initializer_list<T> list)
     return false;
 }
 
+/* Replaces v[first, last) with [begin, end). The elements after it only move if the sizes differ. */
+template <class T, class It>
+inline void splice(std::vector<T>& v, size_t first, size_t last, It begin, It end)
+{
+    const size_t n = static_cast<size_t>(std::distance(begin, end));
+    const size_t common = std::min(n, last - first);
+    std::copy_n(begin, common, v.begin() + first);
+    std::advance(begin, common);
+    if (n > common) {
+        v.insert(v.begin() + first + common, begin, end);
+    } else {
+        v.erase(v.begin() + first + common, v.begin() + last);
+    }
+}
+
 template <class... Args>
 inline std::string fmt(const char* format, Args&&... args)
 {
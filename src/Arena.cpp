@@ -0,0 +1,58 @@
+#include "Arena.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+c8::Arena::Arena(size_t blockSize)
+    : _blockSize(blockSize), _current(0), _used(0) {}
+
+void* c8::Arena::allocate(size_t size, size_t align)
+{
+    for (;;) {
+        if (_current < _blocks.size()) {
+            const Block& block = _blocks[_current];
+            const auto base = reinterpret_cast<uintptr_t>(block.data.get());
+            const size_t start = ((base + _used + align - 1) & ~(align - 1)) - base;
+            if (start + size <= block.size) {
+                _used = start + size;
+                return block.data.get() + start;
+            }
+            /* Blocks too small for this are skipped, not searched again until the next reset */
+            if (_current + 1 < _blocks.size()) {
+                ++_current;
+                _used = 0;
+                continue;
+            }
+        }
+        /* Oversized requests get a block of their own size */
+        const size_t blockSize = std::max(_blockSize, size + align);
+        _blocks.push_back({ std::make_unique<char[]>(blockSize), blockSize });
+        _current = _blocks.size() - 1;
+        _used = 0;
+    }
+}
+
+std::string_view c8::Arena::copy(std::string_view text)
+{
+    if (text.empty()) {
+        return {};
+    }
+    auto* data = static_cast<char*>(allocate(text.size(), 1));
+    std::memcpy(data, text.data(), text.size());
+    return { data, text.size() };
+}
+
+void c8::Arena::reset()
+{
+    _current = 0;
+    _used = 0;
+}
+
+size_t c8::Arena::capacity() const
+{
+    size_t total = 0;
+    for (const Block& block : _blocks) {
+        total += block.size;
+    }
+    return total;
+}
@@ -0,0 +1,151 @@
+#include "AssemblerContext.h"
+#include <algorithm>
+#include <string>
+#include "Generator.h"
+#include "utils.h"
+
+static constexpr uint32_t NONE = UINT32_MAX;
+
+c8::AssemblerContext::AssemblerContext(Diagnostics diagnostics)
+    : _symbols(true), _diagnostics(std::move(diagnostics)), _modules(nullptr), _target(Target::CHIP8) {}
+
+void c8::AssemblerContext::set_includes(ModuleCache& modules, std::string directory)
+{
+    _modules = &modules;
+    _directory = std::move(directory);
+}
+
+void c8::AssemblerContext::reset()
+{
+    _tokens.clear();
+    _symbols.clear();
+    _code.clear();
+    _fixups.clear();
+    _pending.clear();
+    _unresolved.clear();
+    _rom.clear();
+    _diagnostics.clear();
+}
+
+bool c8::AssemblerContext::assemble(std::string_view source)
+{
+    reset();
+    Lexer(source).tokenize(_tokens);
+    Parser parser(_tokens);
+    if (_modules) {
+        parser.set_includes(*_modules, _directory);
+    }
+    parser.set_target(_target);
+    return assemble(parser);
+}
+
+bool c8::AssemblerContext::assemble(Parser& parser)
+{
+    size_t defined = _symbols.defined_count();
+    SymbolId label = parser.label();
+    while (parser.parse_unit(_symbols, _code, _diagnostics)) {
+        if (_symbols.defined_count() != defined) {
+            /* A label is the new current label, while a constant isn't and an included file can define any number of either */
+            if (_symbols.defined_count() == defined + 1 && _code.empty() && parser.label() != label) {
+                patch(parser.label());
+            } else {
+                patch_all();
+            }
+            defined = _symbols.defined_count();
+        }
+        label = parser.label();
+
+        for (Ir& ir : _code) {
+            if (ir.symbol != NO_SYMBOL) {
+                if (_symbols.is_defined(ir.symbol)) {
+                    const int32_t operand = label_operand(ir, _symbols.address(ir.symbol));
+                    ir.operands[0] = static_cast<uint16_t>(operand);
+                    if (out_of_reach(ir.op, operand)) {
+                        _fixups.push_back({ static_cast<uint32_t>(_rom.size()), ir.offset, NONE, ir.file, ir.operands[1], ir.op });
+                        _unresolved.emplace_back(static_cast<uint32_t>(_fixups.size() - 1), ir.symbol);
+                    }
+                } else {
+                    if (ir.symbol >= _pending.size()) {
+                        _pending.resize(_symbols.size(), NONE);
+                    }
+                    _fixups.push_back({ static_cast<uint32_t>(_rom.size()), ir.offset, _pending[ir.symbol], ir.file, ir.operands[1], ir.op });
+                    _pending[ir.symbol] = static_cast<uint32_t>(_fixups.size() - 1);
+                }
+            }
+            emit(_rom, ir, encode(ir));
+        }
+        _code.clear();
+    }
+
+    if (!_diagnostics.full()) {
+        report_unresolved();
+    }
+    return _diagnostics.ok();
+}
+
+void c8::AssemblerContext::patch(SymbolId label)
+{
+    if (label >= _pending.size()) {
+        return;
+    }
+    for (uint32_t f = _pending[label]; f != NONE; f = _fixups[f].next) {
+        const Fixup& fixup = _fixups[f];
+        const int32_t operand = _symbols.address(label) + static_cast<int16_t>(fixup.addend);
+        if (out_of_reach(fixup.op, operand)) {
+            _unresolved.emplace_back(f, label);
+            continue;
+        }
+        const auto addr = static_cast<uint16_t>(operand);
+        /* Every instruction with a label operand keeps the address in its low 12 bits, except for the 16 bits after LLOAD */
+        const uint32_t at = fixup.at;
+        if (spec(fixup.op).operands[0] == Operand::LONG) {
+            _rom[at + 2] = static_cast<uint8_t>(addr >> 8);
+            _rom[at + 3] = static_cast<uint8_t>(addr);
+        } else {
+            _rom[at] = static_cast<uint8_t>((_rom[at] & 0xF0) | (addr >> 8));
+            _rom[at + 1] = static_cast<uint8_t>(addr);
+        }
+    }
+    _pending[label] = NONE;
+}
+
+void c8::AssemblerContext::patch_all()
+{
+    for (SymbolId id = 0; id < _pending.size(); ++id) {
+        if (_pending[id] != NONE && _symbols.is_defined(id)) {
+            patch(id);
+        }
+    }
+}
+
+/*
+ * Whatever is still waiting refers to a label that was never defined. They
+ * are reported along with the labels out of reach in source order, as the
+ * parser reports them.
+ */
+void c8::AssemblerContext::report_unresolved()
+{
+    for (SymbolId id = 0; id < _pending.size(); ++id) {
+        for (uint32_t f = _pending[id]; f != NONE; f = _fixups[f].next) {
+            _unresolved.emplace_back(f, id);
+        }
+    }
+    std::sort(_unresolved.begin(), _unresolved.end());
+    for (const auto& [f, symbol] : _unresolved) {
+        const Fixup& fixup = _fixups[f];
+        if (!_symbols.is_defined(symbol)) {
+            _diagnostics.error(std::string(_symbols.name(symbol)) + " is a label that hasn't been defined.", fixup.offset, fixup.file);
+        } else {
+            _diagnostics.error(out_of_reach_message(_symbols.name(symbol), fixup.addend, _symbols.address(symbol) + static_cast<int16_t>(fixup.addend),
+                fixup.op), fixup.offset, fixup.file);
+        }
+        if (_diagnostics.full()) {
+            return;
+        }
+    }
+}
+
+c8::Result<std::vector<uint8_t>> c8::AssemblerContext::release()
+{
+    return { std::move(_rom), std::move(_diagnostics) };
+}
@@ -0,0 +1,176 @@
+#include "BatchEncoder.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define C8_BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(C8_BATCH_X86) && defined(__GNUC__)
+#define C8_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define C8_TARGET_AVX2
+#endif
+
+c8::IrColumns::IrColumns(const std::vector<Ir>& code)
+{
+    reserve(code.size());
+    for (const auto& ir : code) {
+        push_back(ir);
+    }
+}
+
+void c8::IrColumns::clear()
+{
+    patterns.clear();
+    xs.clear();
+    ys.clear();
+    values.clear();
+    sizes.clear();
+}
+
+void c8::IrColumns::reserve(size_t n)
+{
+    patterns.reserve(n);
+    xs.reserve(n);
+    ys.reserve(n);
+    values.reserve(n);
+    sizes.reserve(n);
+}
+
+void c8::IrColumns::push_back(const Ir& ir)
+{
+    const InstructionSpec& spec = c8::spec(ir.op);
+    if (spec.size == 0) {
+        return;
+    }
+    uint8_t x = 0;
+    uint8_t y = 0;
+    uint16_t value = 0;
+    for (size_t i = 0; i < spec.arity; ++i) {
+        if (spec.operands[i] == Operand::REGISTER && spec.shifts[i] == 8) {
+            x = static_cast<uint8_t>(ir.operands[i]);
+        } else if (spec.operands[i] == Operand::REGISTER && spec.shifts[i] == 4) {
+            y = static_cast<uint8_t>(ir.operands[i]);
+        } else {
+            value = static_cast<uint16_t>(value | ir.operands[i] << spec.shifts[i]);
+        }
+    }
+    patterns.push_back(static_cast<uint16_t>(spec.size == 4 ? spec.pattern >> 16 : spec.pattern));
+    xs.push_back(x);
+    ys.push_back(y);
+    values.push_back(value);
+    sizes.push_back(spec.size);
+}
+
+static void encode_scalar(const c8::IrColumns& code, size_t first, size_t n, uint8_t* out)
+{
+    for (size_t i = first; i < first + n; ++i) {
+        const auto op = static_cast<uint16_t>(code.patterns[i] | code.xs[i] << 8 | code.ys[i] << 4 | code.values[i]);
+        *out++ = static_cast<uint8_t>(op >> 8);
+        *out++ = static_cast<uint8_t>(op);
+    }
+}
+
+#ifdef C8_BATCH_X86
+
+/* Eight opcodes in 16 bit lanes, then each lane's bytes swapped to big endian */
+static void encode_sse2(const c8::IrColumns& code, size_t first, size_t n, uint8_t* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = first;
+    for (; i + 8 <= first + n; i += 8, out += 16) {
+        const __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(code.xs.data() + i)), zero);
+        const __m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(code.ys.data() + i)), zero);
+        __m128i op = _mm_loadu_si128(reinterpret_cast<const __m128i*>(code.patterns.data() + i));
+        op = _mm_or_si128(op, _mm_loadu_si128(reinterpret_cast<const __m128i*>(code.values.data() + i)));
+        op = _mm_or_si128(op, _mm_or_si128(_mm_slli_epi16(x, 8), _mm_slli_epi16(y, 4)));
+        op = _mm_or_si128(_mm_slli_epi16(op, 8), _mm_srli_epi16(op, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), op);
+    }
+    encode_scalar(code, i, first + n - i, out);
+}
+
+/* Sixteen at a time, the bytes widened to 16 bit lanes and swapped with a shuffle */
+C8_TARGET_AVX2 static void encode_avx2(const c8::IrColumns& code, size_t first, size_t n, uint8_t* out)
+{
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = first;
+    for (; i + 16 <= first + n; i += 16, out += 32) {
+        const __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(code.xs.data() + i)));
+        const __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(code.ys.data() + i)));
+        __m256i op = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(code.patterns.data() + i));
+        op = _mm256_or_si256(op, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(code.values.data() + i)));
+        op = _mm256_or_si256(op, _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_slli_epi16(y, 4)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_shuffle_epi8(op, swap));
+    }
+    encode_sse2(code, i, first + n - i, out);
+}
+
+#endif
+
+c8::batch::Kernel c8::batch::kernel(scan::Level level)
+{
+    if (level > scan::detected_level()) {
+        level = scan::detected_level();
+    }
+    switch (level) {
+#ifdef C8_BATCH_X86
+    case scan::Level::AVX2:
+        return encode_avx2;
+    case scan::Level::SSE2:
+        return encode_sse2;
+#endif
+    default:
+        return encode_scalar;
+    }
+}
+
+void c8::batch::encode(const IrColumns& code, size_t first, size_t n, uint8_t* out)
+{
+    static const Kernel active = kernel(scan::detected_level());
+    active(code, first, n, out);
+}
+
+std::vector<uint8_t> c8::generate(const IrColumns& code)
+{
+    size_t size = 0;
+    for (const uint8_t s : code.sizes) {
+        size += s;
+    }
+    std::vector<uint8_t> rom(size);
+    uint8_t* out = rom.data();
+    /*
+     * Runs of 2 byte opcodes go to the kernel. The single bytes of LB and the
+     * 4 byte opcodes in between are written one at a time.
+     */
+    const uint8_t* sizes = code.sizes.data();
+    const auto find = [&code, sizes](uint8_t size, size_t from) {
+        const void* found = std::memchr(sizes + from, size, code.size() - from);
+        return found ? static_cast<size_t>(static_cast<const uint8_t*>(found) - sizes) : code.size();
+    };
+    if (code.size() == 0) {
+        return rom;
+    }
+    size_t nextByte = find(1, 0);
+    size_t nextLong = find(4, 0);
+    for (size_t i = 0; i < code.size();) {
+        nextByte = nextByte < i ? find(1, i) : nextByte;
+        nextLong = nextLong < i ? find(4, i) : nextLong;
+        const size_t end = std::min(nextByte, nextLong);
+        batch::encode(code, i, end - i, out);
+        out += 2 * (end - i);
+        for (i = end; i < code.size() && sizes[i] != 2; ++i) {
+            if (sizes[i] == 4) {
+                const auto high = static_cast<uint16_t>(code.patterns[i] | code.xs[i] << 8 | code.ys[i] << 4);
+                *out++ = static_cast<uint8_t>(high >> 8);
+                *out++ = static_cast<uint8_t>(high);
+                *out++ = static_cast<uint8_t>(code.values[i] >> 8);
+            }
+            *out++ = static_cast<uint8_t>(code.values[i]);
+        }
+    }
+    return rom;
+}
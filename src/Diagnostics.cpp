@@ -0,0 +1,51 @@
+#include "Diagnostics.h"
+#include <algorithm>
+
+c8::Diagnostics::Diagnostics(size_t errorLimit)
+    : _errorLimit(errorLimit), _errors(0) {}
+
+void c8::Diagnostics::clear()
+{
+    _all.clear();
+    _errors = 0;
+}
+
+void c8::Diagnostics::error(std::string message, size_t offset, uint16_t file)
+{
+    add(Severity::ERROR, std::move(message), offset, file);
+    ++_errors;
+}
+
+void c8::Diagnostics::warning(std::string message, size_t offset, uint16_t file)
+{
+    add(Severity::WARNING, std::move(message), offset, file);
+}
+
+void c8::Diagnostics::add_errors(const Diagnostics& other, uint16_t file)
+{
+    for (const auto& d : other._all) {
+        if (d.severity != Severity::ERROR || full()) {
+            continue;
+        }
+        _all.push_back({ d.severity, d.message, d.offset, d.file == 0 ? file : d.file, d.location });
+        ++_errors;
+    }
+}
+
+void c8::Diagnostics::add(Severity severity, std::string message, size_t offset, uint16_t file)
+{
+    SourceLocation location{ 0, 0 };
+    if (_locate && file == 0 && offset != ParseException::NO_OFFSET) {
+        location = _locate(offset);
+    }
+    _all.push_back({ severity, std::move(message), offset, file, location });
+}
+
+ParseException c8::Diagnostics::first_error() const
+{
+    const auto error = std::find_if(_all.begin(), _all.end(), [](const Diagnostic& d) { return d.severity == Severity::ERROR; });
+    if (error == _all.end()) {
+        return ParseException("No error was recorded.");
+    }
+    return ParseException(error->message, error->offset);
+}
@@ -0,0 +1,282 @@
+#include "Document.h"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include "ParseException.h"
+#include "Scan.h"
+#include "utils.h"
+
+c8::Document::Document(std::string text)
+    : _text(std::move(text)), _symbols(true), _stale(false), _directives(0), _foldsLabels(false)
+{
+    _tokens = Lexer(_text).tokenize();
+    _directives = static_cast<size_t>(std::count(_tokens.types.begin(), _tokens.types.end(), TokenType::DIRECTIVE));
+    reparse(0, _tokens.size(), 0, 0);
+}
+
+void c8::Document::edit(size_t offset, size_t length, std::string_view text)
+{
+    if (offset > _text.size() || length > _text.size() - offset) {
+        throw std::out_of_range("The edit is outside of the document.");
+    }
+
+    /* No token or comment crosses a line so only the lines the edit touches are lexed again */
+    size_t begin = offset;
+    while (begin > 0 && _text[begin - 1] != '\n') {
+        --begin;
+    }
+    const size_t after = offset + length;
+    const size_t end = std::min(_text.size(), after + scan::find_newline(_text.data() + after, _text.size() - after) + 1);
+    const ptrdiff_t byteShift = static_cast<ptrdiff_t>(text.size()) - static_cast<ptrdiff_t>(length);
+
+    const auto& offsets = _tokens.offsets;
+    const size_t first = std::lower_bound(offsets.begin(), offsets.end(), begin) - offsets.begin();
+    const size_t last = std::lower_bound(offsets.begin() + first, offsets.end(), end) - offsets.begin();
+
+    _text.replace(offset, length, text);
+    _tokens.source = _text;
+    const auto lexed = Lexer(std::string_view(_text).substr(0, end + byteShift), begin).tokenize();
+    const bool whole = _directives > 0 || _foldsLabels;
+    _directives -= static_cast<size_t>(std::count(_tokens.types.begin() + first, _tokens.types.begin() + last, TokenType::DIRECTIVE));
+    _directives += static_cast<size_t>(std::count(lexed.types.begin(), lexed.types.end(), TokenType::DIRECTIVE));
+    _tokens.splice(first, last, lexed, byteShift);
+
+    if (_stale || whole) {
+        /* The last edit didn't parse, or the parse can't be picked up in the middle, so there is nothing to keep */
+        _code.clear();
+        _firsts.clear();
+        _symbols.clear();
+        _defs.clear();
+        _refs.clear();
+        reparse(0, _tokens.size(), 0, 0);
+        return;
+    }
+    const ptrdiff_t tokenShift = static_cast<ptrdiff_t>(lexed.size()) - static_cast<ptrdiff_t>(last - first);
+    reparse(first, first + lexed.size(), tokenShift, byteShift);
+}
+
+std::vector<c8::Statement> c8::Document::statements() const
+{
+    std::vector<Statement> statements;
+    statements.reserve(_code.size());
+    for (const auto& ir : _code) {
+        statements.push_back(make_statement(ir, _symbols, _text));
+    }
+    return statements;
+}
+
+/*
+ * Parses the tokens again from the statement that holds token first. The
+ * tokens [first, last) are new, the ones after them are the old tokens moved
+ * by tokenShift. Once the parser is past the new tokens and at a label or
+ * statement that was there before, under the same label, everything after it
+ * parses just as it did, only at another address.
+ */
+void c8::Document::reparse(size_t first, size_t last, ptrdiff_t tokenShift, ptrdiff_t byteShift)
+{
+    _stale = true;
+    if (_directives > 0) {
+        parse_whole();
+        return;
+    }
+
+    const size_t before = std::upper_bound(_firsts.begin(), _firsts.end(), first) - _firsts.begin();
+    const size_t s0 = before == 0 ? 0 : before - 1;
+    /* The new names are views into the text until they are interned in the document */
+    SymbolTable added;
+    const auto resumed_label = [&]() {
+        const SymbolId label = _code[s0].label;
+        return label == NO_SYMBOL ? NO_SYMBOL : added.intern(_symbols.name(label));
+    };
+    Parser parser = before == 0 ? Parser(_tokens) : Parser(_tokens, _firsts[s0], _code[s0].addr, resumed_label());
+    /* Whether a label of the document and one the parser interned in added are the same */
+    const auto same_label = [&](SymbolId label, SymbolId parsed) {
+        if (label == NO_SYMBOL || parsed == NO_SYMBOL) {
+            return label == parsed;
+        }
+        return _symbols.name(label) == added.name(parsed);
+    };
+    const auto by_token = [](const LabelDef& def, size_t token) { return def.token < token; };
+    const size_t d0 = std::lower_bound(_defs.begin(), _defs.end(), parser.position(), by_token) - _defs.begin();
+
+    std::vector<Ir> code;
+    /* Edits are checked one at a time so the first error is all there is to report */
+    Diagnostics diagnostics(1);
+    std::vector<size_t> firsts;
+    std::vector<LabelDef> defs;
+    size_t s1 = _code.size();
+    size_t d1 = _defs.size();
+    uint16_t oldAddress = 0;
+    for (;;) {
+        const size_t pos = parser.position();
+        if (pos >= last) {
+            const size_t old = static_cast<size_t>(static_cast<ptrdiff_t>(pos) - tokenShift);
+            s1 = std::lower_bound(_firsts.begin(), _firsts.end(), old) - _firsts.begin();
+            d1 = std::lower_bound(_defs.begin(), _defs.end(), old, by_token) - _defs.begin();
+            if (d1 < _defs.size() && _defs[d1].token == old) {
+                oldAddress = _symbols.address(_defs[d1].symbol);
+                break;
+            }
+            if (s1 < _code.size() && _firsts[s1] == old && same_label(_code[s1].label, parser.label())) {
+                oldAddress = _code[s1].addr;
+                break;
+            }
+        }
+
+        const size_t count = code.size();
+        const bool more = parser.parse_unit(added, code, diagnostics);
+        if (parser.folds_labels()) {
+            /* The statement needs the address of a label the parser may not have seen, and has to be redone whenever it moves */
+            parse_whole();
+            return;
+        }
+        if (!more) {
+            if (!diagnostics.ok()) {
+                throw diagnostics.first_error();
+            }
+            oldAddress = parser.address();
+            break;
+        }
+        if (code.size() > count) {
+            firsts.push_back(pos);
+        } else if (_tokens.types[pos] == TokenType::LABEL) {
+            defs.push_back({ pos, added.find(_tokens.token(pos)._str) });
+        }
+    }
+
+    /* Labels defined by the statements that are replaced may be defined again */
+    for (auto& def : defs) {
+        const SymbolId id = _symbols.find(added.name(def.symbol));
+        if (id != NO_SYMBOL && _symbols.is_defined(id)) {
+            const auto replaced = [id](const LabelDef& old) { return old.symbol == id; };
+            if (std::none_of(_defs.begin() + d0, _defs.begin() + d1, replaced)) {
+                throw ParseException(std::string(added.name(def.symbol)) + " label is redefined!", _tokens.offsets[def.token]);
+            }
+        }
+    }
+
+    /* Everything after the parser stopped only moves */
+    const uint16_t addressShift = static_cast<uint16_t>(parser.address() - oldAddress);
+    std::vector<SymbolId> moved;
+    for (size_t d = d0; d < d1; ++d) {
+        _symbols.undefine(_defs[d].symbol);
+        moved.push_back(_defs[d].symbol);
+    }
+    for (size_t d = d1; d < _defs.size(); ++d) {
+        _defs[d].token += tokenShift;
+        if (addressShift != 0) {
+            _symbols.set_address(_defs[d].symbol, _symbols.address(_defs[d].symbol) + addressShift);
+        }
+    }
+    for (auto& def : defs) {
+        const SymbolId id = _symbols.intern(added.name(def.symbol));
+        _symbols.define(id, added.address(def.symbol));
+        def.symbol = id;
+        moved.push_back(id);
+    }
+    for (auto& ir : code) {
+        if (ir.symbol != NO_SYMBOL) {
+            ir.symbol = _symbols.intern(added.name(ir.symbol));
+        }
+        if (ir.label != NO_SYMBOL) {
+            ir.label = _symbols.intern(added.name(ir.label));
+        }
+    }
+    if (addressShift != 0 || byteShift != 0 || tokenShift != 0) {
+        for (size_t s = s1; s < _code.size(); ++s) {
+            _code[s].addr += addressShift;
+            _code[s].offset += static_cast<uint32_t>(byteShift);
+            _firsts[s] += tokenShift;
+        }
+    }
+
+    const size_t r0 = std::lower_bound(_refs.begin(), _refs.end(), s0) - _refs.begin();
+    const size_t r1 = std::lower_bound(_refs.begin() + r0, _refs.end(), s1) - _refs.begin();
+    const ptrdiff_t stmtShift = static_cast<ptrdiff_t>(code.size()) - static_cast<ptrdiff_t>(s1 - s0);
+    for (size_t r = r1; r < _refs.size(); ++r) {
+        _refs[r] += stmtShift;
+    }
+    std::vector<size_t> refs;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].symbol != NO_SYMBOL) {
+            refs.push_back(s0 + i);
+        }
+    }
+
+    ::splice(_code, s0, s1, code.begin(), code.end());
+    ::splice(_firsts, s0, s1, firsts.begin(), firsts.end());
+    ::splice(_defs, d0, d1, defs.begin(), defs.end());
+    ::splice(_refs, r0, r1, refs.begin(), refs.end());
+
+    /*
+     * Only the new statements and the ones whose label moved need their
+     * address again. If the code after the edit moved, so did every label
+     * in it and all label operands are looked up again.
+     */
+    std::vector<uint8_t> isMoved(_symbols.size());
+    for (const SymbolId id : moved) {
+        isMoved[id] = true;
+    }
+    const size_t newBegin = r0;
+    const size_t newEnd = r0 + refs.size();
+    const bool allMoved = addressShift != 0;
+    const size_t from = moved.empty() && !allMoved ? newBegin : 0;
+    const size_t to = moved.empty() && !allMoved ? newEnd : _refs.size();
+    const Ir* undefined = nullptr;
+    const Ir* unreachable = nullptr;
+    for (size_t r = from; r < to; ++r) {
+        auto& ir = _code[_refs[r]];
+        const bool mustResolve = (r >= newBegin && r < newEnd) || isMoved[ir.symbol];
+        if (!_symbols.is_defined(ir.symbol)) {
+            /* An edit that loses a label leaves the document stale, so only the labels this one touched can be missing */
+            if (mustResolve && !undefined) {
+                undefined = &ir;
+            }
+        } else if (mustResolve || allMoved) {
+            const int32_t operand = label_operand(ir, _symbols.address(ir.symbol));
+            if (out_of_reach(ir.op, operand) && !unreachable) {
+                unreachable = &ir;
+            }
+            ir.operands[0] = static_cast<uint16_t>(operand);
+        }
+    }
+    if (undefined) {
+        throw ParseException(std::string(_symbols.name(undefined->symbol)) + " is a label that hasn't been defined.", undefined->offset);
+    }
+    if (unreachable) {
+        throw ParseException(out_of_reach_message(_symbols.name(unreachable->symbol), unreachable->operands[1],
+            label_operand(*unreachable, _symbols.address(unreachable->symbol)), unreachable->op), unreachable->offset);
+    }
+    _stale = false;
+}
+
+void c8::Document::parse_whole()
+{
+    _code.clear();
+    _firsts.clear();
+    _symbols.clear();
+    _defs.clear();
+    _refs.clear();
+    Parser parser(_tokens);
+    Diagnostics diagnostics(1);
+    while (parser.parse_unit(_symbols, _code, diagnostics)) {
+    }
+    _foldsLabels = parser.folds_labels();
+    if (!diagnostics.ok()) {
+        throw diagnostics.first_error();
+    }
+    for (auto& ir : _code) {
+        if (ir.symbol == NO_SYMBOL) {
+            continue;
+        }
+        if (!_symbols.is_defined(ir.symbol)) {
+            throw ParseException(std::string(_symbols.name(ir.symbol)) + " is a label that hasn't been defined.", ir.offset);
+        }
+        const int32_t operand = label_operand(ir, _symbols.address(ir.symbol));
+        if (out_of_reach(ir.op, operand)) {
+            throw ParseException(out_of_reach_message(_symbols.name(ir.symbol), ir.operands[1], operand, ir.op), ir.offset);
+        }
+        ir.operands[0] = static_cast<uint16_t>(operand);
+    }
+    _stale = false;
+}
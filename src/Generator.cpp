@@ -1,38 +1,146 @@
 #include "Generator.h"
+#include <utility>
+#include "AssemblerContext.h"
 #include "utils.h"
 #include "opcodes.h"
 
-c8::Instruction::Instruction(c8::Statement stmt, uint16_t op)
-    : stmt(std::move(stmt)), op(op) {}
+c8::Instruction::Instruction(uint32_t index, uint32_t op, uint8_t size)
+    : index(index), op(op), size(size) {}
 
-std::string c8::Instruction::toString() const
+std::string c8::Instruction::toString(const Program& program) const
 {
+    const Ir& ir = program.code[index];
+    const Statement stmt = program.statement(ir);
     const auto& args = stmt.args;
     const std::string line = stmt.op + " " + asCsv(args.begin(), args.end());
     /* LB is the only operation to take single byte values. */
-    if (stmt.op == "LB") {
-        uint8_t value = to8Bit(op);
+    if (size == 1) {
+        uint8_t value = to8Bit(static_cast<uint16_t>(op));
         return fmt("0x%04X | 0x%02X ; %s", stmt.addr, value, line.c_str());
+    } else if (size == 4) {
+        return fmt("0x%04X | 0x%08X ; %s", stmt.addr, op, line.c_str());
     } else {
         return fmt("0x%04X | 0x%04X ; %s", stmt.addr, op, line.c_str());
     }
 }
 
-static uint16_t toBinary(const c8::Statement& stmt)
+uint32_t c8::encode(const Ir& ir)
+{
+    return OPERATORS[static_cast<size_t>(ir.op)](ir.operands);
+}
+
+/*
+ * Writes an opcode from encode() into a ROM image at out. Returns where the
+ * next one goes. Only a target with 4 byte instructions checks for them.
+ */
+template <uint8_t MaxSize = 4>
+static uint8_t* write_op(uint8_t* out, uint8_t size, uint32_t op)
+{
+    /* Chip 8 is big endian, LB only writes the low byte and SYS writes nothing */
+    if (size < 2) {
+        if (size == 1) {
+            *out++ = static_cast<uint8_t>(op);
+        }
+        return out;
+    }
+    if constexpr (MaxSize > 2) {
+        if (size == 4) {
+            *out++ = static_cast<uint8_t>(op >> 24);
+            *out++ = static_cast<uint8_t>(op >> 16);
+        }
+    }
+    *out++ = static_cast<uint8_t>(op >> 8);
+    *out++ = static_cast<uint8_t>(op);
+    return out;
+}
+
+/* Swaps an opcode of size bytes between the host's order and big endian, either way round */
+static uint32_t swap_op(uint32_t op, uint8_t size)
+{
+    return size == 4 ? endi(op) : endi(static_cast<uint16_t>(op));
+}
+
+static uint32_t toBinary(const c8::Ir& ir)
 {
-    uint16_t op = OPERATORS.find(stmt.op)->second(stmt.args);
     /* Correct for the host machine endianness to chip 8 big endian */
-    op = endi(op);
-    return op;
+    return swap_op(c8::encode(ir), c8::spec(ir.op).size);
 }
 
-std::vector<c8::Instruction> c8::generateInstructions(const std::vector<c8::Statement>& statements)
+std::vector<c8::Instruction> c8::generateInstructions(const std::vector<c8::Ir>& code)
 {
     std::vector<c8::Instruction> insts;
-    insts.reserve(statements.size());
-    for (const auto& stmt : statements) {
-        const auto op = toBinary(stmt);
-        insts.emplace_back(stmt, op);
+    insts.reserve(code.size());
+    for (size_t i = 0; i < code.size(); ++i) {
+        insts.emplace_back(static_cast<uint32_t>(i), toBinary(code[i]), spec(code[i].op).size);
     }
     return insts;
-}
\ No newline at end of file
+}
+
+/* generate() for one target, so a CHIP8 ROM looks up its own table and never checks for a 4 byte instruction */
+template <c8::Target T>
+static std::vector<uint8_t> generate_for(const std::vector<c8::Ir>& code)
+{
+    size_t size = 0;
+    for (const auto& ir : code) {
+        size += c8::spec(ir.op).size;
+    }
+    std::vector<uint8_t> rom(size);
+    uint8_t* out = rom.data();
+    for (const auto& ir : code) {
+        const uint32_t op = OPERATORS_FOR<T>[static_cast<size_t>(ir.op)](ir.operands);
+        out = write_op<c8::TargetIsa<T>::MAX_SIZE>(out, c8::spec(ir.op).size, op);
+    }
+    return rom;
+}
+
+std::vector<uint8_t> c8::generate(const std::vector<Ir>& code, Target target)
+{
+    switch (target) {
+    case Target::SCHIP:
+        return generate_for<Target::SCHIP>(code);
+    case Target::XOCHIP:
+        return generate_for<Target::XOCHIP>(code);
+    default:
+        return generate_for<Target::CHIP8>(code);
+    }
+}
+
+std::string c8::listing(const Program& program)
+{
+    std::string text;
+    for (size_t i = 0; i < program.code.size(); ++i) {
+        const Ir& ir = program.code[i];
+        text += Instruction(static_cast<uint32_t>(i), toBinary(ir), spec(ir.op).size).toString(program);
+        text += '\n';
+    }
+    return text;
+}
+
+void c8::emit(std::vector<uint8_t>& rom, const Ir& ir, uint32_t op)
+{
+    const size_t at = rom.size();
+    const uint8_t size = spec(ir.op).size;
+    rom.resize(at + size);
+    write_op(rom.data() + at, size, op);
+}
+
+std::vector<uint8_t> c8::toRom(const std::vector<Instruction>& instructions)
+{
+    size_t size = 0;
+    for (const auto& i : instructions) {
+        size += i.size;
+    }
+    std::vector<uint8_t> rom(size);
+    uint8_t* out = rom.data();
+    for (const auto& i : instructions) {
+        out = write_op(out, i.size, swap_op(i.op, i.size));
+    }
+    return rom;
+}
+
+c8::Result<std::vector<uint8_t>> c8::assemble(Parser& parser, Diagnostics diagnostics)
+{
+    AssemblerContext context(std::move(diagnostics));
+    context.assemble(parser);
+    return context.release();
+}
@@ -0,0 +1,63 @@
+#include "Ir.h"
+#include <cstdlib>
+#include "Lexer.h"
+#include "utils.h"
+
+c8::Statement c8::make_statement(const Ir& ir, const SymbolTable& symbols, std::string_view source)
+{
+    const InstructionSpec& spec = c8::spec(ir.op);
+    std::vector<std::string> args;
+    args.reserve(spec.arity);
+    if (!source.empty() && !ir.expanded) {
+        Lexer lexer(source, ir.offset);
+        /* Skip the mnemonic. An operand runs up to the comma before the next one or the end of its line. */
+        lexer.get_next_token();
+        Token tok = lexer.get_next_token();
+        for (size_t i = 0; i < spec.arity; ++i) {
+            const size_t start = tok._offset;
+            size_t end = start + tok._str.size();
+            for (tok = lexer.get_next_token(); !tok._str.empty() && tok._type != TokenType::COMMA && !lexer.starts_line();
+                 tok = lexer.get_next_token()) {
+                end = tok._offset + tok._str.size();
+            }
+            args.emplace_back(source.substr(start, end - start));
+            tok = lexer.get_next_token();
+        }
+    } else {
+        for (size_t i = 0; i < spec.arity; ++i) {
+            args.push_back(fmt(spec.operands[i] == Operand::REGISTER ? "R%X" : "$%X", ir.operands[i]));
+        }
+    }
+    if (ir.symbol != NO_SYMBOL) {
+        args[0] = from_hex(ir.operands[0]);
+    }
+
+    const std::string label = ir.label == NO_SYMBOL ? "" : std::string(symbols.name(ir.label));
+    return Statement(label, std::string(mnemonic(ir.op)), args, ir.operands, ir.addr, ir.offset, ir.symbol);
+}
+
+std::string c8::out_of_reach_message(std::string_view label, uint16_t offset, int32_t operand, Op op)
+{
+    std::string written(label);
+    if (const auto by = static_cast<int16_t>(offset); by != 0) {
+        written += fmt(" %c $%X", by < 0 ? '-' : '+', std::abs(by));
+    }
+    const std::string_view name = mnemonic(op);
+    return fmt("%s is at %s$%X, which %.*s can't reach! It can only reach up to $%X.", written.c_str(), operand < 0 ? "-" : "", std::abs(operand),
+        static_cast<int>(name.size()), name.data(), operand_max(spec(op).operands[0]));
+}
+
+c8::Statement c8::Program::statement(const Ir& ir) const
+{
+    return make_statement(ir, symbols, text(ir.file));
+}
+
+std::vector<c8::Statement> c8::Program::statements() const
+{
+    std::vector<Statement> statements;
+    statements.reserve(code.size());
+    for (const auto& ir : code) {
+        statements.push_back(statement(ir));
+    }
+    return statements;
+}
@@ -1,42 +1,502 @@
 #include "Lexer.h"
-#include <cctype>
-#include "opcodes.h"
+#include "Directive.h"
+#include "Expression.h"
+#include "Isa.h"
+#include "Scan.h"
+#include "utils.h"
+#include "ParseException.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
 
-c8::Lexer::Lexer(const std::string& buf) 
-    : _buf(buf), _cursor(0) {}
+c8::StreamBuffer::StreamBuffer(std::FILE* fp, size_t capacity)
+    : _fp(fp), _data(capacity), _size(0), _dropped(0), _droppedLines(0), _droppedLineStart(0), _eof(false), _rememberedNext(0)
+{
+    _remembered.fill({ SIZE_MAX, { 0, 0 } });
+}
+
+bool c8::StreamBuffer::refill(size_t n)
+{
+    const size_t lines = scan::count_newlines(_data.data(), n);
+    if (lines > 0) {
+        _droppedLines += lines;
+        size_t last = n;
+        while (_data[last - 1] != '\n') {
+            --last;
+        }
+        _droppedLineStart = _dropped + last;
+    }
+    std::memmove(_data.data(), _data.data() + n, _size - n);
+    _size -= n;
+    _dropped += n;
+    if (_eof) {
+        return false;
+    }
+    if (_size == _data.size()) {
+        throw ParseException(fmt("A token at offset %zu does not fit in the %zu byte input window!", _dropped, _data.size()));
+    }
+
+    const size_t wanted = _data.size() - _size;
+    const size_t got = std::fread(_data.data() + _size, sizeof(char), wanted, _fp);
+    _size += got;
+    /* fread only comes up short at the end of the stream or on an error */
+    _eof = got < wanted;
+    return got > 0;
+}
+
+c8::SourceLocation c8::StreamBuffer::locate(size_t offset) const
+{
+    if (offset < _dropped) {
+        for (const auto& [at, location] : _remembered) {
+            if (at == offset) {
+                return location;
+            }
+        }
+        return { 0, 0 };
+    }
+    if (offset > _dropped + _size) {
+        return { 0, 0 };
+    }
+    const size_t end = offset - _dropped;
+    size_t lineStart = end;
+    while (lineStart > 0 && _data[lineStart - 1] != '\n') {
+        --lineStart;
+    }
+    const size_t line = _droppedLines + scan::count_newlines(_data.data(), end) + 1;
+    const size_t column = lineStart == 0 ? offset - _droppedLineStart + 1 : end - lineStart + 1;
+    return { line, column };
+}
+
+void c8::StreamBuffer::remember(size_t offset)
+{
+    _remembered[_rememberedNext++ % _remembered.size()] = { offset, locate(offset) };
+}
+
+c8::Lexer::Lexer(std::string_view buf)
+    : _buf(buf), _cursor(0), _stream(nullptr), _recentNext(0), _gapStart(SIZE_MAX), _lastStart(SIZE_MAX), _prevGapStart(SIZE_MAX), _prevStart(SIZE_MAX),
+      _gapNewline(false), _prevGapNewline(false)
+{
+    _recent.fill(SIZE_MAX);
+}
+
+c8::Lexer::Lexer(std::string_view buf, size_t start)
+    : Lexer(buf)
+{
+    _cursor = start;
+}
+
+c8::Lexer::Lexer(StreamBuffer& stream)
+    : _buf(stream.window()), _cursor(0), _stream(&stream), _recentNext(0), _texts(TOKEN_HISTORY), _gapStart(SIZE_MAX), _lastStart(SIZE_MAX),
+      _prevGapStart(SIZE_MAX), _prevStart(SIZE_MAX), _gapNewline(false), _prevGapNewline(false)
+{
+    _recent.fill(SIZE_MAX);
+}
+
+/* The characters the operators and brackets of an expression start with */
+static constexpr bool is_arithmetic(char c)
+{
+    switch (c) {
+    case '+': case '-': case '*': case '/': case '%': case '<': case '>':
+    case '&': case '|': case '^': case '~': case '(': case ')':
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Words end at white space, the operand separator, the start of a comment or an operator */
+static constexpr std::array<bool, 256> WORD_ENDS = [] {
+    std::array<bool, 256> ends{};
+    for (size_t c = 0; c < ends.size(); ++c) {
+        const char ch = static_cast<char>(c);
+        ends[c] = c8::scan::is_space(ch) || ch == ',' || ch == ';' || is_arithmetic(ch);
+    }
+    return ends;
+}();
+
+static bool is_word_end(char c)
+{
+    return WORD_ENDS[static_cast<unsigned char>(c)];
+}
+
+/* A decimal number is a word of digits only, up to 65535 */
+static bool parse_decimal(std::string_view word, uint16_t* value)
+{
+    uint32_t n = 0;
+    for (const char c : word) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        n = n * 10 + static_cast<uint32_t>(c - '0');
+        if (n > 0xFFFF) {
+            return false;
+        }
+    }
+    *value = static_cast<uint16_t>(n);
+    return true;
+}
+
+/* A register is 'r' or 'R' followed by a single hex digit */
+static bool parse_register(std::string_view word, uint16_t* index)
+{
+    if (word.size() != 2 || (word[0] != 'r' && word[0] != 'R')) {
+        return false;
+    }
+    return parse_hex(word.substr(1), index);
+}
 
 c8::Token c8::Lexer::get_next_token()
 {
-    skip_white_space();
-
-    std::string tok;
-    tok.reserve(10);
-    while (_cursor < _buf.size() && !isspace(_buf[_cursor])) {
-        tok += _buf[_cursor++];
-        if (tok == ",") {
-            return {TokenType::COMMA, tok};
-        } else if (is_operator(tok)) {
-            return {TokenType::OPERATOR, tok};
-        } else if (tok[0] == '$') {
-            while (_cursor < _buf.size() && is_valid_hex_char(_buf[_cursor])) {
-                tok += _buf[_cursor++];
+    Token tok = lex_token();
+    if (_stream) {
+        /* The window moves the bytes under the token, so it views a copy that lasts until its slot comes round again */
+        std::string& text = _texts[(_recentNext - 1) % TOKEN_HISTORY];
+        text.assign(tok._str);
+        tok._str = text;
+    }
+    return tok;
+}
+
+c8::Token c8::Lexer::lex_token()
+{
+    /* Only where the gap before the token is gets noted; starts_line() looks into it when asked */
+    _prevGapStart = _gapStart;
+    _prevStart = _lastStart;
+    _prevGapNewline = _gapNewline;
+    _gapStart = _lastStart == SIZE_MAX ? SIZE_MAX : base_offset() + _cursor;
+    _gapNewline = false;
+    skip_white_space_and_comments();
+    _lastStart = base_offset() + _cursor;
+
+    if (_stream) {
+        _recent[_recentNext++ % TOKEN_HISTORY] = _stream->dropped() + _cursor;
+    }
+
+    if (_cursor < _buf.size() && _buf[_cursor] == ',') {
+        const size_t offset = base_offset() + _cursor;
+        return {TokenType::COMMA, _buf.substr(_cursor++, 1), 0, offset};
+    }
+    if (_cursor < _buf.size() && _buf[_cursor] == '"') {
+        return get_string();
+    }
+    if (_cursor < _buf.size() && is_arithmetic(_buf[_cursor])) {
+        return get_arithmetic();
+    }
+
+    /* Scan the whole word first so that e.g. 'ADDR' is not split into 'ADD' and 'R' */
+    size_t start = _cursor;
+    for (;;) {
+        while (_cursor < _buf.size() && !is_word_end(_buf[_cursor])) {
+            ++_cursor;
+        }
+        if (_cursor < _buf.size()) {
+            break;
+        }
+        /* A word cut off by the end of a stream window carries on after a refill */
+        const size_t length = _cursor - start;
+        const bool more = fill(start);
+        start = _cursor - length;
+        if (!more) {
+            break;
+        }
+    }
+    const std::string_view word = _buf.substr(start, _cursor - start);
+    const size_t offset = base_offset() + start;
+
+    uint16_t value = 0;
+    if (word.empty()) {
+        return {TokenType::LABEL, word, 0, offset};
+    } else if (word[0] == '$') {
+        /* Malformed or out of range literals are left for the parser to report */
+        if (!parse_hex(word.substr(1), &value)) {
+            return {TokenType::UNKNOWN, word, 0, offset};
+        }
+        return {TokenType::HEX, word, value, offset};
+    } else if (word[0] >= '0' && word[0] <= '9') {
+        /* Words that start with a digit but aren't all digits are still labels */
+        if (parse_decimal(word, &value)) {
+            return {TokenType::HEX, word, value, offset};
+        }
+    } else if (word[0] == '.' || word == "EQU") {
+        /* Anything else starting with a '.' is still a label */
+        const Directive directive = find_directive(word);
+        if (directive != Directive::COUNT) {
+            return {TokenType::DIRECTIVE, word, static_cast<uint16_t>(directive), offset};
+        }
+    }
+    const Op op = find_mnemonic(word);
+    if (op != Op::COUNT) {
+        return {TokenType::OPERATOR, word, static_cast<uint16_t>(op), offset};
+    } else if (parse_register(word, &value)) {
+        return {TokenType::REGISTER, word, value, offset};
+    }
+    return {TokenType::LABEL, word, 0, offset};
+}
+
+/* Strings may hold spaces, commas and semicolons but end with their line. One that isn't closed is UNKNOWN. */
+c8::Token c8::Lexer::get_string()
+{
+    size_t start = _cursor++;
+    for (;;) {
+        while (_cursor < _buf.size() && _buf[_cursor] != '"' && _buf[_cursor] != '\n') {
+            ++_cursor;
+        }
+        if (_cursor < _buf.size()) {
+            break;
+        }
+        const size_t length = _cursor - start;
+        const bool more = fill(start);
+        start = _cursor - length;
+        if (!more) {
+            break;
+        }
+    }
+    const bool closed = _cursor < _buf.size() && _buf[_cursor] == '"';
+    if (closed) {
+        ++_cursor;
+    }
+    return {closed ? TokenType::STRING : TokenType::UNKNOWN, _buf.substr(start, _cursor - start), 0, base_offset() + start};
+}
+
+/* Operators and brackets are a character each, apart from the shifts << and >>. A lone '<' or '>' is UNKNOWN. */
+c8::Token c8::Lexer::get_arithmetic()
+{
+    if (_cursor + 1 == _buf.size()) {
+        fill(_cursor);
+    }
+    const char c = _buf[_cursor];
+    const bool shift = (c == '<' || c == '>') && _cursor + 1 < _buf.size() && _buf[_cursor + 1] == c;
+    const std::string_view text = _buf.substr(_cursor, shift ? 2 : 1);
+    const size_t offset = base_offset() + _cursor;
+    _cursor += text.size();
+    const ArithOp op = find_arith_op(text);
+    if (op == ArithOp::COUNT) {
+        return {TokenType::UNKNOWN, text, 0, offset};
+    }
+    return {TokenType::ARITHMETIC, text, static_cast<uint16_t>(op), offset};
+}
+
+void c8::Lexer::skip_white_space_and_comments()
+{
+    for (;;) {
+        const size_t from = _cursor;
+        _cursor += scan::skip_space(_buf.data() + _cursor, _buf.size() - _cursor);
+        /* A stream may drop the gap before anyone asks whether it starts a line */
+        if (_stream && !_gapNewline) {
+            _gapNewline = scan::find_newline(_buf.data() + from, _cursor - from) < _cursor - from;
+        }
+        if (_cursor == _buf.size()) {
+            if (!fill(_cursor)) {
+                return;
             }
-            return {TokenType::HEX, tok};
-        } else if (is_register(tok)) {
-            return {TokenType::REGISTER, tok};
-        } else if (tok[0] == ';') {
-            while (_cursor < _buf.size() && _buf[_cursor] != '\n') {
-                ++_cursor;
+            continue;
+        }
+        if (_buf[_cursor] != ';') {
+            return;
+        }
+        /* Comments run to the end of the line */
+        skip_line();
+    }
+}
+
+bool c8::Lexer::starts_line() const
+{
+    if (_stream) {
+        return _gapStart == SIZE_MAX || _gapNewline;
+    }
+    return line_gap(_gapStart, _lastStart);
+}
+
+bool c8::Lexer::previous_starts_line() const
+{
+    if (_stream) {
+        return _prevGapStart == SIZE_MAX || _prevGapNewline;
+    }
+    return line_gap(_prevGapStart, _prevStart);
+}
+
+/* Whether the gap between two offsets of a buffer holds a newline, or there was no token before it */
+bool c8::Lexer::line_gap(size_t gapStart, size_t start) const
+{
+    if (gapStart == SIZE_MAX) {
+        return true;
+    }
+    const size_t length = start - gapStart;
+    return scan::find_newline(_buf.data() + gapStart, length) < length;
+}
+
+void c8::Lexer::skip_line()
+{
+    /* The end of the line may be past the end of a stream window */
+    for (;;) {
+        _cursor += scan::find_newline(_buf.data() + _cursor, _buf.size() - _cursor);
+        if (_cursor < _buf.size() || !fill(_cursor)) {
+            return;
+        }
+    }
+}
+
+/*
+ * Makes more input available when lexing a stream. Everything from keep
+ * onwards stays in the window and the cursor is moved along with it. The
+ * recent tokens stay too, so a diagnostic can point at them, unless they
+ * would take up more than half the window, as they do after a long run of
+ * comments. Their text is a copy, so only where they were is remembered.
+ */
+bool c8::Lexer::fill(size_t keep)
+{
+    if (!_stream) {
+        return false;
+    }
+    const size_t keepFrom = _stream->dropped() + keep;
+    size_t keepAt = keepFrom;
+    for (const size_t start : _recent) {
+        keepAt = std::min(keepAt, start);
+    }
+    if (keepFrom - keepAt > _stream->capacity() / 2) {
+        for (const size_t start : _recent) {
+            if (start < keepFrom) {
+                _stream->remember(start);
             }
-            return get_next_token();
         }
+        keepAt = keepFrom;
     }
-    return {c8::TokenType::LABEL, tok};
+    const size_t n = keepAt - _stream->dropped();
+    const bool more = _stream->refill(n);
+    _buf = _stream->window();
+    _cursor -= n;
+    return more;
 }
 
-void c8::Lexer::skip_white_space()
+c8::TokenBuffer c8::Lexer::tokenize()
 {
-    while (_cursor < _buf.size() && isspace(_buf[_cursor])) {
-        ++_cursor;
+    TokenBuffer tokens;
+    tokenize(tokens);
+    return tokens;
+}
+
+void c8::Lexer::tokenize(TokenBuffer& tokens)
+{
+    if (_stream) {
+        throw std::logic_error("A streaming lexer can't be tokenized up front.");
+    }
+    tokens.clear();
+    tokens.source = _buf;
+    /* A rough guess of one token every 8 bytes saves most of the regrowth */
+    tokens.reserve((_buf.size() - _cursor) / 8);
+    tokenize_into(tokens);
+}
+
+c8::TokenBuffer c8::Lexer::tokenize(unsigned threads)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    /* Below this a thread costs more to start than it saves */
+    constexpr size_t MIN_CHUNK_SIZE = 256 * 1024;
+    const size_t remaining = _buf.size() - _cursor;
+    threads = static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(1, remaining / MIN_CHUNK_SIZE)));
+    if (threads <= 1 || _stream) {
+        return tokenize();
+    }
+
+    /*
+     * No token or comment crosses a line so chunks that start right after a
+     * '\n' lex exactly as they would have in one pass over the whole input.
+     */
+    std::vector<size_t> bounds(threads + 1, _buf.size());
+    bounds[0] = _cursor;
+    for (unsigned k = 1; k < threads; ++k) {
+        const size_t target = std::max(bounds[k - 1], _cursor + remaining / threads * k);
+        const size_t newline = target + scan::find_newline(_buf.data() + target, _buf.size() - target);
+        bounds[k] = std::min(_buf.size(), newline + 1);
+    }
+
+    std::vector<TokenBuffer> chunks(threads);
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+    for (unsigned k = 0; k < threads; ++k) {
+        workers.emplace_back([this, k, &bounds, &chunks] {
+            Lexer lexer(_buf.substr(0, bounds[k + 1]), bounds[k]);
+            chunks[k].source = _buf;
+            chunks[k].reserve((bounds[k + 1] - bounds[k]) / 8);
+            lexer.tokenize_into(chunks[k]);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    TokenBuffer tokens;
+    tokens.source = _buf;
+    size_t total = 0;
+    for (const auto& chunk : chunks) {
+        total += chunk.size();
+    }
+    tokens.reserve(total);
+
+    for (const auto& chunk : chunks) {
+        tokens.append(chunk);
+    }
+    _cursor = _buf.size();
+    return tokens;
+}
+
+void c8::Lexer::tokenize_into(TokenBuffer& tokens)
+{
+    for (;;) {
+        const Token tok = get_next_token();
+        if (tok._str.empty()) {
+            break;
+        }
+        tokens.push_back(tok);
+    }
+}
+
+void c8::TokenBuffer::clear()
+{
+    types.clear();
+    offsets.clear();
+    lengths.clear();
+    values.clear();
+}
+
+void c8::TokenBuffer::reserve(size_t n)
+{
+    types.reserve(n);
+    offsets.reserve(n);
+    lengths.reserve(n);
+    values.reserve(n);
+}
+
+void c8::TokenBuffer::push_back(const Token& tok)
+{
+    types.push_back(tok._type);
+    offsets.push_back(static_cast<uint32_t>(tok._offset));
+    lengths.push_back(static_cast<uint32_t>(tok._str.size()));
+    values.push_back(tok._value);
+}
+
+void c8::TokenBuffer::append(const TokenBuffer& other)
+{
+    types.insert(types.end(), other.types.begin(), other.types.end());
+    offsets.insert(offsets.end(), other.offsets.begin(), other.offsets.end());
+    lengths.insert(lengths.end(), other.lengths.begin(), other.lengths.end());
+    values.insert(values.end(), other.values.begin(), other.values.end());
+}
+
+void c8::TokenBuffer::splice(size_t first, size_t last, const TokenBuffer& with, ptrdiff_t shift)
+{
+    /* Offsets wrap around like any unsigned value so a negative shift is just a large one */
+    const uint32_t by = static_cast<uint32_t>(shift);
+    if (by != 0) {
+        for (size_t i = last; i < offsets.size(); ++i) {
+            offsets[i] += by;
+        }
     }
+    ::splice(types, first, last, with.types.begin(), with.types.end());
+    ::splice(offsets, first, last, with.offsets.begin(), with.offsets.end());
+    ::splice(lengths, first, last, with.lengths.begin(), with.lengths.end());
+    ::splice(values, first, last, with.values.begin(), with.values.end());
 }
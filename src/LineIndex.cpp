@@ -0,0 +1,23 @@
+#include "LineIndex.h"
+#include <algorithm>
+#include "Scan.h"
+
+c8::LineIndex::LineIndex(std::string_view source)
+{
+    /* Counting first sizes the index exactly, then the newlines are found one run at a time */
+    _starts.reserve(1 + scan::count_newlines(source.data(), source.size()));
+    _starts.push_back(0);
+    size_t cursor = scan::find_newline(source.data(), source.size());
+    while (cursor < source.size()) {
+        _starts.push_back(++cursor);
+        cursor += scan::find_newline(source.data() + cursor, source.size() - cursor);
+    }
+}
+
+c8::SourceLocation c8::LineIndex::locate(size_t offset) const
+{
+    /* The last line that starts at or before the offset */
+    const auto it = std::upper_bound(_starts.begin(), _starts.end(), offset) - 1;
+    const size_t line = static_cast<size_t>(it - _starts.begin());
+    return { line + 1, offset - *it + 1 };
+}
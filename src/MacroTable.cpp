@@ -0,0 +1,104 @@
+#include "MacroTable.h"
+#include <algorithm>
+
+c8::Token c8::MacroTable::own(const Token& tok)
+{
+    return { tok._type, _storage.copy(tok._str), tok._value, tok._offset };
+}
+
+bool c8::MacroTable::define(std::string_view name, const std::vector<std::string_view>& params, TokenList body)
+{
+    if (find(name) != SIZE_MAX) {
+        return false;
+    }
+    Macro macro;
+    macro.name = _storage.copy(name);
+    for (const auto param : params) {
+        macro.params.push_back(_storage.copy(param));
+    }
+    macro.body = std::move(body);
+    _names.emplace(macro.name, _macros.size());
+    _macros.push_back(std::move(macro));
+    return true;
+}
+
+bool c8::MacroTable::import(const Macro& macro, uint16_t file)
+{
+    TokenList body;
+    body.file = file;
+    body.lineStarts = macro.body.lineStarts;
+    body.tokens.reserve(macro.body.size());
+    for (const Token& tok : macro.body.tokens) {
+        body.tokens.push_back(own(tok));
+    }
+    return define(macro.name, macro.params, std::move(body));
+}
+
+size_t c8::MacroTable::find(std::string_view name) const
+{
+    const auto found = _names.find(name);
+    return found == _names.end() ? SIZE_MAX : found->second;
+}
+
+/* Tokens are told apart by their type and text, which decide what they parse as */
+void c8::MacroTable::append_key(const Token& tok)
+{
+    _key.push_back(static_cast<char>(tok._type));
+    _key.append(tok._str);
+    _key.push_back('\0');
+}
+
+const c8::TokenList& c8::MacroTable::expand(size_t index, const std::vector<Token>& args)
+{
+    _key.assign("M");
+    _key.append(reinterpret_cast<const char*>(&index), sizeof(index));
+    for (const auto& arg : args) {
+        append_key(arg);
+    }
+    const auto found = _lists.find(_key);
+    if (found != _lists.end()) {
+        return found->second;
+    }
+
+    /* The arguments are only copied once, however often they are used */
+    std::vector<Token> owned;
+    owned.reserve(args.size());
+    for (const auto& arg : args) {
+        owned.push_back(own(arg));
+    }
+    const Macro& macro = _macros[index];
+    TokenList expansion;
+    expansion.file = macro.body.file;
+    expansion.tokens.reserve(macro.body.size());
+    expansion.lineStarts = macro.body.lineStarts;
+    for (const Token& tok : macro.body.tokens) {
+        const auto param = tok._type == TokenType::LABEL ? std::find(macro.params.begin(), macro.params.end(), tok._str) : macro.params.end();
+        if (param == macro.params.end()) {
+            expansion.tokens.push_back(tok);
+            continue;
+        }
+        /* Errors point at the parameter in the body, which is in the same file as the rest of it */
+        Token arg = owned[param - macro.params.begin()];
+        arg._offset = tok._offset;
+        expansion.tokens.push_back(arg);
+    }
+    ++_expansions;
+    return _lists.emplace(_key, std::move(expansion)).first->second;
+}
+
+const c8::TokenList& c8::MacroTable::keep(TokenList body)
+{
+    _key.assign("R");
+    _key.append(reinterpret_cast<const char*>(&body.file), sizeof(body.file));
+    for (size_t i = 0; i < body.size(); ++i) {
+        const uint32_t offset = static_cast<uint32_t>(body.tokens[i]._offset);
+        _key.append(reinterpret_cast<const char*>(&offset), sizeof(offset));
+        _key.push_back(static_cast<char>(body.lineStarts[i]));
+        append_key(body.tokens[i]);
+    }
+    const auto found = _lists.find(_key);
+    if (found != _lists.end()) {
+        return found->second;
+    }
+    return _lists.emplace(_key, std::move(body)).first->second;
+}
@@ -0,0 +1,385 @@
+#include "ModuleCache.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+/* FNV-1a over the whole text */
+static uint64_t hash_text(std::string_view text)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (const char c : text) {
+        h = (h ^ static_cast<unsigned char>(c)) * 0x100000001B3ull;
+    }
+    return h;
+}
+
+static bool read_all(const std::string& path, std::string& text)
+{
+    std::FILE* fp = std::fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = std::fseek(fp, 0, SEEK_END) == 0;
+    const long size = ok ? std::ftell(fp) : -1;
+    ok = size >= 0 && std::fseek(fp, 0, SEEK_SET) == 0;
+    if (ok) {
+        text.assign(static_cast<size_t>(size), '\0');
+        text.resize(std::fread(&text[0], sizeof(char), text.size(), fp));
+    }
+    std::fclose(fp);
+    return ok;
+}
+
+c8::ModuleCache::ModuleCache(std::string directory)
+    : _directory(std::move(directory)), _parsed(0), _loaded(0), _hits(0) {}
+
+std::vector<std::string_view> c8::ModuleCache::texts() const
+{
+    std::vector<std::string_view> texts;
+    texts.reserve(_files.size());
+    for (const auto& file : _files) {
+        texts.push_back(file->text);
+    }
+    return texts;
+}
+
+/* The id of the file at path as it is now, or 0 if it can't be read. Files that didn't change keep their id. */
+uint16_t c8::ModuleCache::read(const std::string& path)
+{
+    auto file = std::make_unique<SourceFile>();
+    if (!read_all(path, file->text)) {
+        return 0;
+    }
+    file->hash = hash_text(file->text);
+    const auto known = _paths.find(path);
+    if (known != _paths.end() && this->file(known->second).hash == file->hash) {
+        return known->second;
+    }
+    /* Ids are 16 bits wide in records and diagnostics */
+    if (_files.size() >= UINT16_MAX) {
+        return 0;
+    }
+    file->path = path;
+    _files.push_back(std::move(file));
+    const auto id = static_cast<uint16_t>(_files.size());
+    _paths[path] = id;
+    return id;
+}
+
+/* Maps the files of a module to ids, as long as they all still have the content it was parsed from */
+bool c8::ModuleCache::resolve(const Module& module, const std::string& directory, uint16_t id, std::vector<uint16_t>& files)
+{
+    files.assign(module.files.size(), 0);
+    files[0] = id;
+    for (size_t k = 1; k < module.files.size(); ++k) {
+        const uint16_t dependency = read((fs::path(directory) / module.files[k].path).lexically_normal().string());
+        if (dependency == 0 || file(dependency).hash != module.files[k].hash) {
+            return false;
+        }
+        files[k] = dependency;
+    }
+    return true;
+}
+
+const c8::Module* c8::ModuleCache::load(std::string_view directory, std::string_view path, Target target, size_t offset,
+    Diagnostics& diagnostics, std::vector<uint16_t>& files)
+{
+    const fs::path full = (fs::path(directory) / path).lexically_normal();
+    const std::string name = full.string();
+    if (std::find(_loading.begin(), _loading.end(), name) != _loading.end()) {
+        diagnostics.error("\"" + std::string(path) + "\" includes itself!", offset);
+        return nullptr;
+    }
+    const uint16_t id = read(name);
+    if (id == 0) {
+        diagnostics.error("The included file \"" + std::string(path) + "\" can't be read!", offset);
+        return nullptr;
+    }
+
+    /* Files in the working directory are under "." so that their includes are looked up the same way */
+    const std::string dir = full.has_parent_path() ? full.parent_path().string() : ".";
+    const uint64_t hash = file(id).hash;
+    auto& parsed = _modules[hash];
+    const Module* module = nullptr;
+    for (const auto& candidate : parsed) {
+        if (candidate->target == target && resolve(*candidate, dir, id, files)) {
+            module = candidate.get();
+            ++_hits;
+            break;
+        }
+    }
+    if (!module && !_directory.empty()) {
+        auto saved = read_disk(hash);
+        if (saved && saved->target == target && resolve(*saved, dir, id, files)) {
+            parsed.push_back(std::move(saved));
+            module = parsed.back().get();
+            ++_loaded;
+        }
+    }
+    if (!module) {
+        auto fresh = parse(id, dir, target, diagnostics);
+        if (!fresh) {
+            return nullptr;
+        }
+        resolve(*fresh, dir, id, files);
+        if (!_directory.empty()) {
+            write_disk(*fresh);
+        }
+        parsed.push_back(std::move(fresh));
+        module = parsed.back().get();
+        ++_parsed;
+    }
+
+    /* Whoever is including this depends on the same files */
+    if (!_used.empty()) {
+        _used.back().insert(_used.back().end(), files.begin(), files.end());
+    }
+    return module;
+}
+
+std::unique_ptr<c8::Module> c8::ModuleCache::parse(uint16_t id, const std::string& directory, Target target, Diagnostics& diagnostics)
+{
+    const std::string name = file(id).path;
+    const std::string_view text = file(id).text;
+    TokenBuffer tokens = Lexer(text).tokenize();
+    /* Parsed from address 0 under no label so that it can be placed anywhere */
+    Parser parser(tokens, 0, 0, NO_SYMBOL);
+    parser.set_includes(*this, directory);
+    parser.set_relocatable();
+    parser.set_target(target);
+    auto module = std::make_unique<Module>();
+    module->target = target;
+    Diagnostics errors(diagnostics.error_limit());
+
+    _loading.push_back(name);
+    _used.emplace_back();
+    while (parser.parse_unit(module->symbols, module->code, errors)) {
+    }
+    std::vector<uint16_t> used = std::move(_used.back());
+    _used.pop_back();
+    _loading.pop_back();
+    if (!errors.ok()) {
+        diagnostics.add_errors(errors, id);
+        return nullptr;
+    }
+    module->size = parser.address();
+    module->label = parser.label();
+    module->macros = std::move(parser.macros());
+
+    /* Records of the file itself are file 0; those spliced in from its own includes get the index of their file */
+    module->files.push_back({ fs::path(name).filename().string(), file(id).hash });
+    std::sort(used.begin(), used.end());
+    used.erase(std::unique(used.begin(), used.end()), used.end());
+    used.erase(std::remove(used.begin(), used.end(), id), used.end());
+    for (const uint16_t dependency : used) {
+        module->files.push_back({ fs::path(file(dependency).path).lexically_relative(directory).string(), file(dependency).hash });
+    }
+    const auto local = [&used](uint16_t& file) {
+        if (file != 0) {
+            file = static_cast<uint16_t>(std::lower_bound(used.begin(), used.end(), file) - used.begin() + 1);
+        }
+    };
+    for (Ir& ir : module->code) {
+        local(ir.file);
+    }
+    for (size_t m = 0; m < module->macros.size(); ++m) {
+        local(module->macros.macro(m).body.file);
+    }
+    return module;
+}
+
+namespace {
+    /* The saved form of a module is plain native-endian bytes, guarded by the version and the size of a record */
+    constexpr char MAGIC[8] = { 'C', '8', 'M', 'O', 'D', 'U', 'L', 'E' };
+    /* What each saved symbol is */
+    enum : uint8_t { UNDEFINED, LABEL, CONSTANT };
+
+    struct Writer {
+        std::string out;
+
+        template <typename T>
+        void put(const T& value) { out.append(reinterpret_cast<const char*>(&value), sizeof(T)); }
+        void put_string(std::string_view s)
+        {
+            put(static_cast<uint32_t>(s.size()));
+            out.append(s.data(), s.size());
+        }
+    };
+
+    struct Reader {
+        std::string_view in;
+        size_t at = 0;
+        bool ok = true;
+
+        template <typename T>
+        T get()
+        {
+            T value{};
+            if (in.size() - at < sizeof(T)) {
+                ok = false;
+                return value;
+            }
+            std::memcpy(&value, in.data() + at, sizeof(T));
+            at += sizeof(T);
+            return value;
+        }
+        std::string_view get_string()
+        {
+            const auto size = get<uint32_t>();
+            if (!ok || in.size() - at < size) {
+                ok = false;
+                return {};
+            }
+            at += size;
+            return in.substr(at - size, size);
+        }
+        /* A count of things that take at least each bytes, which can't be more than the bytes left hold */
+        uint32_t get_count(size_t each)
+        {
+            const auto count = get<uint32_t>();
+            ok &= count <= (in.size() - at) / each;
+            return ok ? count : 0;
+        }
+    };
+}
+
+std::string c8::ModuleCache::disk_path(uint64_t hash) const
+{
+    return (fs::path(_directory) / fmt("%016llx.c8m", static_cast<unsigned long long>(hash))).string();
+}
+
+std::unique_ptr<c8::Module> c8::ModuleCache::read_disk(uint64_t hash) const
+{
+    std::string bytes;
+    if (!read_all(disk_path(hash), bytes)) {
+        return nullptr;
+    }
+    Reader in{ bytes };
+    for (const char c : MAGIC) {
+        in.ok &= in.get<char>() == c;
+    }
+    in.ok &= in.get<uint32_t>() == DISK_VERSION && in.get<uint32_t>() == sizeof(Ir);
+    auto module = std::make_unique<Module>();
+    module->size = in.get<uint16_t>();
+    module->label = in.get<SymbolId>();
+    module->target = static_cast<Target>(in.get<uint8_t>());
+    in.ok &= module->target < Target::COUNT;
+    const auto files = in.get_count(sizeof(uint32_t) + sizeof(uint64_t));
+    for (uint32_t k = 0; in.ok && k < files; ++k) {
+        const std::string_view path = in.get_string();
+        module->files.push_back({ std::string(path), in.get<uint64_t>() });
+    }
+    const auto symbols = in.get_count(sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t));
+    for (uint32_t id = 0; in.ok && id < symbols; ++id) {
+        /* A name saved twice would leave the ids after it pointing past the table */
+        in.ok &= module->symbols.intern(in.get_string()) == id;
+        const auto kind = in.get<uint8_t>();
+        const auto address = in.get<uint16_t>();
+        if (!in.ok) {
+            break;
+        }
+        if (kind == CONSTANT) {
+            module->symbols.define_constant(id, address);
+        } else if (kind == LABEL) {
+            module->symbols.define(id, address);
+        }
+        in.ok &= kind <= CONSTANT;
+    }
+    const auto macros = in.get_count(3 * sizeof(uint32_t) + sizeof(uint16_t));
+    for (uint32_t m = 0; in.ok && m < macros; ++m) {
+        const std::string_view name = in.get_string();
+        std::vector<std::string_view> params(in.get_count(sizeof(uint32_t)));
+        for (auto& param : params) {
+            param = in.get_string();
+        }
+        TokenList body;
+        body.file = in.get<uint16_t>();
+        const auto tokens = in.get_count(2 * sizeof(uint8_t) + sizeof(uint16_t) + 2 * sizeof(uint32_t));
+        for (uint32_t t = 0; in.ok && t < tokens; ++t) {
+            const auto type = static_cast<TokenType>(in.get<uint8_t>());
+            in.ok &= type <= TokenType::UNKNOWN;
+            const auto value = in.get<uint16_t>();
+            const auto offset = in.get<uint32_t>();
+            const bool startsLine = in.get<uint8_t>() != 0;
+            body.push_back(module->macros.own({ type, in.get_string(), value, offset }), startsLine);
+        }
+        in.ok &= body.file < module->files.size() && module->macros.define(name, params, std::move(body));
+    }
+    const auto records = in.get<uint32_t>();
+    if (!in.ok || (bytes.size() - in.at) / sizeof(Ir) < records || module->files.empty() || module->files[0].hash != hash) {
+        return nullptr;
+    }
+    module->code.resize(records);
+    std::memcpy(module->code.data(), bytes.data() + in.at, records * sizeof(Ir));
+    /* A damaged file must not send ids out of range */
+    const auto valid = [&module](SymbolId id) { return id == NO_SYMBOL || id < module->symbols.size(); };
+    for (const Ir& ir : module->code) {
+        if (ir.file >= module->files.size() || ir.op >= Op::COUNT || !valid(ir.symbol) || !valid(ir.label)) {
+            return nullptr;
+        }
+    }
+    return valid(module->label) ? std::move(module) : nullptr;
+}
+
+void c8::ModuleCache::write_disk(const Module& module) const
+{
+    Writer out;
+    out.out.append(MAGIC, sizeof(MAGIC));
+    out.put(DISK_VERSION);
+    out.put(static_cast<uint32_t>(sizeof(Ir)));
+    out.put(module.size);
+    out.put(module.label);
+    out.put(static_cast<uint8_t>(module.target));
+    out.put(static_cast<uint32_t>(module.files.size()));
+    for (const auto& file : module.files) {
+        out.put_string(file.path);
+        out.put(file.hash);
+    }
+    out.put(static_cast<uint32_t>(module.symbols.size()));
+    for (SymbolId id = 0; id < module.symbols.size(); ++id) {
+        out.put_string(module.symbols.name(id));
+        out.put<uint8_t>(module.symbols.is_constant(id) ? CONSTANT : module.symbols.is_defined(id) ? LABEL : UNDEFINED);
+        out.put(module.symbols.address(id));
+    }
+    out.put(static_cast<uint32_t>(module.macros.size()));
+    for (size_t m = 0; m < module.macros.size(); ++m) {
+        const Macro& macro = module.macros.macro(m);
+        out.put_string(macro.name);
+        out.put(static_cast<uint32_t>(macro.params.size()));
+        for (const auto param : macro.params) {
+            out.put_string(param);
+        }
+        out.put(macro.body.file);
+        out.put(static_cast<uint32_t>(macro.body.size()));
+        for (size_t t = 0; t < macro.body.size(); ++t) {
+            const Token& tok = macro.body.tokens[t];
+            out.put(static_cast<uint8_t>(tok._type));
+            out.put(tok._value);
+            out.put(static_cast<uint32_t>(tok._offset));
+            out.put(macro.body.lineStarts[t]);
+            out.put_string(tok._str);
+        }
+    }
+    out.put(static_cast<uint32_t>(module.code.size()));
+    out.out.append(reinterpret_cast<const char*>(module.code.data()), module.code.size() * sizeof(Ir));
+
+    /* Written next to its final name and moved there so another run never reads half a module */
+    const std::string path = disk_path(module.files[0].hash);
+    const std::string temporary = path + ".tmp";
+    std::FILE* fp = std::fopen(temporary.c_str(), "wb");
+    if (!fp) {
+        return;
+    }
+    const bool written = std::fwrite(out.out.data(), sizeof(char), out.out.size(), fp) == out.out.size();
+    if (std::fclose(fp) == 0 && written) {
+        std::rename(temporary.c_str(), path.c_str());
+    } else {
+        std::remove(temporary.c_str());
+    }
+}
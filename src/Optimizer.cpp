@@ -0,0 +1,202 @@
+#include "Optimizer.h"
+#include <algorithm>
+#include <vector>
+
+/* How many jumps a chain is followed through, which also stops a loop of jumps from going round forever */
+static constexpr size_t MAX_CHAIN = 16;
+
+static bool is_skip(c8::Op op)
+{
+    switch (op) {
+    case c8::Op::SKE:
+    case c8::Op::SKNE:
+    case c8::Op::SKRE:
+    case c8::Op::SKRNE:
+    case c8::Op::SKK:
+    case c8::Op::SKNK:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Whether record i comes right after a skip, which may jump over it */
+static bool after_skip(const std::vector<c8::Ir>& code, size_t i)
+{
+    while (i > 0 && c8::spec(code[i - 1].op).size == 0) {
+        --i;
+    }
+    return i > 0 && is_skip(code[i - 1].op);
+}
+
+/* The record that starts at an address and takes up bytes, or code.size() if there is none */
+static size_t record_at(const std::vector<c8::Ir>& code, uint16_t address)
+{
+    auto it = std::lower_bound(code.begin(), code.end(), address, [](const c8::Ir& ir, uint16_t a) { return ir.addr < a; });
+    while (it != code.end() && it->addr == address && c8::spec(it->op).size == 0) {
+        ++it;
+    }
+    return it != code.end() && it->addr == address ? static_cast<size_t>(it - code.begin()) : code.size();
+}
+
+/* Whether every address in the code comes from a label, so that the code can be moved by moving the labels */
+static bool movable(const c8::Program& program)
+{
+    if (program.folds_labels) {
+        return false;
+    }
+    for (const auto& ir : program.code) {
+        const auto& spec = c8::spec(ir.op);
+        if (ir.op == c8::Op::ZJMP || (spec.takes_label && spec.size > 0 && ir.symbol == c8::NO_SYMBOL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+c8::OptimizeStats c8::optimize(Program& program)
+{
+    OptimizeStats stats;
+    std::vector<Ir>& code = program.code;
+    /* Records are in address order unless the code ran past the end of memory and wrapped */
+    if (!std::is_sorted(code.begin(), code.end(), [](const Ir& a, const Ir& b) { return a.addr < b.addr; })) {
+        return stats;
+    }
+
+    /* The routine called right before a return can return for the caller */
+    std::vector<bool> tailReturn(code.size());
+    for (size_t i = 0; i + 1 < code.size(); ++i) {
+        if (code[i].op == Op::CALL && code[i + 1].op == Op::RET) {
+            code[i].op = Op::JMP;
+            tailReturn[i + 1] = !after_skip(code, i);
+            ++stats.rewritten;
+        }
+    }
+
+    /* A jump or call to a jump goes to the end of the chain */
+    for (Ir& ir : code) {
+        if (ir.op != Op::JMP && ir.op != Op::CALL) {
+            continue;
+        }
+        const Ir* last = nullptr;
+        uint16_t to = ir.operands[0];
+        for (size_t hops = 0; hops < MAX_CHAIN; ++hops) {
+            const size_t t = record_at(code, to);
+            if (t == code.size() || code[t].op != Op::JMP || code[t].operands[0] == to) {
+                break;
+            }
+            last = &code[t];
+            to = last->operands[0];
+        }
+        if (last && to != ir.operands[0]) {
+            ir.symbol = last->symbol;
+            ir.operands[1] = last->operands[1];
+            ir.operands[0] = to;
+            ++stats.rewritten;
+        }
+    }
+
+    if (!movable(program)) {
+        return stats;
+    }
+    /* The records a label or an address operand is at, which anything may jump to */
+    std::vector<bool> landed(code.size());
+    const auto land = [&code, &landed](uint16_t address) {
+        const size_t t = record_at(code, address);
+        if (t < code.size()) {
+            landed[t] = true;
+        }
+    };
+    for (SymbolId id = 0; id < program.symbols.size(); ++id) {
+        if (program.symbols.is_defined(id) && !program.symbols.is_constant(id)) {
+            land(program.symbols.address(id));
+        }
+    }
+    for (const Ir& ir : code) {
+        if (ir.symbol != NO_SYMBOL) {
+            land(ir.operands[0]);
+        }
+    }
+    std::vector<bool> dropped(code.size());
+    for (size_t i = 0; i < code.size(); ++i) {
+        Ir& ir = code[i];
+        /* Runs of ADD to one register add up to one ADD, and ADD never sets VF so the sum wraps the same */
+        if (ir.op == Op::ADD && !after_skip(code, i)) {
+            size_t j = i + 1;
+            for (; j < code.size() && code[j].op == Op::ADD && code[j].operands[0] == ir.operands[0] && !landed[j]; ++j) {
+                ir.operands[1] = static_cast<uint16_t>((ir.operands[1] + code[j].operands[1]) & 0xFF);
+                dropped[j] = true;
+            }
+            if (j > i + 1) {
+                /* The operands as written no longer add up to it */
+                ir.expanded = true;
+                ++stats.rewritten;
+                i = j - 1;
+            }
+            continue;
+        }
+        /* Nothing can land on a return once the call before it has become a jump, except for a label */
+        dropped[i] = ir.op == Op::RET && tailReturn[i] && !landed[i];
+    }
+    /* A jump over nothing but dropped records goes to the next one. Going backwards lets one dropped jump make another. */
+    for (size_t i = code.size(); i-- > 0;) {
+        if (code[i].op != Op::JMP || after_skip(code, i)) {
+            continue;
+        }
+        const size_t t = record_at(code, code[i].operands[0]);
+        if (t != code.size() && t > i && std::all_of(dropped.begin() + static_cast<std::ptrdiff_t>(i) + 1,
+            dropped.begin() + static_cast<std::ptrdiff_t>(t), [](bool d) { return d; })) {
+            dropped[i] = true;
+        }
+    }
+    if (std::find(dropped.begin(), dropped.end(), true) == dropped.end()) {
+        return stats;
+    }
+
+    /* Where each record goes, and a dropped one where the record after it goes */
+    std::vector<uint16_t> moved(code.size());
+    uint16_t at = code.front().addr;
+    for (size_t i = 0; i < code.size(); ++i) {
+        moved[i] = at;
+        if (!dropped[i]) {
+            at = static_cast<uint16_t>(at + spec(code[i].op).size);
+        }
+    }
+    const auto relocate = [&code, &moved, &dropped](uint16_t address) {
+        auto it = std::upper_bound(code.begin(), code.end(), address, [](uint16_t a, const Ir& ir) { return a < ir.addr; });
+        if (it == code.begin()) {
+            return address;
+        }
+        const auto i = static_cast<size_t>(it - code.begin() - 1);
+        const auto into = static_cast<uint16_t>(address - code[i].addr);
+        const uint16_t size = spec(code[i].op).size;
+        return static_cast<uint16_t>(moved[i] + (dropped[i] ? into - std::min(into, size) : into));
+    };
+
+    /* Operands are moved while the labels are still where they were */
+    for (Ir& ir : code) {
+        if (ir.symbol != NO_SYMBOL) {
+            const uint16_t operand = relocate(ir.operands[0]);
+            ir.operands[1] = static_cast<uint16_t>(operand - relocate(program.symbols.address(ir.symbol)));
+            ir.operands[0] = operand;
+        }
+    }
+    for (SymbolId id = 0; id < program.symbols.size(); ++id) {
+        if (program.symbols.is_defined(id) && !program.symbols.is_constant(id)) {
+            program.symbols.set_address(id, relocate(program.symbols.address(id)));
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (dropped[i]) {
+            ++stats.instructions;
+            stats.bytes += spec(code[i].op).size;
+            continue;
+        }
+        code[kept] = code[i];
+        code[kept].addr = moved[i];
+        ++kept;
+    }
+    code.resize(kept);
+    return stats;
+}
@@ -1,159 +1,1023 @@
 #include "Parser.h"
+#include "Isa.h"
+#include "ModuleCache.h"
 #include "ParseException.h"
+#include "Scan.h"
 #include "utils.h"
+#include "opcodes.h"
+#include <algorithm>
+#include <thread>
 
 c8::Parser::Parser(c8::Lexer lexer)
-    : _lexer(lexer), _currAddress(0x0200) {}
+    : _lexer(std::move(lexer)), _tokens(nullptr), _nextToken(0), _currLabel(NO_SYMBOL), _currAddress(0x0200), _modules(nullptr), _file(0), _framed(false), _frameLineStart(false),
+      _hasAhead(false), _unread(false), _read(0), _unitStart(0), _relocatable(false), _foldsLabels(false), _target(Target::CHIP8) {}
 
-std::vector<c8::Statement> c8::Parser::parse()
+c8::Parser::Parser(const TokenBuffer& tokens)
+    : _lexer(tokens.source), _tokens(&tokens), _nextToken(0), _currLabel(NO_SYMBOL), _currAddress(0x0200), _modules(nullptr), _file(0), _framed(false), _frameLineStart(false),
+      _hasAhead(false), _unread(false), _read(0), _unitStart(0), _relocatable(false), _foldsLabels(false), _target(Target::CHIP8) {}
+
+c8::Parser::Parser(const TokenBuffer& tokens, size_t first, uint16_t address, SymbolId label)
+    : _lexer(tokens.source), _tokens(&tokens), _nextToken(first), _currLabel(label), _currAddress(address), _modules(nullptr), _file(0), _framed(false), _frameLineStart(false),
+      _hasAhead(false), _unread(false), _read(0), _unitStart(0), _relocatable(false), _foldsLabels(false), _target(Target::CHIP8) {}
+
+void c8::Parser::set_includes(ModuleCache& modules, std::string directory)
+{
+    _modules = &modules;
+    _directory = std::move(directory);
+}
+
+c8::Token c8::Parser::next_token()
+{
+    ++_read;
+    while (!_frames.empty()) {
+        Frame& frame = _frames.back();
+        if (frame.next < frame.list->size()) {
+            _framed = true;
+            _file = frame.list->file;
+            _frameLineStart = frame.list->lineStarts[frame.next];
+            return frame.list->tokens[frame.next++];
+        }
+        if (frame.repeats > 0) {
+            --frame.repeats;
+            frame.next = 0;
+            continue;
+        }
+        _frames.pop_back();
+    }
+    _framed = false;
+    _file = 0;
+    if (_tokens) {
+        return _tokens->token(_nextToken++);
+    }
+    ++_nextToken;
+    if (_unread) {
+        _unread = false;
+    } else if (_hasAhead) {
+        _hasAhead = false;
+        _last = _ahead;
+    } else {
+        _last = _lexer.get_next_token();
+    }
+    return _last;
+}
+
+c8::Token c8::Parser::peek_token()
+{
+    for (size_t f = _frames.size(); f-- > 0;) {
+        const Frame& frame = _frames[f];
+        if (frame.next < frame.list->size()) {
+            return frame.list->tokens[frame.next];
+        }
+        if (frame.repeats > 0 && frame.list->size() > 0) {
+            return frame.list->tokens[0];
+        }
+    }
+    if (_tokens) {
+        return _tokens->token(_nextToken);
+    }
+    if (_unread) {
+        return _last;
+    }
+    if (!_hasAhead) {
+        _ahead = _lexer.get_next_token();
+        _hasAhead = true;
+    }
+    return _ahead;
+}
+
+c8::Program c8::Parser::parse()
+{
+    /* Stopping at the first error leaves nothing to recover from */
+    auto result = parse(Diagnostics(1));
+    if (!result.ok()) {
+        throw result.diagnostics.first_error();
+    }
+    return std::move(result.value);
+}
+
+c8::Result<c8::Program> c8::Parser::parse(Diagnostics diagnostics)
+{
+    /* A streaming lexer's tokens don't outlive its window so the names are copied */
+    Result<Program> result{ Program{ {}, SymbolTable(streaming()), streaming() ? std::string_view() : _lexer.source(), {} },
+        std::move(diagnostics) };
+    auto& program = result.value;
+    auto& symbols = program.symbols;
+    while (parse_unit(symbols, program.code, result.diagnostics)) {
+    }
+    program.folds_labels = _foldsLabels;
+    if (_modules) {
+        program.includes = _modules->texts();
+    }
+    if (result.diagnostics.full()) {
+        return result;
+    }
+
+    replaceLabelsWithAddress(program.code, symbols, result.diagnostics);
+
+#ifndef NDEBUG
+    for (SymbolId id = 0; id < symbols.size(); ++id) {
+        LOG("%.*s -> 0x%04X", static_cast<int>(symbols.name(id).size()), symbols.name(id).data(), symbols.address(id));
+    }
+#endif
+    return result;
+}
+
+bool c8::Parser::parse_unit(SymbolTable& symbols, std::vector<Ir>& code, Diagnostics& diagnostics)
 {
-    c8::Token tok;
-    std::map<std::string, uint16_t> labelToAddress;
-    std::vector<Statement> statements;
-    do {
-        tok = _lexer.get_next_token();
-        LOG("Token '%s' retrieved.", tok._str.c_str());
+    const c8::Token tok = next_token();
+    _unitStart = _read;
+    LOG("Token '%.*s' retrieved.", static_cast<int>(tok._str.size()), tok._str.data());
 
-        if (tok._type == c8::TokenType::LABEL) {
-            parse_label(tok._str, labelToAddress);
-        } else if (tok._type == c8::TokenType::OPERATOR) {
-            parse_operator(tok._str, statements);
+    if (tok._str.empty()) {
+        return false;
+    } else if (tok._type == c8::TokenType::LABEL) {
+        /* A defined macro's name expands it; any other word is a label */
+        const size_t macro = _macros.empty() ? SIZE_MAX : _macros.find(tok._str);
+        if (macro != SIZE_MAX) {
+            if (!expand(tok, macro, diagnostics)) {
+                skip_line();
+            }
         } else {
-            throw ParseException(tok._str + " is not a valid starting token! (OPERATOR|LABEL) expected!");
+            /* The name is interned before looking ahead, which can read past a stream's window */
+            const Token name(tok._type, symbols.name(symbols.intern(tok._str)), tok._value, tok._offset);
+            if (uint16_t directive = 0; next_is(c8::TokenType::DIRECTIVE, directive) && directive == static_cast<uint16_t>(Directive::EQU)) {
+                if (!parse_constant(name, next_token(), symbols, diagnostics)) {
+                    skip_line();
+                }
+            } else {
+                parse_label(name, symbols, diagnostics);
+            }
+        }
+    } else if (tok._type == c8::TokenType::OPERATOR) {
+        if (!parse_operator(tok, symbols, code, diagnostics)) {
+            skip_line();
+        }
+    } else if (tok._type == c8::TokenType::DIRECTIVE) {
+        if (!parse_directive(tok, symbols, code, diagnostics)) {
+            skip_line();
         }
-    } while (!tok._str.empty());
+    } else {
+        diagnostics.error(std::string(tok._str) + " is not a valid starting token! (OPERATOR|LABEL) expected!", tok._offset, _file);
+        skip_line();
+    }
+    return !diagnostics.full();
+}
 
-    replaceLabelsWithAddress(statements, labelToAddress);
+bool c8::Parser::next_is(TokenType type, uint16_t& value)
+{
+    /* A buffer has the answer without making a token */
+    if (_tokens && _frames.empty()) {
+        if (_nextToken >= _tokens->size() || _tokens->types[_nextToken] != type) {
+            return false;
+        }
+        value = _tokens->values[_nextToken];
+        return true;
+    }
+    const Token ahead = peek_token();
+    value = ahead._value;
+    return ahead._type == type && !ahead._str.empty();
+}
 
-    for (auto& p : labelToAddress) {
-        LOG("%s -> 0x%04X", p.first.c_str(), p.second);
+bool c8::Parser::starts_line() const
+{
+    if (_framed) {
+        return _frameLineStart;
+    }
+    if (!_tokens) {
+        return _hasAhead ? _lexer.previous_starts_line() : _lexer.starts_line();
     }
-    return statements;
+    const size_t i = _nextToken - 1;
+    if (i == 0 || i >= _tokens->size()) {
+        return true;
+    }
+    const size_t end = _tokens->offsets[i - 1] + _tokens->lengths[i - 1];
+    const size_t gap = _tokens->offsets[i] - end;
+    return scan::find_newline(_tokens->source.data() + end, gap) < gap;
 }
 
-void c8::Parser::parse_label(const std::string& label, std::map<std::string, uint16_t>& labels)
+void c8::Parser::skip_line()
 {
-    if (labels.count(label) > 0) {
-        throw ParseException(label + " label is redefined!");
+    /* A statement cut short by the end of its line read the first token of the next one, which is put back instead */
+    if (_read > _unitStart && starts_line()) {
+        unread();
+        return;
+    }
+    if (_framed) {
+        /* The frame of the last token is still the innermost as frames are only popped when the next token is read */
+        Frame& frame = _frames.back();
+        while (frame.next < frame.list->size() && !frame.list->lineStarts[frame.next]) {
+            ++frame.next;
+        }
+        return;
     }
+    if (!_tokens) {
+        /* A token that was peeked at is either on a later line or on the line to skip */
+        if (_hasAhead && _lexer.starts_line()) {
+            return;
+        }
+        _hasAhead = false;
+        _lexer.skip_line();
+        return;
+    }
+    /* Past the end of the buffer there is nothing left to skip */
+    if (_nextToken == 0 || _nextToken > _tokens->size()) {
+        return;
+    }
+    const std::string_view source = _tokens->source;
+    const size_t end = _tokens->offsets[_nextToken - 1] + _tokens->lengths[_nextToken - 1];
+    const size_t newline = end + scan::find_newline(source.data() + end, source.size() - end);
+    while (_nextToken < _tokens->size() && _tokens->offsets[_nextToken] < newline) {
+        ++_nextToken;
+    }
+}
 
-    _currLabel = label;
-    if (!_currLabel.empty()) {
-        labels.insert({ _currLabel, _currAddress });
+void c8::Parser::unread()
+{
+    --_read;
+    if (_framed) {
+        --_frames.back().next;
+    } else {
+        --_nextToken;
+        _unread = !_tokens;
     }
 }
 
-void c8::Parser::parse_operator(const std::string& op, std::vector<Statement>& statements)
+void c8::Parser::parse_label(const Token& tok, SymbolTable& symbols, Diagnostics& diagnostics)
 {
-    /* Not implemented */
-    if (op == "SYS") {
+    const SymbolId id = symbols.intern(tok._str);
+    /* The first definition stands and what follows is parsed as usual */
+    if (!symbols.define(id, _currAddress)) {
+        diagnostics.error(std::string(tok._str) + " label is redefined!", tok._offset, _file);
         return;
     }
+    _currLabel = id;
+}
+
+/* Whether a statement is the first not to fit in the memory of a target. The rest still assembles. */
+static bool runs_past_memory(uint16_t address, size_t size, const c8::TargetSpec& target)
+{
+    return address <= target.memory_end + 1u && address + size > target.memory_end + 1u;
+}
+
+static void warn_past_memory(size_t offset, const c8::TargetSpec& target, c8::Diagnostics& diagnostics, uint16_t file = 0)
+{
+    diagnostics.warning(fmt("The code runs past $%X, the end of %.*s memory!", target.memory_end, static_cast<int>(target.title.size()),
+        target.title.data()), offset, file);
+}
+
+/* A label the operand of ir can't hold the address of */
+static void report_out_of_reach(const c8::Ir& ir, const c8::SymbolTable& symbols, c8::Diagnostics& diagnostics)
+{
+    diagnostics.error(c8::out_of_reach_message(symbols.name(ir.symbol), ir.operands[1], c8::label_operand(ir, symbols.address(ir.symbol)), ir.op),
+        ir.offset, ir.file);
+}
+
+/* Whether a number fits in an operand that can hold up to max, negative numbers being written in two's complement */
+static bool fits(int32_t number, uint16_t max)
+{
+    return number <= max && number >= -static_cast<int32_t>(max) - 1;
+}
+
+/* How a number that doesn't fit is shown: as it is written if it is a single token, otherwise its value */
+static std::string shown(int32_t number, const c8::Token& first, const c8::Token& last)
+{
+    if (first._offset == last._offset) {
+        return std::string(last._str);
+    }
+    return number < 0 ? fmt("-$%X", -static_cast<int64_t>(number)) : fmt("$%X", number);
+}
+
+static void report_out_of_range(const std::string& number, std::string_view after, uint16_t max, size_t offset,
+    c8::Diagnostics& diagnostics, uint16_t file)
+{
+    diagnostics.error(fmt("%s is out of range after %.*s! The most it can be is $%X.",
+        number.c_str(), static_cast<int>(after.size()), after.data(), max), offset, file);
+}
+
+bool c8::Parser::parse_operator(const Token& tok, SymbolTable& symbols, std::vector<Ir>& code, Diagnostics& diagnostics)
+{
+    const InstructionSpec& spec = c8::spec(static_cast<Op>(tok._value));
+    const TargetSpec& target = target_spec(_target);
+    /* Every target runs the instructions of the ones before it, so a later one is all it takes */
+    if (tok._value >= target.op_count) {
+        const TargetSpec& needed = target_spec(first_target(static_cast<Op>(tok._value)));
+        diagnostics.error(fmt("%.*s is a %.*s instruction! Assemble with --target %.*s to use it.", static_cast<int>(tok._str.size()), tok._str.data(),
+            static_cast<int>(needed.title.size()), needed.title.data(), static_cast<int>(needed.name.size()), needed.name.data()), tok._offset, _file);
+        return false;
+    }
+    /* Not implemented */
+    if (spec.size == 0) {
+        return true;
+    }
+
+    Ir ir{ static_cast<uint32_t>(tok._offset), NO_SYMBOL, _currLabel, _currAddress, {}, static_cast<Op>(tok._value), _framed, _file };
+    /* Operands are separated by commas and errors name whatever came just before */
+    std::string_view after = mnemonic(ir.op);
+    Token last = tok;
+    for (size_t i = 0; i < spec.arity; ++i) {
+        if (i > 0) {
+            auto comma = next_token();
+            if (comma._type != c8::TokenType::COMMA) {
+                diagnostics.error("COMMA expected after " + std::string(last._str) + "!", comma._offset, _file);
+                return false;
+            }
+            after = ",";
+        }
+        if (!parse_operand(spec.operands[i], after, i, ir, last, symbols, diagnostics)) {
+            return false;
+        }
+    }
+
+    code.push_back(ir);
+    if (runs_past_memory(_currAddress, spec.size, target)) {
+        warn_past_memory(tok._offset, target, diagnostics, ir.file);
+    }
+    _currAddress += spec.size;
+    return true;
+}
+
+/*
+ * Parses operand i into ir. An address that is a label, plus or minus an
+ * offset, is left for the label to be resolved; any other operand has to
+ * come to a number that fits.
+ */
+bool c8::Parser::parse_operand(Operand kind, std::string_view after, size_t i, Ir& ir, Token& last, SymbolTable& symbols,
+    Diagnostics& diagnostics)
+{
+    if (kind == Operand::REGISTER) {
+        last = next_token();
+        if (last._type != c8::TokenType::REGISTER) {
+            diagnostics.error("REGISTER expected after " + std::string(after) + "!", last._offset, _file);
+            return false;
+        }
+        ir.operands[i] = last._value;
+        return true;
+    }
+
+    const Token first = next_token();
+    if (is_address(kind) && (first._str.empty()
+        || (first._type != c8::TokenType::HEX && first._type != c8::TokenType::LABEL && first._type != c8::TokenType::ARITHMETIC))) {
+        diagnostics.error(std::string(mnemonic(ir.op)) + " expects a label or hex address as an operand!", first._offset, _file);
+        return false;
+    }
+    /*
+     * Most operands are a lone number or an address that is a lone label,
+     * which need no folding. A label is interned before looking ahead, which
+     * can move a stream's window away from its name.
+     */
+    if (first._type == c8::TokenType::HEX && !first._str.empty()) {
+        if (uint16_t next = 0; !next_is(c8::TokenType::ARITHMETIC, next)) {
+            last = first;
+            const uint16_t max = operand_max(kind);
+            if (first._value > max) {
+                report_out_of_range(std::string(first._str), after, max, first._offset, diagnostics, _file);
+                return false;
+            }
+            ir.operands[i] = first._value;
+            return true;
+        }
+    } else if (is_address(kind) && first._type == c8::TokenType::LABEL) {
+        const SymbolId label = symbols.intern(first._str);
+        if (uint16_t next = 0; !symbols.is_constant(label) && !next_is(c8::TokenType::ARITHMETIC, next)) {
+            last = first;
+            ir.symbol = label;
+            return true;
+        }
+    }
+    Value value;
+    if (!parse_expression(value, first, 1, after, last, 0, symbols, diagnostics)) {
+        return false;
+    }
+    if (is_address(kind) && value.label != NO_SYMBOL) {
+        /* Labels are replaced by their address once they are all known, and the offset is kept in 16 bits */
+        if (!fits(value.number, INT16_MAX)) {
+            report_out_of_range(shown(value.number, first, last), after, INT16_MAX, first._offset, diagnostics, _file);
+            return false;
+        }
+        ir.symbol = value.label;
+        ir.operands[1] = static_cast<uint16_t>(value.number);
+        return true;
+    }
+    if (!fold(value, symbols, diagnostics)) {
+        return false;
+    }
+    /* Only an immediate can be negative; an address below zero would wrap to the top of memory */
+    const uint16_t max = operand_max(kind);
+    if (!fits(value.number, max) || (is_address(kind) && value.number < 0)) {
+        report_out_of_range(shown(value.number, first, last), after, max, first._offset, diagnostics, _file);
+        return false;
+    }
+    ir.operands[i] = static_cast<uint16_t>(value.number & max);
+    return true;
+}
+
+/* An expression that has to come to a number, like the value of a constant */
+bool c8::Parser::parse_number(const Token& first, std::string_view after, int32_t& number, Token& last, SymbolTable& symbols,
+    Diagnostics& diagnostics)
+{
+    Value value;
+    if (!parse_expression(value, first, 1, after, last, 0, symbols, diagnostics) || !fold(value, symbols, diagnostics)) {
+        return false;
+    }
+    number = value.number;
+    return true;
+}
+
+/*
+ * Parses the expression that starts at first, with binary operators that
+ * bind at least as tightly as precedence, by precedence climbing. They are
+ * all left associative. The expression ends at the first token that can't
+ * carry it on, which is left to be read.
+ */
+bool c8::Parser::parse_expression(Value& value, const Token& first, unsigned precedence, std::string_view after, Token& last,
+    unsigned depth, SymbolTable& symbols, Diagnostics& diagnostics)
+{
+    if (!parse_term(value, first, after, last, depth, symbols, diagnostics)) {
+        return false;
+    }
+    uint16_t next = 0;
+    while (next_is(c8::TokenType::ARITHMETIC, next)) {
+        const auto op = static_cast<ArithOp>(next);
+        if (binary_precedence(op) == 0 || binary_precedence(op) < precedence) {
+            break;
+        }
+        const size_t offset = next_token()._offset;
+        Value rhs;
+        if (!parse_expression(rhs, next_token(), binary_precedence(op) + 1, arith_op_name(op), last, depth + 1, symbols, diagnostics)
+            || !combine(op, value, rhs, offset, symbols, diagnostics)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* A number, a name, lo(...) or hi(...), a bracketed expression or a unary operator and its term, starting at tok */
+bool c8::Parser::parse_term(Value& value, const Token& tok, std::string_view after, Token& last, unsigned depth, SymbolTable& symbols,
+    Diagnostics& diagnostics)
+{
+    last = tok;
+    if (depth >= MAX_EXPRESSION_DEPTH) {
+        diagnostics.error("The expression nests too deeply!", tok._offset, _file);
+        return false;
+    }
+    if (tok._type == c8::TokenType::HEX) {
+        value = { tok._value, NO_SYMBOL, tok._offset };
+        return true;
+    }
+    if (tok._type == c8::TokenType::LABEL && !tok._str.empty()) {
+        const bool lo = tok._str == "lo";
+        uint16_t open = 0;
+        if ((lo || tok._str == "hi") && next_is(c8::TokenType::ARITHMETIC, open) && open == static_cast<uint16_t>(ArithOp::OPEN)) {
+            if (!parse_term(value, next_token(), lo ? "lo" : "hi", last, depth + 1, symbols, diagnostics) || !fold(value, symbols, diagnostics)) {
+                return false;
+            }
+            value.number = lo ? value.number & 0xFF : (value.number >> 8) & 0xFF;
+            return true;
+        }
+        const SymbolId id = symbols.intern(tok._str);
+        if (symbols.is_constant(id)) {
+            value = { symbols.address(id), NO_SYMBOL, tok._offset };
+        } else {
+            value = { 0, id, tok._offset };
+        }
+        return true;
+    }
+    if (tok._type == c8::TokenType::ARITHMETIC) {
+        const auto op = static_cast<ArithOp>(tok._value);
+        if (op == ArithOp::OPEN) {
+            if (!parse_expression(value, next_token(), 1, "(", last, depth + 1, symbols, diagnostics)) {
+                return false;
+            }
+            const Token close = next_token();
+            if (close._type != c8::TokenType::ARITHMETIC || close._value != static_cast<uint16_t>(ArithOp::CLOSE)) {
+                diagnostics.error(") expected after " + std::string(last._str) + "!", close._offset, _file);
+                return false;
+            }
+            last = close;
+            return true;
+        }
+        if (op == ArithOp::ADD || op == ArithOp::SUB || op == ArithOp::NOT) {
+            if (!parse_term(value, next_token(), arith_op_name(op), last, depth + 1, symbols, diagnostics)) {
+                return false;
+            }
+            if (op == ArithOp::ADD) {
+                return true;
+            }
+            if (!fold(value, symbols, diagnostics)) {
+                return false;
+            }
+            value.number = op == ArithOp::SUB ? apply(ArithOp::SUB, 0, value.number) : ~value.number;
+            return true;
+        }
+    }
+    if (!tok._str.empty() && tok._str[0] == '$') {
+        diagnostics.error(std::string(tok._str) + " is not a valid hex value! At most 4 hex digits are allowed.", tok._offset, _file);
+    } else {
+        diagnostics.error("HEX expected after " + std::string(after) + "!", tok._offset, _file);
+    }
+    return false;
+}
+
+/* a op b into a. Only label + n, n + label and label - n keep a label; anything else takes the labels' addresses. */
+bool c8::Parser::combine(ArithOp op, Value& a, const Value& b, size_t offset, SymbolTable& symbols, Diagnostics& diagnostics)
+{
+    Value rhs = b;
+    const bool keepsLabel = (op == ArithOp::ADD && (a.label == NO_SYMBOL || rhs.label == NO_SYMBOL))
+        || (op == ArithOp::SUB && rhs.label == NO_SYMBOL);
+    if (!keepsLabel && (!fold(a, symbols, diagnostics) || !fold(rhs, symbols, diagnostics))) {
+        return false;
+    }
+    if ((op == ArithOp::DIV || op == ArithOp::MOD) && rhs.number == 0) {
+        diagnostics.error(std::string(arith_op_name(op)) + " by 0 in an expression!", offset, _file);
+        return false;
+    }
+    if ((op == ArithOp::SHL || op == ArithOp::SHR) && (rhs.number < 0 || rhs.number > 31)) {
+        diagnostics.error(fmt("%s by %d is out of range! A shift can be by 0 to 31.", std::string(arith_op_name(op)).c_str(), rhs.number),
+            offset, _file);
+        return false;
+    }
+    if (a.label == NO_SYMBOL) {
+        a.label = rhs.label;
+        a.offset = rhs.offset;
+    }
+    a.number = apply(op, a.number, rhs.number);
+    return true;
+}
+
+/* Turns label + n into a number with the label's address as it is now */
+bool c8::Parser::fold(Value& value, const SymbolTable& symbols, Diagnostics& diagnostics)
+{
+    if (value.label == NO_SYMBOL) {
+        return true;
+    }
+    _foldsLabels = true;
+    const std::string name(symbols.name(value.label));
+    if (!symbols.is_defined(value.label)) {
+        diagnostics.error(name + " must be defined before it is used here! Only an address can refer to a later label.", value.offset, _file);
+        return false;
+    }
+    if (_relocatable) {
+        diagnostics.error(name + " moves with the file it is in, so it can only be used as an address, plus or minus an offset!",
+            value.offset, _file);
+        return false;
+    }
+    value.number = apply(ArithOp::ADD, value.number, symbols.address(value.label));
+    value.label = NO_SYMBOL;
+    return true;
+}
+
+bool c8::Parser::parse_directive(const Token& tok, SymbolTable& symbols, std::vector<Ir>& code, Diagnostics& diagnostics)
+{
+    switch (static_cast<Directive>(tok._value)) {
+    case Directive::INCLUDE:
+        return parse_include(tok, symbols, code, diagnostics);
+    case Directive::MACRO:
+        return parse_macro(tok, diagnostics);
+    case Directive::REPT:
+        return parse_rept(tok, symbols, diagnostics);
+    case Directive::DEFINE: {
+        const Token name = next_token();
+        if (name._type != c8::TokenType::LABEL || name._str.empty()) {
+            diagnostics.error("LABEL expected after " + std::string(tok._str) + "!", name._offset, _file);
+            return false;
+        }
+        return parse_constant(name, tok, symbols, diagnostics);
+    }
+    case Directive::EQU:
+        diagnostics.error("LABEL expected before EQU!", tok._offset, _file);
+        return false;
+    case Directive::ENDM:
+        diagnostics.error(".endm without .macro!", tok._offset, _file);
+        return false;
+    case Directive::ENDR:
+        diagnostics.error(".endr without .rept!", tok._offset, _file);
+        return false;
+    default:
+        return true;
+    }
+}
+
+/* .macro name a, b with the parameters on its line, then the body up to the matching .endm */
+bool c8::Parser::parse_macro(const Token& tok, Diagnostics& diagnostics)
+{
+    const uint16_t file = _file;
+    const Token name = next_token();
+    if (name._type != c8::TokenType::LABEL || name._str.empty()) {
+        diagnostics.error("LABEL expected after " + std::string(tok._str) + "!", name._offset, _file);
+        return false;
+    }
+    /* The body is read before the macro is defined, by which time a stream has moved on from these */
+    const std::string macro(name._str);
+    std::vector<std::string> params;
+    Token next = next_token();
+    while (!next._str.empty() && !starts_line()) {
+        if (next._type != c8::TokenType::LABEL) {
+            diagnostics.error("LABEL expected after " + (params.empty() ? macro : std::string(",")) + "!", next._offset, _file);
+            return false;
+        }
+        params.emplace_back(next._str);
+        next = next_token();
+        if (next._str.empty() || starts_line()) {
+            break;
+        }
+        if (next._type != c8::TokenType::COMMA) {
+            diagnostics.error("COMMA expected after " + params.back() + "!", next._offset, _file);
+            return false;
+        }
+        next = next_token();
+    }
+
+    TokenList body;
+    body.file = file;
+    if (!collect_body(tok, next, Directive::MACRO, Directive::ENDM, body, diagnostics)) {
+        return false;
+    }
+    const std::vector<std::string_view> views(params.begin(), params.end());
+    if (!_macros.define(macro, views, std::move(body))) {
+        diagnostics.error(macro + " macro is redefined!", name._offset, file);
+    }
+    return true;
+}
+
+/* NAME EQU value or .define NAME value, where the value can use the labels and constants defined before it */
+bool c8::Parser::parse_constant(const Token& name, const Token& tok, SymbolTable& symbols, Diagnostics& diagnostics)
+{
+    /* Interned first, as the name of a stream is gone by the time the value is read */
+    const SymbolId id = symbols.intern(name._str);
+    const size_t offset = name._offset;
+    const std::string_view after = directive_name(static_cast<Directive>(tok._value));
+    const Token first = next_token();
+    Token last = tok;
+    int32_t value = 0;
+    if (!parse_number(first, after, value, last, symbols, diagnostics)) {
+        return false;
+    }
+    /* Constants are 16 bit, so negative ones can still be written */
+    if (!fits(value, 0xFFFF) || value < -0x8000) {
+        report_out_of_range(shown(value, first, last), after, 0xFFFF, first._offset, diagnostics, _file);
+        return false;
+    }
+    if (!symbols.define_constant(id, static_cast<uint16_t>(value))) {
+        diagnostics.error(std::string(symbols.name(id)) + " constant is redefined!", offset, _file);
+    }
+    return true;
+}
+
+/* .rept N followed by the statements to repeat up to the matching .endr */
+bool c8::Parser::parse_rept(const Token& tok, SymbolTable& symbols, Diagnostics& diagnostics)
+{
+    const uint16_t file = _file;
+    const std::string_view after = directive_name(Directive::REPT);
+    /* The count can be any number of tokens, after which a stream has dropped the directive's own */
+    const Token directive(tok._type, after, tok._value, tok._offset);
+    const Token first = next_token();
+    Token last = tok;
+    int32_t count = 0;
+    if (!parse_number(first, after, count, last, symbols, diagnostics)) {
+        return false;
+    }
+    const uint16_t memoryEnd = target_spec(_target).memory_end;
+    if (count < 0 || count > memoryEnd) {
+        report_out_of_range(shown(count, first, last), after, memoryEnd, first._offset, diagnostics, _file);
+        return false;
+    }
+    TokenList body;
+    body.file = file;
+    if (!collect_body(directive, next_token(), Directive::REPT, Directive::ENDR, body, diagnostics)) {
+        return false;
+    }
+    if (count == 0 || body.size() == 0) {
+        return true;
+    }
+    return push_frame(directive, _macros.keep(std::move(body)), static_cast<size_t>(count) - 1, diagnostics);
+}
+
+/*
+ * Reads tokens from next on into body up to the close that matches open.
+ * Tokens from the input are copied into the macro table; those of a frame
+ * already live there.
+ */
+bool c8::Parser::collect_body(const Token& tok, Token next, Directive open, Directive close, TokenList& body, Diagnostics& diagnostics)
+{
+    size_t depth = 0;
+    for (;; next = next_token()) {
+        if (next._str.empty()) {
+            diagnostics.error(std::string(tok._str) + " has no matching " + std::string(directive_name(close)) + "!", tok._offset, body.file);
+            return false;
+        }
+        if (next._type == c8::TokenType::DIRECTIVE) {
+            const auto directive = static_cast<Directive>(next._value);
+            if (directive == open) {
+                ++depth;
+            } else if (directive == close && depth-- == 0) {
+                return true;
+            }
+        }
+        body.push_back(_framed ? next : _macros.own(next), starts_line());
+    }
+}
+
+/* name a, b expands a macro, taking one argument per parameter */
+bool c8::Parser::expand(const Token& tok, size_t macro, Diagnostics& diagnostics)
+{
+    const size_t arity = _macros.macro(macro).params.size();
+    struct Arg {
+        TokenType type;
+        uint16_t value;
+        size_t offset, start, length;
+    };
+    std::vector<Arg> args;
+    _argText.clear();
+    std::string prev(tok._str);
+    for (size_t i = 0; i < arity; ++i) {
+        if (i > 0) {
+            const Token comma = next_token();
+            if (comma._type != c8::TokenType::COMMA) {
+                diagnostics.error("COMMA expected after " + prev + "!", comma._offset, _file);
+                return false;
+            }
+        }
+        const Token arg = next_token();
+        if (arg._type != c8::TokenType::HEX && arg._type != c8::TokenType::REGISTER && arg._type != c8::TokenType::LABEL) {
+            diagnostics.error(std::string(tok._str) + " expects a register, hex value or label as an argument!", arg._offset, _file);
+            return false;
+        }
+        args.push_back({ arg._type, arg._value, arg._offset, _argText.size(), arg._str.size() });
+        _argText.append(arg._str);
+        prev = arg._str;
+    }
+    _args.clear();
+    for (const Arg& arg : args) {
+        _args.emplace_back(arg.type, std::string_view(_argText).substr(arg.start, arg.length), arg.value, arg.offset);
+    }
+    return push_frame(tok, _macros.expand(macro, _args), 0, diagnostics);
+}
+
+bool c8::Parser::push_frame(const Token& tok, const TokenList& list, size_t repeats, Diagnostics& diagnostics)
+{
+    if (_frames.size() >= MAX_EXPANSION_DEPTH) {
+        diagnostics.error(std::string(tok._str) + " expands too deeply! Does a macro expand itself?", tok._offset, _file);
+        return false;
+    }
+    _frames.push_back({ &list, 0, repeats });
+    return true;
+}
+
+bool c8::Parser::parse_include(const Token& tok, SymbolTable& symbols, std::vector<Ir>& code, Diagnostics& diagnostics)
+{
+    const Token name = next_token();
+    if (name._type != c8::TokenType::STRING) {
+        diagnostics.error("STRING expected after " + std::string(tok._str) + "!", name._offset, _file);
+        return false;
+    }
+    if (!_modules) {
+        diagnostics.error("Files can't be included here!", tok._offset, _file);
+        return false;
+    }
+    std::vector<uint16_t> files;
+    const Module* module = _modules->load(_directory, name._str.substr(1, name._str.size() - 2), _target, name._offset, diagnostics, files);
+    /* What went wrong in the included file is already recorded */
+    if (module) {
+        place(*module, files, tok, symbols, code, diagnostics);
+    }
+    return true;
+}
+
+/* Splices a module in at the current address, as if its statements were written in place of the .include */
+void c8::Parser::place(const Module& module, const std::vector<uint16_t>& files, const Token& tok, SymbolTable& symbols,
+    std::vector<Ir>& code, Diagnostics& diagnostics)
+{
+    const uint16_t base = _currAddress;
+    std::vector<SymbolId> ids(module.symbols.size());
+    for (SymbolId id = 0; id < module.symbols.size(); ++id) {
+        ids[id] = symbols.intern(module.symbols.name(id));
+        if (module.symbols.is_constant(id)) {
+            if (!symbols.define_constant(ids[id], module.symbols.address(id))) {
+                diagnostics.error(std::string(module.symbols.name(id)) + " constant is redefined!", tok._offset, _file);
+            }
+        } else if (module.symbols.is_defined(id) && !symbols.define(ids[id], static_cast<uint16_t>(base + module.symbols.address(id)))) {
+            diagnostics.error(std::string(module.symbols.name(id)) + " label is redefined!", tok._offset, _file);
+        }
+    }
+    for (size_t m = 0; m < module.macros.size(); ++m) {
+        const Macro& macro = module.macros.macro(m);
+        if (!_macros.import(macro, files[macro.body.file])) {
+            diagnostics.error(std::string(macro.name) + " macro is redefined!", tok._offset, _file);
+        }
+    }
+    for (Ir ir : module.code) {
+        ir.addr = static_cast<uint16_t>(ir.addr + base);
+        ir.label = ir.label == NO_SYMBOL ? _currLabel : ids[ir.label];
+        if (ir.symbol != NO_SYMBOL) {
+            ir.symbol = ids[ir.symbol];
+        }
+        ir.file = files[ir.file];
+        if (runs_past_memory(ir.addr, spec(ir.op).size, target_spec(_target))) {
+            warn_past_memory(ir.offset, target_spec(_target), diagnostics, ir.file);
+        }
+        code.push_back(ir);
+    }
+    _currAddress = static_cast<uint16_t>(_currAddress + module.size);
+    if (module.label != NO_SYMBOL) {
+        _currLabel = ids[module.label];
+    }
+}
+
+void c8::Parser::replaceLabelsWithAddress(std::vector<Ir>& code, const SymbolTable& symbols, Diagnostics& diagnostics)
+{
+    for (auto& ir : code) {
+        /* Hex addresses were decoded while parsing */
+        if (ir.symbol == NO_SYMBOL) {
+            continue;
+        }
+        if (!symbols.is_defined(ir.symbol)) {
+            diagnostics.error(std::string(symbols.name(ir.symbol)) + " is a label that hasn't been defined.", ir.offset, ir.file);
+            if (diagnostics.full()) {
+                return;
+            }
+            continue;
+        }
+        if (out_of_reach(ir.op, label_operand(ir, symbols.address(ir.symbol)))) {
+            report_out_of_reach(ir, symbols, diagnostics);
+            if (diagnostics.full()) {
+                return;
+            }
+            continue;
+        }
+        ir.operands[0] = static_cast<uint16_t>(label_operand(ir, symbols.address(ir.symbol)));
+    }
+}
+
+/* Whether a label right after token i is an operand: after a comma, an operator of an expression or a mnemonic that can take one */
+static bool takes_operand(const c8::TokenBuffer& tokens, size_t i)
+{
+    switch (tokens.types[i]) {
+    case c8::TokenType::COMMA:
+        return true;
+    case c8::TokenType::ARITHMETIC:
+        return tokens.values[i] != static_cast<uint16_t>(c8::ArithOp::CLOSE);
+    case c8::TokenType::OPERATOR: {
+        const c8::InstructionSpec& spec = c8::spec(static_cast<c8::Op>(tokens.values[i]));
+        return spec.arity > 0 && spec.operands[0] != c8::Operand::REGISTER;
+    }
+    default:
+        return false;
+    }
+}
+
+/*
+ * The first statement at or after token i, not before lo. Operators always
+ * start one, along with the labels defined right before them; a label that
+ * is an operand of the statement before is not one of them.
+ */
+static size_t statement_start(const c8::TokenBuffer& tokens, size_t i, size_t lo)
+{
+    while (i < tokens.size() && tokens.types[i] != c8::TokenType::OPERATOR) {
+        ++i;
+    }
+    if (i == tokens.size()) {
+        return i;
+    }
+    while (i > lo && tokens.types[i - 1] == c8::TokenType::LABEL) {
+        if (i - 1 > 0 && takes_operand(tokens, i - 2)) {
+            break;
+        }
+        --i;
+    }
+    return i;
+}
+
+/* Runs work(k) for every k below n, each on a thread of its own */
+template <typename F>
+static void run_on_threads(unsigned n, F work)
+{
+    std::vector<std::thread> workers;
+    workers.reserve(n);
+    for (unsigned k = 0; k < n; ++k) {
+        workers.emplace_back(work, k);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+unsigned c8::parallel_parse_threads(const TokenBuffer& tokens, unsigned threads)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    /* Below this a thread costs more to start than it saves */
+    constexpr size_t MIN_CHUNK_TOKENS = 32 * 1024;
+    if (tokens.size() < 2 * MIN_CHUNK_TOKENS || std::find(tokens.types.begin(), tokens.types.end(), TokenType::DIRECTIVE) != tokens.types.end()) {
+        return 1;
+    }
+    return static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(1, tokens.size() / MIN_CHUNK_TOKENS)));
+}
+
+c8::Result<c8::Program> c8::parse_parallel(const TokenBuffer& tokens, unsigned threads, Diagnostics diagnostics, Target target)
+{
+    const auto serial = [&]() {
+        Parser parser(tokens);
+        parser.set_target(target);
+        return parser.parse(std::move(diagnostics));
+    };
+    threads = parallel_parse_threads(tokens, threads);
+    if (threads <= 1) {
+        return serial();
+    }
+
+    std::vector<size_t> bounds(threads + 1, tokens.size());
+    bounds[0] = 0;
+    for (unsigned k = 1; k < threads; ++k) {
+        bounds[k] = statement_start(tokens, std::max(bounds[k - 1], tokens.size() / threads * k), bounds[k - 1]);
+    }
+
+    struct Chunk {
+        std::vector<Ir> code;
+        SymbolTable symbols;
+        /* The bytes the chunk takes and the last label it defines, as ids of its own table */
+        uint16_t size = 0;
+        SymbolId label = NO_SYMBOL;
+        bool ok = false;
+        /* The ids of the chunk's symbols in the program and where its records go */
+        std::vector<SymbolId> ids;
+        uint16_t base = 0;
+        SymbolId before = NO_SYMBOL;
+        size_t at = 0;
+        bool resolved = true;
+        /* The statements that run past the end of memory, only known once the chunk is rebased */
+        std::vector<uint32_t> pastMemory;
+    };
+    std::vector<Chunk> chunks(threads);
+    run_on_threads(threads, [&tokens, &bounds, &chunks, target](unsigned k) {
+        Chunk& chunk = chunks[k];
+        Parser parser(tokens, bounds[k], 0, NO_SYMBOL);
+        parser.set_target(target);
+        /* Any error sends the whole source to the serial parser, so the first is enough */
+        Diagnostics errors(1);
+        chunk.code.reserve((bounds[k + 1] - bounds[k]) / 3);
+        while (parser.position() < bounds[k + 1] && parser.parse_unit(chunk.symbols, chunk.code, errors)) {
+        }
+        chunk.ok = errors.ok() && !parser.folds_labels() && parser.position() == bounds[k + 1];
+        chunk.size = parser.address();
+        chunk.label = parser.label();
+    });
+    if (!std::all_of(chunks.begin(), chunks.end(), [](const Chunk& c) { return c.ok; })) {
+        return serial();
+    }
+
+    /* Merging in chunk order numbers the symbols in the order a serial parse first sees them */
+    Program program{ {}, SymbolTable(), tokens.source, {} };
+    uint16_t base = 0x0200;
+    SymbolId label = NO_SYMBOL;
+    size_t at = 0;
+    for (Chunk& chunk : chunks) {
+        chunk.base = base;
+        chunk.before = label;
+        chunk.at = at;
+        chunk.ids.resize(chunk.symbols.size());
+        for (SymbolId id = 0; id < chunk.symbols.size(); ++id) {
+            const SymbolId merged = program.symbols.intern(chunk.symbols.name(id));
+            chunk.ids[id] = merged;
+            if (chunk.symbols.is_defined(id) && !program.symbols.define(merged, static_cast<uint16_t>(chunk.symbols.address(id) + base))) {
+                return serial();
+            }
+        }
+        if (chunk.label != NO_SYMBOL) {
+            label = chunk.ids[chunk.label];
+        }
+        base = static_cast<uint16_t>(base + chunk.size);
+        at += chunk.code.size();
+    }
 
-    std::vector<std::string> args;
-    uint16_t offset = 0;
-    /* Expects no arguments */
-    if (one_of<std::string>(op, { "CLR", "RET" })) {
-
-        /* Expects label or hex */
-    } else if (one_of<std::string>(op, { "JMP", "CALL", "ZJMP", "ILOAD" })) {
-        auto t1 = _lexer.get_next_token();
-        if (t1._type != c8::TokenType::LABEL && t1._type != c8::TokenType::HEX) {
-            throw ParseException(op + " expects a label or hex address as an operand!");
-        }
-        args.push_back(t1._str);
-        offset = 2;
-        /* Expects register, comma, and hex */
-    } else if (one_of<std::string>(op, { "SKE", "SKNE", "SKRE", "LOAD", "ADD", "RAND" })) {
-        auto t1 = _lexer.get_next_token();
-        if (t1._type != c8::TokenType::REGISTER) {
-            throw ParseException("REGISTER expected after " + op + "!\n");
-        }
-        auto t2 = _lexer.get_next_token();
-        if (t2._type != c8::TokenType::COMMA) {
-            throw ParseException("COMMA expected after " + t1._str + "!\n");
-        }
-        auto t3 = _lexer.get_next_token();
-        if (t3._type != c8::TokenType::HEX) {
-            throw ParseException("HEX expected after " + t2._str + "!\n");
-        }
-        args.push_back(t1._str);
-        args.push_back(t3._str);
-        offset = 2;
-        /* Expects 2 registers */
-    } else if (one_of<std::string>(op, { "ASN", "OR", "AND", "XOR", "RADD", "SUB", "RSUB", "SKRNE" })) {
-        auto t1 = _lexer.get_next_token();
-        if (t1._type != c8::TokenType::REGISTER) {
-            throw ParseException("REGISTER expected after " + op + "!\n");
-        }
-        auto t2 = _lexer.get_next_token();
-        if (t2._type != c8::TokenType::COMMA) {
-            throw ParseException("COMMA expected after " + t1._str + "!\n");
-        }
-        auto t3 = _lexer.get_next_token();
-        if (t3._type != c8::TokenType::REGISTER) {
-            throw ParseException("REGISTER expected after " + t2._str + "!\n");
-        }
-        args.push_back(t1._str);
-        args.push_back(t3._str);
-        offset = 2;
-        /* Expects one register */
-    } else if (one_of<std::string>(op, { "SHR", "SHL", "SKK", "SKNK", "DELA", "KEYW", "DELR", "SNDR", "IADD", "SILS", "BCD", "DUMP", "IDUMP" })) {
-        auto t1 = _lexer.get_next_token();
-        if (t1._type != c8::TokenType::REGISTER) {
-            throw ParseException("REGISTER expected after " + op + "!\n");
-        }
-        args.push_back(t1._str);
-        offset = 2;
-    } else if (op == "DRAW") { /* DRAW is the only operator to take three operands */
-        auto t1 = _lexer.get_next_token();
-        if (t1._type != c8::TokenType::REGISTER) {
-            throw ParseException("REGISTER expected after " + op + "!\n");
-        }
-        auto t2 = _lexer.get_next_token();
-        if (t2._type != c8::TokenType::COMMA) {
-            throw ParseException("COMMA expected after " + t1._str + "!\n");
-        }
-        auto t3 = _lexer.get_next_token();
-        if (t3._type != c8::TokenType::REGISTER) {
-            throw ParseException("REGISTER expected after " + t2._str + "!\n");
-        }
-        auto t4 = _lexer.get_next_token();
-        if (t4._type != c8::TokenType::COMMA) {
-            throw ParseException("COMMA expected after " + t3._str + "!\n");
-        }
-        auto t5 = _lexer.get_next_token();
-        if (t5._type != c8::TokenType::HEX) {
-            throw ParseException("HEX expected after " + t4._str + "!\n");
-        }
-        args.push_back(t1._str);
-        args.push_back(t3._str);
-        args.push_back(t5._str);
-        offset = 2;
-    } else { /* Must be special instruction LB */
-        auto t1 = _lexer.get_next_token();
-        if (t1._type != c8::TokenType::HEX) {
-            throw ParseException("HEX expected after " + op + "!\n");
-        }
-        args.push_back(t1._str);
-        offset = 1;
-    }
-
-    /* Now put it into the symbol table */
-    statements.push_back({ _currLabel, op, args, _currAddress });
-    _currAddress += offset;
-}
-
-void c8::Parser::replaceLabelsWithAddress(std::vector<Statement>& statements, const std::map<std::string, uint16_t>& labels)
-{
-    for (auto& stmt : statements) {
-        /* Only these instructions accept labels. */
-        if (one_of<std::string>(stmt.op, { "JMP", "CALL", "ZJMP", "ILOAD" })) {
-            auto label = stmt.args[0];
-            if (labels.count(label) == 0) {
-                throw ParseException(label + " is a label that hasn't been defined.");
-            }
-            stmt.args[0] = from_hex(labels.at(label));
-        }
-    }
-}
\ No newline at end of file
+    program.code.resize(at);
+    const SymbolTable& symbols = program.symbols;
+    const TargetSpec& memory = target_spec(target);
+    run_on_threads(threads, [&chunks, &symbols, &program, &memory](unsigned k) {
+        Chunk& chunk = chunks[k];
+        Ir* out = program.code.data() + chunk.at;
+        for (Ir ir : chunk.code) {
+            ir.addr = static_cast<uint16_t>(ir.addr + chunk.base);
+            ir.label = ir.label == NO_SYMBOL ? chunk.before : chunk.ids[ir.label];
+            if (ir.symbol != NO_SYMBOL) {
+                ir.symbol = chunk.ids[ir.symbol];
+                chunk.resolved &= symbols.is_defined(ir.symbol) && !out_of_reach(ir.op, label_operand(ir, symbols.address(ir.symbol)));
+                ir.operands[0] = static_cast<uint16_t>(label_operand(ir, symbols.address(ir.symbol)));
+            }
+            if (runs_past_memory(ir.addr, spec(ir.op).size, memory)) {
+                chunk.pastMemory.push_back(ir.offset);
+            }
+            *out++ = ir;
+        }
+    });
+    if (!std::all_of(chunks.begin(), chunks.end(), [](const Chunk& c) { return c.resolved; })) {
+        return serial();
+    }
+
+    for (const Chunk& chunk : chunks) {
+        for (const uint32_t offset : chunk.pastMemory) {
+            warn_past_memory(offset, memory, diagnostics);
+        }
+    }
+    return { std::move(program), std::move(diagnostics) };
+}
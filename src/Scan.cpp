@@ -0,0 +1,269 @@
+#include "Scan.h"
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define C8_SCAN_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(C8_SCAN_X86) && defined(__GNUC__)
+#define C8_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define C8_TARGET_AVX2
+#endif
+
+static size_t skip_space_scalar(const char* p, size_t n)
+{
+    size_t i = 0;
+    while (i < n && c8::scan::is_space(p[i])) {
+        ++i;
+    }
+    return i;
+}
+
+static size_t find_newline_scalar(const char* p, size_t n)
+{
+    size_t i = 0;
+    while (i < n && p[i] != '\n') {
+        ++i;
+    }
+    return i;
+}
+
+static size_t count_newlines_scalar(const char* p, size_t n)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        count += p[i] == '\n';
+    }
+    return count;
+}
+
+#ifdef C8_SCAN_X86
+
+static unsigned count_trailing_zeros(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+/*
+ * A byte is white space if it is ' ' or falls in '\t'..'\r'. The range test
+ * is done as an unsigned compare: subtract '\t' and check that the result
+ * is unchanged by min(x, '\r' - '\t').
+ */
+static __m128i space_mask_sse2(__m128i v)
+{
+    const __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    const __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8('\r' - '\t')), shifted);
+    return _mm_or_si128(in_range, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+static size_t skip_space_sse2(const char* p, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(space_mask_sse2(v))) ^ 0xFFFFu;
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + skip_space_scalar(p + i, n - i);
+}
+
+static size_t find_newline_sse2(const char* p, size_t n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + find_newline_scalar(p + i, n - i);
+}
+
+/*
+ * Newline matches are accumulated as -1 per byte lane and folded into 64 bit
+ * sums with psadbw before a lane can wrap around after 255 blocks.
+ */
+static size_t count_newlines_sse2(const char* p, size_t n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    __m128i total = _mm_setzero_si128();
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i lanes = _mm_setzero_si128();
+        for (int block = 0; block < 255 && i + 16 <= n; ++block, i += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(v, nl));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(lanes, _mm_setzero_si128()));
+    }
+    alignas(16) uint64_t sums[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(sums), total);
+    return static_cast<size_t>(sums[0] + sums[1]) + count_newlines_scalar(p + i, n - i);
+}
+
+C8_TARGET_AVX2 static __m256i space_mask_avx2(__m256i v)
+{
+    const __m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    const __m256i in_range = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8('\r' - '\t')), shifted);
+    return _mm256_or_si256(in_range, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+C8_TARGET_AVX2 static size_t skip_space_avx2(const char* p, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(space_mask_avx2(v)));
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + skip_space_sse2(p + i, n - i);
+}
+
+C8_TARGET_AVX2 static size_t find_newline_avx2(const char* p, size_t n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+        if (mask != 0) {
+            return i + count_trailing_zeros(mask);
+        }
+    }
+    return i + find_newline_sse2(p + i, n - i);
+}
+
+C8_TARGET_AVX2 static size_t count_newlines_avx2(const char* p, size_t n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i lanes = _mm256_setzero_si256();
+        for (int block = 0; block < 255 && i + 32 <= n; ++block, i += 32) {
+            const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(v, nl));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(lanes, _mm256_setzero_si256()));
+    }
+    alignas(32) uint64_t sums[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(sums), total);
+    return static_cast<size_t>(sums[0] + sums[1] + sums[2] + sums[3]) + count_newlines_sse2(p + i, n - i);
+}
+
+static bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    /* The OS has to save the YMM registers too */
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static c8::scan::Level detect_level()
+{
+#ifdef C8_SCAN_X86
+    if (cpu_has_avx2()) {
+        return c8::scan::Level::AVX2;
+    }
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+    return c8::scan::Level::SSE2;
+#endif
+#endif
+    return c8::scan::Level::SCALAR;
+}
+
+static const c8::scan::Kernels SCALAR_KERNELS = { skip_space_scalar, find_newline_scalar, count_newlines_scalar };
+#ifdef C8_SCAN_X86
+static const c8::scan::Kernels SSE2_KERNELS = { skip_space_sse2, find_newline_sse2, count_newlines_sse2 };
+static const c8::scan::Kernels AVX2_KERNELS = { skip_space_avx2, find_newline_avx2, count_newlines_avx2 };
+#endif
+
+/* Function local statics so the lexer can be used during static initialization */
+c8::scan::Level c8::scan::detected_level()
+{
+    static const Level level = detect_level();
+    return level;
+}
+
+static const c8::scan::Kernels& active_kernels()
+{
+    static const c8::scan::Kernels& active = c8::scan::kernels(c8::scan::detected_level());
+    return active;
+}
+
+const c8::scan::Kernels& c8::scan::kernels(Level level)
+{
+    if (level > detected_level()) {
+        level = detected_level();
+    }
+    switch (level) {
+#ifdef C8_SCAN_X86
+    case Level::AVX2:
+        return AVX2_KERNELS;
+    case Level::SSE2:
+        return SSE2_KERNELS;
+#endif
+    default:
+        return SCALAR_KERNELS;
+    }
+}
+
+const char* c8::scan::level_name(Level level)
+{
+    switch (level) {
+    case Level::AVX2:
+        return "avx2";
+    case Level::SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+size_t c8::scan::skip_space(const char* p, size_t n)
+{
+    return active_kernels().skip_space(p, n);
+}
+
+size_t c8::scan::find_newline(const char* p, size_t n)
+{
+    return active_kernels().find_newline(p, n);
+}
+
+size_t c8::scan::count_newlines(const char* p, size_t n)
+{
+    return active_kernels().count_newlines(p, n);
+}
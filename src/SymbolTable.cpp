@@ -0,0 +1,101 @@
+#include "SymbolTable.h"
+
+/* FNV-1a, which is plenty for short identifiers */
+static uint64_t hash_name(std::string_view name)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (const char c : name) {
+        h = (h ^ static_cast<unsigned char>(c)) * 0x100000001B3ull;
+    }
+    return h;
+}
+
+c8::SymbolTable::SymbolTable(bool ownsNames)
+    : _ownsNames(ownsNames), _definedCount(0) {}
+
+c8::SymbolId c8::SymbolTable::intern(std::string_view name)
+{
+    if ((_names.size() + 1) * 2 > _slots.size()) {
+        grow();
+    }
+    const uint64_t h = hash_name(name);
+    const size_t mask = _slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        const SymbolId id = _slots[i];
+        if (id == NO_SYMBOL) {
+            const auto added = static_cast<SymbolId>(_names.size());
+            _slots[i] = added;
+            if (_ownsNames) {
+                name = _storage.copy(name);
+            }
+            _names.push_back(name);
+            _hashes.push_back(h);
+            _addresses.push_back(0);
+            _defined.push_back(UNDEFINED);
+            return added;
+        }
+        if (_hashes[id] == h && _names[id] == name) {
+            return id;
+        }
+    }
+}
+
+c8::SymbolId c8::SymbolTable::find(std::string_view name) const
+{
+    if (_slots.empty()) {
+        return NO_SYMBOL;
+    }
+    const uint64_t h = hash_name(name);
+    const size_t mask = _slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        const SymbolId id = _slots[i];
+        if (id == NO_SYMBOL || (_hashes[id] == h && _names[id] == name)) {
+            return id;
+        }
+    }
+}
+
+bool c8::SymbolTable::define(SymbolId id, uint16_t address)
+{
+    if (_defined[id] != UNDEFINED) {
+        return false;
+    }
+    _defined[id] = LABEL;
+    ++_definedCount;
+    _addresses[id] = address;
+    return true;
+}
+
+bool c8::SymbolTable::define_constant(SymbolId id, uint16_t value)
+{
+    if (!define(id, value)) {
+        return false;
+    }
+    _defined[id] = CONSTANT;
+    return true;
+}
+
+void c8::SymbolTable::clear()
+{
+    _names.clear();
+    _hashes.clear();
+    _addresses.clear();
+    _defined.clear();
+    _definedCount = 0;
+    _slots.clear();
+    _storage.reset();
+}
+
+void c8::SymbolTable::grow()
+{
+    const size_t capacity = _slots.empty() ? 64 : _slots.size() * 2;
+    _slots.assign(capacity, NO_SYMBOL);
+    const size_t mask = capacity - 1;
+    for (SymbolId id = 0; id < _names.size(); ++id) {
+        size_t i = _hashes[id] & mask;
+        while (_slots[i] != NO_SYMBOL) {
+            i = (i + 1) & mask;
+        }
+        _slots[i] = id;
+    }
+}
@@ -1,72 +1,85 @@
+#include <chrono>
 #include <cstdlib>
+#include <filesystem>
+#include <optional>
 #include <string>
 #include "utils.h"
 #include "Lexer.h"
 #include "Parser.h"
 #include <exception>
+#include <stdexcept>
 #include "ParseException.h"
 #include "Generator.h"
+#include "ModuleCache.h"
+#include "Optimizer.h"
 
 // the options used by the program
 struct AsmOpts {
     const char* in_file; // the file we are reading from.
     const char* out_file; // the file we are writing to.
+    const char* cache_dir; // where parsed included files are kept between runs, if anywhere.
     bool dump_asm; // flag to determine if we're dumping the assembly to stdout.
     bool show_help; // flag to determine if we're showing help message.
+    bool show_timings; // flag to determine if we're printing how long each stage took.
+    unsigned threads; // the number of threads to lex with, 0 meaning one per core.
+    size_t max_errors; // the number of errors to stop after, 0 meaning no limit.
+    c8::Target target; // the machine the ROM is for.
+    bool optimize; // flag to determine if the peephole pass runs before code generation.
 };
 
-static void write_rom(const std::string& filePath, const std::vector<c8::Instruction>& instructions)
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ms(Clock::time_point begin, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+static void write_rom(const std::string& filePath, const std::vector<uint8_t>& rom)
 {
     std::FILE *fp = std::fopen(filePath.c_str(), "wb");
     if (!fp) {
         throw std::runtime_error("Unable to open file for writing.");
     }
-
-    for (const auto& i : instructions) {
-        auto op = i.op;
-        /* LB is the only operation to take single byte values. */
-        if (i.stmt.op == "LB") {
-            auto value = to8Bit(op);
-            std::fwrite(&value, sizeof(value), 1, fp);
-        } else {
-            std::fwrite(&op, sizeof(op), 1, fp);
-        }
-    }
+    std::fwrite(rom.data(), sizeof(uint8_t), rom.size(), fp);
     std::fclose(fp);
 }
 
-static void dump_asm(const std::vector<c8::Instruction>& instructions)
+static void dump_asm(const c8::Program& program)
 {
     std::puts("-------- ASM Dump --------");
-    for (const auto& i : instructions) {
-        const std::string line = i.toString();
-        std::puts(line.c_str());
-    }
+    std::fputs(c8::listing(program).c_str(), stdout);
     std::puts("-------- End Dump --------");
 }
 
-static std::string read_file(const char *path)
+/* Reads all of a seekable file. Returns false for pipes, FIFOs and the like. */
+static bool read_file(std::FILE *fp, std::string& buf)
 {
-    std::FILE *fp = std::fopen(path, "r");
-    if (!fp) { return ""; }
-
-    fseek(fp, 0, SEEK_END);
+    if (std::fseek(fp, 0, SEEK_END) != 0) {
+        return false;
+    }
     auto fsize = std::ftell(fp);
+    if (fsize < 0) {
+        return false;
+    }
     std::rewind(fp);
 
-    std::string buf(fsize, '\0');
-    std::fread(&buf[0], sizeof(char), fsize, fp);
-    std::fclose(fp);
-
-    return buf;
+    buf.assign(fsize, '\0');
+    buf.resize(std::fread(&buf[0], sizeof(char), fsize, fp));
+    return true;
 }
 
 static bool parse_args(int argc, char **argv, AsmOpts *opts)
 {
     opts->show_help = false;
     opts->dump_asm = false;
+    opts->show_timings = false;
+    opts->optimize = false;
+    opts->threads = 0;
+    opts->max_errors = c8::Diagnostics::DEFAULT_ERROR_LIMIT;
     opts->in_file = nullptr;
     opts->out_file = "a.c8";
+    opts->cache_dir = nullptr;
+    opts->target = c8::Target::CHIP8;
 
     if (argc < 2) {
         return false;
@@ -83,6 +96,42 @@ static bool parse_args(int argc, char **argv, AsmOpts *opts)
         std::string arg(argv[i]);
         if (arg == "--dump-asm") {
             opts->dump_asm = true;
+        } else if (arg == "--time") {
+            opts->show_timings = true;
+        } else if (arg == "-O") {
+            opts->optimize = true;
+        } else if (arg == "--threads" || arg == "-j") {
+            if (argv[i + 1] == nullptr) {
+                std::fprintf(stderr, "Thread flag specified without a thread count!\n");
+                return false;
+            }
+            opts->threads = static_cast<unsigned>(std::strtoul(argv[i + 1], nullptr, 10));
+            ++i;
+        } else if (arg == "--max-errors") {
+            if (argv[i + 1] == nullptr) {
+                std::fprintf(stderr, "Error limit flag specified without a count!\n");
+                return false;
+            }
+            opts->max_errors = std::strtoul(argv[i + 1], nullptr, 10);
+            ++i;
+        } else if (arg == "--cache-dir") {
+            opts->cache_dir = argv[i + 1];
+            if (opts->cache_dir == nullptr) {
+                std::fprintf(stderr, "Cache flag specified without a directory!\n");
+                return false;
+            }
+            ++i;
+        } else if (arg == "--target") {
+            if (argv[i + 1] == nullptr) {
+                std::fprintf(stderr, "Target flag specified without a target!\n");
+                return false;
+            }
+            opts->target = c8::find_target(argv[i + 1]);
+            if (opts->target == c8::Target::COUNT) {
+                std::fprintf(stderr, "Unknown target '%s'!\n", argv[i + 1]);
+                return false;
+            }
+            ++i;
         } else if (arg == "--output" || arg == "-o") {
             opts->out_file = argv[i + 1];
             if (opts->out_file == nullptr) {
@@ -100,18 +149,58 @@ static bool parse_args(int argc, char **argv, AsmOpts *opts)
 static void show_help()
 {
     std::puts("chip8asm is an assembler for the chip 8 VM.");
-    std::puts("The only required argument is the input .asm file.");
+    std::puts("The only required argument is the input .asm file, or '-' to read it from stdin.");
     std::puts("The first argument should be one of the input file or help.");
     std::puts("Here are the supported options:");
     std::puts("   --dump-asm | -dasm -- dumps the assembled statements with memory locations");
     std::puts("   --output | -o -- the name of the output ROM file. By default, it is 'a.rom'");
+    std::puts("   --time -- prints how long lexing, parsing and code generation took to stderr");
+    std::puts("   -O -- rewrites tail calls, jump chains and runs of ADD before generating code and prints what it saved");
+    std::puts("   --threads | -j -- the number of threads used to lex large files. By default, one per core");
+    std::puts("   --max-errors -- the number of errors to stop after, 0 for no limit. By default, 20");
+    std::puts("   --cache-dir -- a directory to keep parsed .include files in between runs");
+    std::puts("   --target -- the machine to assemble for: chip8, schip or xochip. By default, chip8");
     std::puts("   --help | -h -- displays this help screen");
 }
 
+/* Prints a diagnostic prefixed with where it happened when that is known */
+static void print_diagnostic(const char* file, const char* severity, const char* message, c8::SourceLocation loc)
+{
+    if (loc.line == 0) {
+        std::fprintf(stderr, "%s: %s: %s\n", file, severity, message);
+    } else {
+        std::fprintf(stderr, "%s:%zu:%zu: %s: %s\n", file, loc.line, loc.column, severity, message);
+    }
+}
+
+/* Prints every error and warning of a run. text is the source unless it was streamed. */
+static void report(const AsmOpts& opts, const c8::Diagnostics& diagnostics, const std::string& text, const c8::ModuleCache& modules)
+{
+    /* Offsets are only kept cheaply; turning them into lines and columns happens here, once per file */
+    std::vector<std::optional<c8::LineIndex>> lines(modules.file_count() + 1);
+    for (const auto& d : diagnostics.all()) {
+        const std::string_view source = d.file == 0 ? std::string_view(text) : std::string_view(modules.file(d.file).text);
+        c8::SourceLocation loc = d.location;
+        if (loc.line == 0 && d.offset != ParseException::NO_OFFSET && !source.empty()) {
+            if (!lines[d.file]) {
+                lines[d.file].emplace(source);
+            }
+            loc = lines[d.file]->locate(d.offset);
+        }
+        const char* file = d.file == 0 ? opts.in_file : modules.file(d.file).path.c_str();
+        print_diagnostic(file, d.severity == c8::Severity::ERROR ? "error" : "warning", d.message.c_str(), loc);
+    }
+    if (diagnostics.full()) {
+        std::fprintf(stderr, "%s: stopped after %zu errors, see --max-errors\n", opts.in_file, diagnostics.errors());
+    }
+}
+
 int main(int argc, char **argv)
 {
+    AsmOpts opts;
+    std::string text;
+    std::optional<c8::StreamBuffer> stream;
     try {
-        AsmOpts opts;
         if (!parse_args(argc, argv, &opts)) {
             show_help();
             return EXIT_FAILURE;
@@ -122,29 +211,100 @@ int main(int argc, char **argv)
             return EXIT_SUCCESS;
         }
 
-        const std::string text = read_file(opts.in_file);
-        if (text.empty()) {
+        /* '-' reads the source from stdin */
+        const bool from_stdin = std::string(opts.in_file) == "-";
+        std::FILE *in = from_stdin ? stdin : std::fopen(opts.in_file, "r");
+        if (!in) {
             std::fprintf(stderr, "Error reading from '%s'\n", opts.in_file);
             return EXIT_FAILURE;
         }
 
-        c8::Lexer lexer(text);
-        c8::Parser parser(text);
-        auto statements = parser.parse();
-        auto instructions = c8::generateInstructions(statements);
+        /* The listing needs every statement, otherwise they are encoded as they are parsed */
+        std::optional<c8::TokenBuffer> tokens;
+        std::optional<c8::Parser> parser;
+        c8::ModuleCache modules(opts.cache_dir ? opts.cache_dir : "");
+        const auto lexStart = Clock::now();
+        if (read_file(in, text)) {
+            if (text.empty()) {
+                std::fprintf(stderr, "Error reading from '%s'\n", opts.in_file);
+                return EXIT_FAILURE;
+            }
+            tokens = c8::Lexer{ text }.tokenize(opts.threads);
+            parser.emplace(*tokens);
+            if (opts.show_timings) {
+                std::fprintf(stderr, "lex:      %8.3f ms (%zu tokens)\n", elapsed_ms(lexStart, Clock::now()), tokens->size());
+            }
+        } else {
+            /* Pipes can't be read up front so lex and parse them as the input arrives */
+            stream.emplace(in);
+            parser.emplace(c8::Lexer{ *stream });
+        }
+        /* Included files are found next to the source, or in the working directory for stdin */
+        const std::filesystem::path inDir = std::filesystem::path(opts.in_file).parent_path();
+        parser->set_includes(modules, from_stdin || inDir.empty() ? "." : inDir.string());
+        parser->set_target(opts.target);
+
+        c8::Diagnostics diagnostics(opts.max_errors);
+        if (stream) {
+            /* The window moves on, so stream offsets are located while they are still in it */
+            diagnostics.set_locator([&stream](size_t offset) { return stream->locate(offset); });
+        }
+
+        /* Large buffers parse faster in parallel than in one pass, and the listing and -O need the statements anyway */
+        const bool parallel = tokens && c8::parallel_parse_threads(*tokens, opts.threads) > 1;
+        std::vector<uint8_t> rom;
+        const auto parseStart = Clock::now();
+        if (opts.dump_asm || opts.optimize || parallel) {
+            auto result = parallel ? c8::parse_parallel(*tokens, opts.threads, std::move(diagnostics), opts.target) : parser->parse(std::move(diagnostics));
+            diagnostics = std::move(result.diagnostics);
+            if (diagnostics.ok()) {
+                c8::Program& program = result.value;
+                if (opts.optimize) {
+                    const c8::OptimizeStats saved = c8::optimize(program);
+                    std::printf("Optimized: %zu instructions rewritten, %zu removed, %zu bytes saved.\n", saved.rewritten, saved.instructions,
+                        saved.bytes);
+                }
+                const auto generateStart = Clock::now();
+                rom = c8::generate(program.code, opts.target);
+                if (opts.show_timings) {
+                    std::fprintf(stderr, tokens ? "parse:    %8.3f ms (%zu statements)\n" : "lex+parse: %7.3f ms (%zu statements)\n",
+                        elapsed_ms(parseStart, generateStart), program.code.size());
+                    std::fprintf(stderr, "generate: %8.3f ms\n", elapsed_ms(generateStart, Clock::now()));
+                }
+                if (opts.dump_asm) {
+                    dump_asm(program);
+                }
+            }
+        } else {
+            auto result = c8::assemble(*parser, std::move(diagnostics));
+            rom = std::move(result.value);
+            diagnostics = std::move(result.diagnostics);
+            if (opts.show_timings) {
+                std::fprintf(stderr, "assemble: %8.3f ms (%zu bytes)\n", elapsed_ms(parseStart, Clock::now()), rom.size());
+            }
+        }
+        if (!from_stdin) {
+            std::fclose(in);
+        }
 
-        write_rom(opts.out_file, instructions);
-        if (opts.dump_asm) {
-            dump_asm(instructions);
+        report(opts, diagnostics, text, modules);
+        if (!diagnostics.ok()) {
+            return EXIT_FAILURE;
         }
+
+        write_rom(opts.out_file, rom);
         
         std::puts("Done.");
 
     } catch (const ParseException& e) {
-        std::fprintf(stderr, "Caught Parse Exception: %s\n", e.what());
+        /* Only a token too long for the stream window is still thrown */
+        print_diagnostic(opts.in_file, "error", e.what(), stream ? stream->locate(e.offset()) : c8::SourceLocation{ 0, 0 });
+        return EXIT_FAILURE;
     } catch (const std::exception& e) {
         std::fprintf(stderr, "Caught generic exception: %s\n", e.what());
+        return EXIT_FAILURE;
     } catch (...) {
         std::fprintf(stderr, "Unknown error! Please retry!\n");
+        return EXIT_FAILURE;
     }
 }
@@ -1,9 +1,26 @@
 #define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
 #include "test/catch.hpp"
 #include "Lexer.h"
 #include "opcodes.h"
 #include "Parser.h"
+#include "Document.h"
+#include "SymbolTable.h"
 #include "Generator.h"
+#include "BatchEncoder.h"
+#include "AssemblerContext.h"
+#include "Arena.h"
+#include "ModuleCache.h"
+#include "Optimizer.h"
+#include "Scan.h"
+#include "ParseException.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <new>
 
 TEST_CASE("LexerIntegrationTest")
 {
@@ -124,6 +141,381 @@ sprite
     REQUIRE("$90" == tok._str);
 }
 
+TEST_CASE("LexerTokensViewSource")
+{
+    const std::string text = "start\n    LOAD r0, $A ; comment\n";
+    c8::Lexer lex(text);
+
+    auto tok = lex.get_next_token();
+    REQUIRE(c8::TokenType::LABEL == tok._type);
+    REQUIRE(text.data() == tok._str.data());
+
+    tok = lex.get_next_token();
+    REQUIRE(c8::TokenType::OPERATOR == tok._type);
+    REQUIRE(text.data() + 10 == tok._str.data());
+    REQUIRE(4 == tok._str.size());
+}
+
+TEST_CASE("LexerScansWholeWords")
+{
+    const std::string text = "CALL ADDR\nADDR LB $FF";
+    c8::Lexer lex(text);
+
+    auto tok = lex.get_next_token();
+    REQUIRE(c8::TokenType::OPERATOR == tok._type);
+
+    tok = lex.get_next_token();
+    REQUIRE(c8::TokenType::LABEL == tok._type);
+    REQUIRE("ADDR" == tok._str);
+
+    tok = lex.get_next_token();
+    REQUIRE(c8::TokenType::LABEL == tok._type);
+    REQUIRE("ADDR" == tok._str);
+
+    tok = lex.get_next_token();
+    REQUIRE(c8::TokenType::OPERATOR == tok._type);
+    REQUIRE("LB" == tok._str);
+}
+
+TEST_CASE("LexerRejectsMalformedHex")
+{
+    c8::Lexer lex("$12G $");
+    REQUIRE(c8::TokenType::UNKNOWN == lex.get_next_token()._type);
+    REQUIRE(c8::TokenType::UNKNOWN == lex.get_next_token()._type);
+}
+
+TEST_CASE("LexerSkipsConsecutiveComments")
+{
+    std::string text;
+    for (int i = 0; i < 1000; ++i) {
+        text += "; a comment line with\ttabs and spaces\r\n";
+    }
+    text += "CLR ;trailing";
+    c8::Lexer lex(text);
+
+    auto tok = lex.get_next_token();
+    REQUIRE(c8::TokenType::OPERATOR == tok._type);
+    REQUIRE("CLR" == tok._str);
+    REQUIRE(lex.get_next_token()._str.empty());
+}
+
+TEST_CASE("ScanKernelsMatchScalar")
+{
+    const char alphabet[] = { ' ', '\t', '\n', '\v', '\f', '\r', ';', 'A', '\x85', '\xA0' };
+    std::string text;
+    unsigned seed = 12345;
+    for (int i = 0; i < 4096; ++i) {
+        seed = seed * 1103515245 + 12345;
+        /* Long runs of one character so the vector loops actually get exercised */
+        text.append((seed >> 8) % 70, alphabet[(seed >> 16) % sizeof(alphabet)]);
+    }
+
+    const auto& scalar = c8::scan::kernels(c8::scan::Level::SCALAR);
+    for (auto level : { c8::scan::Level::SSE2, c8::scan::Level::AVX2 }) {
+        const auto& k = c8::scan::kernels(level);
+        for (size_t start = 0; start < text.size(); start += 7) {
+            const size_t n = text.size() - start;
+            REQUIRE(scalar.skip_space(text.data() + start, n) == k.skip_space(text.data() + start, n));
+            REQUIRE(scalar.find_newline(text.data() + start, n) == k.find_newline(text.data() + start, n));
+            REQUIRE(scalar.count_newlines(text.data() + start, n) == k.count_newlines(text.data() + start, n));
+        }
+    }
+}
+
+TEST_CASE("ScanIsSpaceMatchesCLocale")
+{
+    for (int c = 0; c < 256; ++c) {
+        REQUIRE((std::isspace(c) != 0) == c8::scan::is_space(static_cast<char>(c)));
+    }
+}
+
+TEST_CASE("TokenizeMatchesPullLexer")
+{
+    const std::string text = "start\n  ; note\n  LOAD r0, $AB\n\n  JMP start ; loop\n";
+    const auto tokens = c8::Lexer(text).tokenize();
+
+    c8::Lexer lex(text);
+    REQUIRE(7 == tokens.size());
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const auto tok = lex.get_next_token();
+        REQUIRE(tok._type == tokens.types[i]);
+        REQUIRE(tok._str == tokens.token(i)._str);
+    }
+    REQUIRE(tokens.token(tokens.size())._str.empty());
+
+    REQUIRE(static_cast<uint16_t>(c8::Op::LOAD) == tokens.values[1]);
+    REQUIRE(0x0 == tokens.values[2]);
+    REQUIRE(0xAB == tokens.values[4]);
+
+    REQUIRE(0 == tokens.offsets[0]);
+    REQUIRE(17 == tokens.offsets[1]);
+    REQUIRE(text.find("JMP") == tokens.token(5)._offset);
+}
+
+TEST_CASE("LineIndexLocatesOffsets")
+{
+    const std::string text = "start\n  ; note\n  LOAD r0, $AB\n\n  JMP start";
+    const c8::LineIndex index(text);
+    REQUIRE(5 == index.line_count());
+
+    auto loc = index.locate(0);
+    REQUIRE(1 == loc.line);
+    REQUIRE(1 == loc.column);
+    loc = index.locate(text.find("$AB"));
+    REQUIRE(3 == loc.line);
+    REQUIRE(12 == loc.column);
+    loc = index.locate(text.find("JMP"));
+    REQUIRE(5 == loc.line);
+    REQUIRE(3 == loc.column);
+    loc = index.locate(text.size());
+    REQUIRE(5 == loc.line);
+    REQUIRE(12 == loc.column);
+}
+
+TEST_CASE("ParallelTokenizeMatchesSerial")
+{
+    std::string text;
+    for (int i = 0; i < 40000; ++i) {
+        text += "label_" + std::to_string(i) + " ; a label\n    DRAW r0, r1, $5\n    LB $F0 ; a byte\n\n";
+    }
+    const auto serial = c8::Lexer(text).tokenize();
+
+    for (unsigned threads : { 2u, 3u, 8u, 0u }) {
+        const auto parallel = c8::Lexer(text).tokenize(threads);
+        REQUIRE(serial.types == parallel.types);
+        REQUIRE(serial.offsets == parallel.offsets);
+        REQUIRE(serial.lengths == parallel.lengths);
+        REQUIRE(serial.values == parallel.values);
+    }
+}
+
+static void require_same_program(const c8::Result<c8::Program>& expected, const c8::Result<c8::Program>& actual)
+{
+    REQUIRE(expected.value.code.size() == actual.value.code.size());
+    for (size_t i = 0; i < expected.value.code.size(); ++i) {
+        const auto& e = expected.value.code[i];
+        const auto& a = actual.value.code[i];
+        REQUIRE((e.offset == a.offset && e.symbol == a.symbol && e.label == a.label && e.addr == a.addr && e.operands == a.operands && e.op == a.op));
+    }
+    REQUIRE(expected.value.symbols.size() == actual.value.symbols.size());
+    for (c8::SymbolId id = 0; id < expected.value.symbols.size(); ++id) {
+        REQUIRE(expected.value.symbols.name(id) == actual.value.symbols.name(id));
+        REQUIRE(expected.value.symbols.address(id) == actual.value.symbols.address(id));
+    }
+    const auto& ed = expected.diagnostics.all();
+    const auto& ad = actual.diagnostics.all();
+    REQUIRE(ed.size() == ad.size());
+    for (size_t i = 0; i < ed.size(); ++i) {
+        REQUIRE(ed[i].message == ad[i].message);
+        REQUIRE(ed[i].offset == ad[i].offset);
+    }
+}
+
+TEST_CASE("ParallelParseMatchesSerial")
+{
+    /*
+     * Forward and backward jumps across chunks, odd sizes, and a label operand
+     * right before a label. Most blocks are SYS, which takes no space, so that
+     * every label stays in reach.
+     */
+    std::string text = "JMP end\n";
+    for (int i = 0; i < 60000; ++i) {
+        const std::string n = std::to_string(i);
+        if (i % 150 == 0) {
+            text += "loop_" + n + "\n  DRAW r0, r1, $5\n  LB $F0\n  JMP loop_" + std::to_string(i / 300 * 150) + "\nnext_" + n + " CALL next_" +
+                std::to_string(i + 150) + "\n";
+        } else {
+            text += "loop_" + n + "\n  SYS\n  SYS\nnext_" + n + " SYS\n";
+        }
+    }
+    text += "next_60000 RET\nend CLR\n";
+    /* Code past the end of memory that nothing jumps to is only warned about */
+    for (int i = 0; i < 500; ++i) {
+        text += "  DRAW r0, r1, $5\n";
+    }
+    const auto tokens = c8::Lexer(text).tokenize();
+
+    const auto serial = c8::Parser(tokens).parse(c8::Diagnostics());
+    REQUIRE(serial.ok());
+    REQUIRE(serial.diagnostics.warnings() > 0);
+    for (unsigned threads : { 2u, 3u, 8u, 0u }) {
+        require_same_program(serial, c8::parse_parallel(tokens, threads));
+    }
+
+    /* Errors anywhere give the serial diagnostics */
+    for (const char* bad : { "JMP nowhere\n", "loop_7 CLR\n", "LOAD r0\n" }) {
+        const std::string broken = text.substr(0, text.size() / 2) + bad + text.substr(text.size() / 2);
+        const auto brokenTokens = c8::Lexer(broken).tokenize();
+        const auto expected = c8::Parser(brokenTokens).parse(c8::Diagnostics());
+        REQUIRE(!expected.ok());
+        require_same_program(expected, c8::parse_parallel(brokenTokens, 4));
+    }
+}
+
+static std::FILE* make_stream(const std::string& text)
+{
+    std::FILE* fp = std::tmpfile();
+    std::fwrite(text.data(), sizeof(char), text.size(), fp);
+    std::rewind(fp);
+    return fp;
+}
+
+TEST_CASE("StreamingLexerMatchesBufferLexer")
+{
+    std::string text = "; " + std::string(300, '-') + " a comment longer than the window\n";
+    for (int i = 0; i < 50; ++i) {
+        text += "label" + std::to_string(i) + "\n  DRAW r0,r1,$5 ; draw\n  JMP label" + std::to_string(i) + "\n";
+    }
+
+    std::FILE* fp = make_stream(text);
+    c8::StreamBuffer stream(fp, 96);
+    c8::Lexer streaming(stream);
+    c8::Lexer buffered(text);
+    for (;;) {
+        const auto expected = buffered.get_next_token();
+        const auto actual = streaming.get_next_token();
+        REQUIRE(expected._type == actual._type);
+        REQUIRE(expected._str == actual._str);
+        if (expected._str.empty()) {
+            break;
+        }
+    }
+    std::fclose(fp);
+}
+
+TEST_CASE("StreamingLexerKeepsRecentTokens")
+{
+    std::FILE* fp = make_stream("DRAW r0 , r1 , $5 CLR CLR CLR CLR CLR CLR CLR CLR");
+    c8::StreamBuffer stream(fp, 40);
+    c8::Lexer lex(stream);
+
+    std::vector<c8::Token> held;
+    for (size_t i = 0; i < c8::Lexer::TOKEN_HISTORY; ++i) {
+        held.push_back(lex.get_next_token());
+    }
+    REQUIRE("DRAW" == held[0]._str);
+    REQUIRE("r0" == held[1]._str);
+    REQUIRE("$5" == held[5]._str);
+    REQUIRE("CLR" == held[7]._str);
+    std::fclose(fp);
+}
+
+TEST_CASE("StreamingTokensOutliveTheWindowMoving")
+{
+    /* Comment lines between a label and the token after it move the window on, past the label */
+    std::string text;
+    for (int i = 0; i < 10; ++i) {
+        text += " CLR\n";
+    }
+    text += "alpha\n";
+    for (int i = 0; i < 20; ++i) {
+        text += "; " + std::string(30, 'c') + "\n";
+    }
+    text += " JMP alpha\n";
+
+    std::FILE* fp = make_stream(text);
+    c8::StreamBuffer stream(fp, 64);
+    c8::Lexer lex(stream);
+    c8::Token label;
+    while (label._str != "alpha") {
+        label = lex.get_next_token();
+    }
+    REQUIRE("JMP" == lex.get_next_token()._str);
+    REQUIRE("alpha" == label._str);
+    REQUIRE(stream.dropped() > label._offset);
+    std::fclose(fp);
+
+    fp = make_stream(text);
+    c8::StreamBuffer parsed(fp, 64);
+    REQUIRE(c8::generate(c8::Parser(c8::Lexer(parsed)).parse().code) == c8::generate(c8::Parser(c8::Lexer(text)).parse().code));
+    std::fclose(fp);
+}
+
+TEST_CASE("StreamingLexerRejectsTokensLongerThanTheWindow")
+{
+    std::FILE* fp = make_stream("CLR " + std::string(64, 'x'));
+    c8::StreamBuffer stream(fp, 16);
+    c8::Lexer lex(stream);
+    REQUIRE("CLR" == lex.get_next_token()._str);
+    REQUIRE_THROWS_AS(lex.get_next_token(), ParseException);
+    std::fclose(fp);
+}
+
+TEST_CASE("StreamingParserMatchesBufferParser")
+{
+    const std::string text = "start\n  ILOAD sprite\n  DRAW r0,r1,$5 ; draw it\n  JMP start\nsprite\n  LB $F0\n";
+    std::FILE* fp = make_stream(text);
+    c8::StreamBuffer stream(fp, 64);
+    auto streamed = c8::Parser(c8::Lexer(stream)).parse();
+    auto buffered = c8::Parser(c8::Lexer(text)).parse();
+    std::fclose(fp);
+
+    REQUIRE(streamed.code.size() == buffered.code.size());
+    for (size_t i = 0; i < streamed.code.size(); ++i) {
+        REQUIRE(streamed.code[i].op == buffered.code[i].op);
+        REQUIRE(streamed.code[i].operands == buffered.code[i].operands);
+        REQUIRE(streamed.code[i].addr == buffered.code[i].addr);
+        REQUIRE(streamed.code[i].offset == buffered.code[i].offset);
+    }
+    /* Without the source the debug view spells the operands out itself */
+    REQUIRE(std::vector<std::string>{ "R0", "R1", "$5" } == streamed.statement(streamed.code[1]).args);
+    REQUIRE(std::vector<std::string>{ "r0", "r1", "$5" } == buffered.statement(buffered.code[1]).args);
+    REQUIRE("start" == streamed.statement(streamed.code[1]).label);
+}
+
+TEST_CASE("FindMnemonicMatchesOperators")
+{
+    REQUIRE(c8::MNEMONICS.size() == OPERATORS.size());
+    for (size_t i = 0; i < c8::MNEMONICS.size(); ++i) {
+        const auto op = c8::find_mnemonic(c8::MNEMONICS[i]);
+        REQUIRE(op == static_cast<c8::Op>(i));
+        REQUIRE(c8::mnemonic(op) == c8::MNEMONICS[i]);
+    }
+}
+
+static std::string read_file(const std::filesystem::path& path)
+{
+    std::FILE* fp = std::fopen(path.string().c_str(), "rb");
+    REQUIRE(fp != nullptr);
+    std::string text;
+    char chunk[4096];
+    for (size_t n; (n = std::fread(chunk, sizeof(char), sizeof(chunk), fp)) > 0;) {
+        text.append(chunk, n);
+    }
+    std::fclose(fp);
+    return text;
+}
+
+TEST_CASE("OpsListMatchesMnemonics")
+{
+    std::string expected;
+    for (const auto mnemonic : c8::MNEMONICS) {
+        expected.append(mnemonic).push_back('\n');
+    }
+    REQUIRE(read_file(std::filesystem::path(CHIP8ASM_SOURCE_DIR) / "doc" / "ops.txt") == expected);
+}
+
+TEST_CASE("OperatorsAreIndexedByOp")
+{
+    const Operands args{ 0xA, 0xB, 0x5 };
+    REQUIRE(OPERATORS[static_cast<size_t>(c8::Op::SKRE)](args) == fxnSKRE(args));
+    REQUIRE(OPERATORS[static_cast<size_t>(c8::Op::DRAW)](args) == fxnDRAW(args));
+    REQUIRE(OPERATORS[static_cast<size_t>(c8::Op::IDUMP)](args) == fxnIDUMP(args));
+    c8::Ir ir{};
+    ir.op = c8::Op::DRAW;
+    ir.operands = args;
+    REQUIRE(c8::encode(ir) == 0xDAB5);
+}
+
+TEST_CASE("FindMnemonicRejectsOtherWords")
+{
+    REQUIRE(c8::find_mnemonic("") == c8::Op::COUNT);
+    REQUIRE(c8::find_mnemonic("ADDR") == c8::Op::COUNT);
+    REQUIRE(c8::find_mnemonic("add") == c8::Op::COUNT);
+    REQUIRE(c8::find_mnemonic("IDUMPS") == c8::Op::COUNT);
+    REQUIRE(c8::find_mnemonic("r0") == c8::Op::COUNT);
+}
+
 TEST_CASE("TestSYS")
 {
     auto val = fxnSYS({});
@@ -144,199 +536,206 @@ TEST_CASE("TestRET")
 
 TEST_CASE("TestJMP")
 {
-    auto val = fxnJMP({ "ABC" });
+    auto val = fxnJMP({ 0xABC });
     REQUIRE(0x1ABC == val);
 }
 
 TEST_CASE("TestCALL")
 {
-    auto val = fxnCALL({ "ABC" });
+    auto val = fxnCALL({ 0xABC });
     REQUIRE(0x2ABC == val);
 }
 
 TEST_CASE("TestSKE")
 {
-    auto val = fxnSKE({ "RF", "AB" });
+    auto val = fxnSKE({ 0xF, 0xAB });
     REQUIRE(0x3FAB == val);
 }
 
 TEST_CASE("TestSKNE")
 {
-    auto val = fxnSKNE({ "RF", "AB" });
+    auto val = fxnSKNE({ 0xF, 0xAB });
     REQUIRE(0x4FAB == val);
 }
 
 TEST_CASE("TestSKRE")
 {
-    auto val = fxnSKRE({ "RA", "RB" });
+    auto val = fxnSKRE({ 0xA, 0xB });
     REQUIRE(0x5AB0 == val);
 }
 
 TEST_CASE("TestLOAD")
 {
-    auto val = fxnLOAD({ "R1", "$AB" });
+    auto val = fxnLOAD({ 0x1, 0xAB });
     REQUIRE(0x61AB == val);
 }
 
 TEST_CASE("TestADD")
 {
-    auto val = fxnADD({ "R1", "$AB" });
+    auto val = fxnADD({ 0x1, 0xAB });
     REQUIRE(0x71AB == val);
 }
 
 TEST_CASE("TestASN")
 {
-    auto val = fxnASN({ "RA", "RB" });
+    auto val = fxnASN({ 0xA, 0xB });
     REQUIRE(0x8AB0 == val);
 }
 
 TEST_CASE("TestOR")
 {
-    auto val = fxnOR({ "RA", "RB" });
+    auto val = fxnOR({ 0xA, 0xB });
     REQUIRE(0x8AB1 == val);
 }
 
 TEST_CASE("TestAND")
 {
-    auto val = fxnAND({ "RA", "RB" });
+    auto val = fxnAND({ 0xA, 0xB });
     REQUIRE(0x8AB2 == val);
 }
 
 TEST_CASE("TestXOR")
 {
-    auto val = fxnXOR({ "RA", "RB" });
+    auto val = fxnXOR({ 0xA, 0xB });
     REQUIRE(0x8AB3 == val);
 }
 
 TEST_CASE("TestRADD")
 {
-    auto val = fxnRADD({ "RA", "RB" });
+    auto val = fxnRADD({ 0xA, 0xB });
     REQUIRE(0x8AB4 == val);
 }
 
 TEST_CASE("TestSUB")
 {
-    auto val = fxnSUB({ "RA", "RB" });
+    auto val = fxnSUB({ 0xA, 0xB });
     REQUIRE(0x8AB5 == val);
 }
 
 TEST_CASE("TestSHR")
 {
-    auto val = fxnSHR({ "R2" });
+    auto val = fxnSHR({ 0x2 });
     REQUIRE(0x8206 == val);
 }
 
 TEST_CASE("TestRSUB")
 {
-    auto val = fxnRSUB({ "RA", "RB" });
+    auto val = fxnRSUB({ 0xA, 0xB });
     REQUIRE(0x8AB7 == val);
 }
 
 TEST_CASE("TestSHL")
 {
-    auto val = fxnSHL({ "R2" });
+    auto val = fxnSHL({ 0x2 });
     REQUIRE(0x820E == val);
 }
 
 TEST_CASE("TestSKRNE")
 {
-    auto val = fxnSKRNE({ "RA", "RB" });
+    auto val = fxnSKRNE({ 0xA, 0xB });
     REQUIRE(0x9AB0 == val);
 }
 
 TEST_CASE("TestILOAD")
 {
-    auto val = fxnILOAD({ "$ABC" });
+    auto val = fxnILOAD({ 0xABC });
     REQUIRE(0xAABC == val);
 }
 
 TEST_CASE("TestZJMP")
 {
-    auto val = fxnZJMP({ "$ABC" });
+    auto val = fxnZJMP({ 0xABC });
     REQUIRE(0xBABC == val);
 }
 
 TEST_CASE("TestRAND")
 {
-    auto val = fxnRAND({ "R8" });
-    REQUIRE(0xC808 == val);
+    auto val = fxnRAND({ 0x8, 0xAB });
+    REQUIRE(0xC8AB == val);
+}
+
+TEST_CASE("OperandsLandInTheirDocumentedFields")
+{
+    const auto program = c8::Parser(c8::Lexer("RAND r3, $AB\nSKRE r0, r1\n")).parse();
+    REQUIRE(c8::toRom(c8::generateInstructions(program.code)) == std::vector<uint8_t>{ 0xC3, 0xAB, 0x50, 0x10 });
+    REQUIRE_THROWS_AS(c8::Parser(c8::Lexer("SKRE r0, $1\n")).parse(), ParseException);
 }
 
 TEST_CASE("TestDRAW")
 {
-    auto val = fxnDRAW({ "r0", "r1", "$6" });
+    auto val = fxnDRAW({ 0x0, 0x1, 0x6 });
     REQUIRE(0xD016 == val);
 }
 
 TEST_CASE("TestSKK")
 {
-    auto val = fxnSKK({ "9" });
+    auto val = fxnSKK({ 0x9 });
     REQUIRE(0xE99E == val);
 }
 
 TEST_CASE("TestSKNK")
 {
-    auto val = fxnSKNK({ "9" });
+    auto val = fxnSKNK({ 0x9 });
     REQUIRE(0xE9A1 == val);
 }
 
 TEST_CASE("TestDELA")
 {
-    auto val = fxnDELA({ "r4" });
+    auto val = fxnDELA({ 0x4 });
     REQUIRE(0xF407 == val);
 }
 
 TEST_CASE("TestKEYW")
 {
-    auto val = fxnKEYW({ "rF" });
+    auto val = fxnKEYW({ 0xF });
     REQUIRE(0xFF0A == val);
 }
 
 TEST_CASE("TestDELR")
 {
-    auto val = fxnDELR({ "rF" });
+    auto val = fxnDELR({ 0xF });
     REQUIRE(0xFF15 == val);
 }
 
 TEST_CASE("TestSNDR")
 {
-    auto val = fxnSNDR({ "rF" });
+    auto val = fxnSNDR({ 0xF });
     REQUIRE(0xFF18 == val);
 }
 
 TEST_CASE("TestIADD")
 {
-    auto val = fxnIADD({ "rF" });
+    auto val = fxnIADD({ 0xF });
     REQUIRE(0xFF1E == val);
 }
 
 TEST_CASE("TestSILS")
 {
-    auto val = fxnSILS({ "rF" });
+    auto val = fxnSILS({ 0xF });
     REQUIRE(0xFF29 == val);
 }
 
 TEST_CASE("TestBCD")
 {
-    auto val = fxnBCD({ "rF" });
+    auto val = fxnBCD({ 0xF });
     REQUIRE(0xFF33 == val);
 }
 
 TEST_CASE("TestDUMP")
 {
-    auto val = fxnDUMP({ "rF" });
+    auto val = fxnDUMP({ 0xF });
     REQUIRE(0xFF55 == val);
 }
 
 TEST_CASE("TestIDUMP")
 {
-    auto val = fxnIDUMP({ "rF" });
+    auto val = fxnIDUMP({ 0xF });
     REQUIRE(0xFF65 == val);
 }
 
 TEST_CASE("TestLB")
 {
-    auto val = fxnLB({ "$ABC" });
+    auto val = fxnLB({ 0xABC });
     REQUIRE(0xABC == val);
 }
 
@@ -427,6 +826,41 @@ TEST_CASE("IsValidHexCharLowerLetters")
     }
 }
 
+TEST_CASE("ParseHexAllValues")
+{
+    for (unsigned v = 0; v <= 0xFFFF; ++v) {
+        uint16_t parsed = 0;
+        REQUIRE(parse_hex(fmt("%X", v), &parsed));
+        REQUIRE(v == parsed);
+        REQUIRE(parse_hex(fmt("%04x", v), &parsed));
+        REQUIRE(v == parsed);
+    }
+}
+
+TEST_CASE("ParseHexRejectsBadInput")
+{
+    uint16_t parsed = 0;
+    REQUIRE(!parse_hex("", &parsed));
+    REQUIRE(!parse_hex("G", &parsed));
+    REQUIRE(!parse_hex("1:", &parsed));
+    REQUIRE(!parse_hex("@", &parsed));
+    REQUIRE(!parse_hex("`", &parsed));
+    REQUIRE(!parse_hex("\xC1", &parsed));
+    REQUIRE(!parse_hex("12345", &parsed));
+    REQUIRE(parse_hex("000FF", &parsed));
+    REQUIRE(0xFF == parsed);
+}
+
+TEST_CASE("LexerDecodesValues")
+{
+    c8::Lexer lex("LOAD rB, $1f $12345");
+    REQUIRE(static_cast<uint16_t>(c8::Op::LOAD) == lex.get_next_token()._value);
+    REQUIRE(0xB == lex.get_next_token()._value);
+    lex.get_next_token();
+    REQUIRE(0x1F == lex.get_next_token()._value);
+    REQUIRE(c8::TokenType::UNKNOWN == lex.get_next_token()._type);
+}
+
 TEST_CASE("FromHexMax")
 {
     auto val = from_hex(65535);
@@ -472,7 +906,7 @@ sprite
     c8::Lexer lexer(text);
     c8::Parser parser(lexer);
 
-    auto statements = parser.parse();
+    auto statements = parser.parse().statements();
     REQUIRE(10 == statements.size());
 
     auto stmt = statements[0];
@@ -533,6 +967,242 @@ sprite
     REQUIRE(stmt.op == "LB");
 }
 
+TEST_CASE("ParserTokenBufferMatchesPull")
+{
+    const std::string text = R"(
+start
+    ILOAD sprite
+    DRAW r0,r1,$5
+    JMP start
+sprite
+    LB $F0
+)";
+    auto pulled = c8::Parser(c8::Lexer(text)).parse().statements();
+    const auto tokens = c8::Lexer(text).tokenize();
+    auto walked = c8::Parser(tokens).parse().statements();
+
+    REQUIRE(pulled.size() == walked.size());
+    for (size_t i = 0; i < pulled.size(); ++i) {
+        REQUIRE(pulled[i].op == walked[i].op);
+        REQUIRE(pulled[i].args == walked[i].args);
+        REQUIRE(pulled[i].addr == walked[i].addr);
+    }
+}
+
+TEST_CASE("ParserChecksOperandRanges")
+{
+    REQUIRE_THROWS_AS(c8::Parser(c8::Lexer("LOAD r0, $100")).parse(), ParseException);
+    REQUIRE_THROWS_AS(c8::Parser(c8::Lexer("DRAW r0, r1, $10")).parse(), ParseException);
+    REQUIRE_THROWS_AS(c8::Parser(c8::Lexer("LB $1FF")).parse(), ParseException);
+    REQUIRE_THROWS_AS(c8::Parser(c8::Lexer("JMP $1000")).parse(), ParseException);
+    REQUIRE_THROWS_AS(c8::Parser(c8::Lexer("ADD r0, $12345")).parse(), ParseException);
+    REQUIRE_NOTHROW(c8::Parser(c8::Lexer("LOAD r0, $FF DRAW r0, r1, $F JMP $FFF")).parse());
+}
+
+TEST_CASE("ParseExceptionPointsAtToken")
+{
+    const std::string text = "start\n  LOAD r0, $AB\n  DRAW r0, r1 $5\n";
+    try {
+        c8::Parser(c8::Lexer(text)).parse();
+        FAIL("DRAW without a second comma should not parse");
+    } catch (const ParseException& e) {
+        REQUIRE(text.find("$5") == e.offset());
+        const auto loc = c8::LineIndex(text).locate(e.offset());
+        REQUIRE(3 == loc.line);
+        REQUIRE(15 == loc.column);
+    }
+}
+
+TEST_CASE("StreamBufferLocatesOffsets")
+{
+    std::string text;
+    for (int i = 0; i < 40; ++i) {
+        text += "  CLR ; line " + std::to_string(i + 1) + "\n";
+    }
+    text += "  LOAD r0, r1\n";
+
+    std::FILE* fp = make_stream(text);
+    c8::StreamBuffer stream(fp, 256);
+    try {
+        c8::Parser(c8::Lexer{ stream }).parse();
+        FAIL("LOAD with a register operand should not parse");
+    } catch (const ParseException& e) {
+        REQUIRE(text.find("r1") == e.offset());
+        REQUIRE(e.offset() > stream.dropped());
+        const auto loc = stream.locate(e.offset());
+        REQUIRE(41 == loc.line);
+        REQUIRE(12 == loc.column);
+    }
+    std::fclose(fp);
+}
+
+static void require_matches_full_parse(const c8::Document& doc)
+{
+    const auto tokens = c8::Lexer(doc.text()).tokenize();
+    REQUIRE(tokens.types == doc.tokens().types);
+    REQUIRE(tokens.offsets == doc.tokens().offsets);
+    REQUIRE(tokens.values == doc.tokens().values);
+
+    const auto statements = c8::Parser(tokens).parse().statements();
+    const auto actuals = doc.statements();
+    REQUIRE(statements.size() == actuals.size());
+    for (size_t i = 0; i < statements.size(); ++i) {
+        const auto& expected = statements[i];
+        const auto& actual = actuals[i];
+        REQUIRE(expected.label == actual.label);
+        REQUIRE(expected.op == actual.op);
+        REQUIRE(expected.args == actual.args);
+        REQUIRE(expected.operands == actual.operands);
+        REQUIRE(expected.addr == actual.addr);
+        REQUIRE(expected.offset == actual.offset);
+    }
+}
+
+TEST_CASE("DocumentMatchesFullParse")
+{
+    std::string text;
+    for (int i = 0; i < 20; ++i) {
+        const std::string n = std::to_string(i);
+        text += "block" + n + "\n  LOAD r0, $" + n + " ; count\n  DRAW r0, r1, $5\n  JMP block" + n + "\n  CALL end\n";
+    }
+    text += "end\n  RET\n";
+    c8::Document doc(text);
+    require_matches_full_parse(doc);
+
+    const auto at = [&doc](const std::string& what) { return doc.text().find(what); };
+    /* A statement in the middle moves everything after it */
+    doc.edit(at("  DRAW"), 0, "  LB $FF\n");
+    require_matches_full_parse(doc);
+    /* An operand changes in place */
+    doc.edit(at("$5"), 2, "$A");
+    require_matches_full_parse(doc);
+    /* A label is renamed along with the jump to it */
+    REQUIRE_THROWS_AS(doc.edit(at("block3\n"), 6, "third"), ParseException);
+    doc.edit(at("JMP block3"), 10, "JMP third");
+    require_matches_full_parse(doc);
+    /* Two lines are joined into one */
+    doc.edit(at("block7\n") + 6, 1, " ");
+    require_matches_full_parse(doc);
+    /* A new label shifts the label of the statements after it */
+    doc.edit(at("  CALL end"), 0, "inner\n");
+    require_matches_full_parse(doc);
+    /* Lines are deleted and the code after them moves back */
+    doc.edit(at("block10\n"), at("block12\n") - at("block10\n"), "");
+    require_matches_full_parse(doc);
+    /* Code is added at both ends */
+    doc.edit(0, 0, "CLR\n");
+    doc.edit(doc.text().size(), 0, "  LB $1");
+    require_matches_full_parse(doc);
+}
+
+TEST_CASE("DocumentRecoversFromBadEdits")
+{
+    c8::Document doc("start\n  LOAD r0, $1\n  JMP start\nend\n  RET\n");
+    REQUIRE_THROWS_AS(doc.edit(doc.text().find("$1"), 2, "r1"), ParseException);
+    doc.edit(doc.text().find("r1"), 2, "$2");
+    require_matches_full_parse(doc);
+
+    REQUIRE_THROWS_AS(doc.edit(doc.text().find("end"), 0, "start\n"), ParseException);
+    doc.edit(doc.text().find("start\nend"), 6, "");
+    require_matches_full_parse(doc);
+
+    REQUIRE_THROWS_AS(doc.edit(0, 5, "begin"), ParseException);
+    doc.edit(0, 5, "start");
+    require_matches_full_parse(doc);
+    REQUIRE_THROWS_AS(doc.edit(doc.text().size() + 1, 0, "CLR"), std::out_of_range);
+
+    /* A label lost by one edit is still missing after the next, which parses the whole source again */
+    c8::Document lost("a\n CLR\n JMP a\n");
+    REQUIRE_THROWS_AS(lost.edit(0, 2, ""), ParseException);
+    REQUIRE_THROWS_AS(lost.edit(lost.text().find("CLR"), 3, "RET"), ParseException);
+    lost.edit(0, 0, "a\n");
+    require_matches_full_parse(lost);
+}
+
+TEST_CASE("ParserFollowsInstructionSpecs")
+{
+    for (size_t i = 0; i < c8::OP_COUNT; ++i) {
+        const auto op = static_cast<c8::Op>(i);
+        const auto& spec = c8::spec(op);
+        std::string text = "here " + std::string(c8::mnemonic(op));
+        for (size_t k = 0; k < spec.arity; ++k) {
+            text += k == 0 ? " " : ", ";
+            text += spec.operands[k] == c8::Operand::REGISTER ? "r1" : c8::is_address(spec.operands[k]) ? "here" : "$1";
+        }
+        text += " CLR";
+
+        c8::Parser parser{ c8::Lexer(text) };
+        parser.set_target(c8::Target::XOCHIP);
+        const auto statements = parser.parse().statements();
+        REQUIRE(statements.size() == (spec.size == 0 ? 1u : 2u));
+        REQUIRE(statements.back().addr == 0x200 + spec.size);
+        if (spec.size > 0) {
+            REQUIRE(spec.arity == statements[0].args.size());
+        }
+        if (spec.arity > 0) {
+            REQUIRE((spec.takes_label ? 0x200 : 0x1) == statements[0].operands[0]);
+        }
+    }
+}
+
+TEST_CASE("SymbolTableInternsNames")
+{
+    std::vector<std::string> names;
+    for (int i = 0; i < 5000; ++i) {
+        names.push_back("label_" + std::to_string(i));
+    }
+    c8::SymbolTable symbols;
+    for (size_t i = 0; i < names.size(); ++i) {
+        REQUIRE(i == symbols.intern(names[i]));
+    }
+    REQUIRE(names.size() == symbols.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        REQUIRE(i == symbols.intern(names[i]));
+        REQUIRE(i == symbols.find(names[i]));
+        REQUIRE(names[i] == symbols.name(static_cast<c8::SymbolId>(i)));
+    }
+    REQUIRE(c8::NO_SYMBOL == symbols.find("label_5000"));
+
+    const auto id = symbols.find("label_42");
+    REQUIRE_FALSE(symbols.is_defined(id));
+    REQUIRE(symbols.define(id, 0x234));
+    REQUIRE_FALSE(symbols.define(id, 0x300));
+    REQUIRE(0x234 == symbols.address(id));
+}
+
+TEST_CASE("SymbolTableCanOwnNames")
+{
+    c8::SymbolTable symbols(true);
+    std::string name = "start";
+    const auto id = symbols.intern(name);
+    name = "other";
+    REQUIRE("start" == symbols.name(id));
+    REQUIRE(id == symbols.find("start"));
+}
+
+TEST_CASE("ParserRefersToLabelsBySymbol")
+{
+    auto statements = c8::Parser(c8::Lexer("start JMP end\nCALL start\nJMP $300\nend RET")).parse().code;
+    REQUIRE(statements[0].symbol != c8::NO_SYMBOL);
+    REQUIRE(statements[1].symbol != c8::NO_SYMBOL);
+    REQUIRE(statements[0].symbol != statements[1].symbol);
+    REQUIRE(c8::NO_SYMBOL == statements[2].symbol);
+    REQUIRE(c8::NO_SYMBOL == statements[3].symbol);
+    REQUIRE(0x206 == statements[0].operands[0]);
+    REQUIRE_THROWS_AS(c8::Parser(c8::Lexer("start CLR start RET")).parse(), ParseException);
+}
+
+TEST_CASE("ParserDecodesOperands")
+{
+    auto statements = c8::Parser(c8::Lexer("start DRAW rA, r1, $5\nJMP $2F0\nCALL start")).parse().code;
+    REQUIRE(3 == statements.size());
+    REQUIRE(0xA == statements[0].operands[0]);
+    REQUIRE(0x1 == statements[0].operands[1]);
+    REQUIRE(0x5 == statements[0].operands[2]);
+    REQUIRE(0x2F0 == statements[1].operands[0]);
+    REQUIRE(0x200 == statements[2].operands[0]);
+}
+
 TEST_CASE("GeneratorIntegrationTest")
 {
     const std::string text = R"(
@@ -560,8 +1230,8 @@ sprite
     c8::Lexer lexer(text);
     c8::Parser parser(lexer);
 
-    auto statements = parser.parse();
-    auto instructions = c8::generateInstructions(statements);
+    auto program = parser.parse();
+    auto instructions = c8::generateInstructions(program.code);
 
     REQUIRE(instructions.size() == 10);
 
@@ -576,4 +1246,648 @@ sprite
     REQUIRE(instructions[7].op == 0xF000);
     REQUIRE(instructions[8].op == 0x9000);
     REQUIRE(instructions[9].op == 0x9000);
-}
\ No newline at end of file
+}
+
+TEST_CASE("GenerateWritesTheRomDirectly")
+{
+    const auto program = c8::Parser(c8::Lexer("start ILOAD sprite\nJMP start\nsprite LB $F0\nLB $90\nCLR\nSYS")).parse();
+    const auto instructions = c8::generateInstructions(program.code);
+    const auto rom = c8::generate(program.code);
+    REQUIRE(rom == std::vector<uint8_t>{ 0xA2, 0x04, 0x12, 0x00, 0xF0, 0x90, 0x00, 0xE0 });
+    REQUIRE(rom == c8::toRom(instructions));
+    /* Instructions only point back at their records */
+    REQUIRE(instructions[3].index == 3);
+    REQUIRE(instructions[3].size == 1);
+    REQUIRE(instructions[3].toString(program) == "0x0205 | 0x90 ; LB $90");
+    REQUIRE(c8::listing(program).find("0x0202 | 0x0012 ; JMP 0x0200\n") != std::string::npos);
+}
+
+TEST_CASE("BatchEncodersMatchScalarEncoder")
+{
+    /* Every instruction with random operands that fit, and runs of LB and SYS in between */
+    std::vector<c8::Ir> code;
+    unsigned seed = 12345;
+    for (int i = 0; i < 5000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        c8::Ir ir{};
+        ir.op = static_cast<c8::Op>((seed >> 8) % c8::OP_COUNT);
+        const auto& spec = c8::spec(ir.op);
+        for (size_t k = 0; k < spec.arity; ++k) {
+            seed = seed * 1103515245 + 12345;
+            ir.operands[k] = static_cast<uint16_t>((seed >> 8) % (spec.operands[k] == c8::Operand::REGISTER ? 0x10 : c8::operand_max(spec.operands[k]) + 1));
+        }
+        code.push_back(ir);
+    }
+    const c8::IrColumns columns(code);
+    REQUIRE(c8::generate(columns) == c8::generate(code, c8::Target::XOCHIP));
+
+    /* SYS takes up no space, so it isn't packed */
+    std::vector<c8::Ir> packed;
+    std::copy_if(code.begin(), code.end(), std::back_inserter(packed), [](const c8::Ir& ir) { return c8::spec(ir.op).size > 0; });
+    REQUIRE(columns.size() == packed.size());
+    REQUIRE(columns.size() < code.size());
+    for (auto level : { c8::scan::Level::SCALAR, c8::scan::Level::SSE2, c8::scan::Level::AVX2 }) {
+        const auto kernel = c8::batch::kernel(level);
+        for (size_t first = 0; first < 40; first += 3) {
+            const size_t n = packed.size() - first - first / 2;
+            std::vector<uint8_t> out(2 * n);
+            kernel(columns, first, n, out.data());
+            for (size_t i = 0; i < n; ++i) {
+                /* The kernels only get the runs of 2 byte opcodes */
+                if (c8::spec(packed[first + i].op).size == 4) {
+                    continue;
+                }
+                const auto op = static_cast<uint16_t>(c8::encode(packed[first + i]));
+                REQUIRE(out[2 * i] == static_cast<uint8_t>(op >> 8));
+                REQUIRE(out[2 * i + 1] == static_cast<uint8_t>(op));
+            }
+        }
+    }
+}
+
+TEST_CASE("AssembleMatchesTwoPasses")
+{
+    /* Forward and backward jumps, a label used before and after it is defined and single bytes in between */
+    const std::string text = "start ILOAD sprite\nCALL sub\nJMP end\nsub LB $12\nRET\nsprite LB $F0\nLB $90\nend JMP start\nZJMP sprite\nJMP sub";
+    const c8::TokenBuffer tokens = c8::Lexer(text).tokenize();
+
+    c8::Parser twoPass(tokens);
+    const auto expected = c8::toRom(c8::generateInstructions(twoPass.parse().code));
+    c8::Parser onePass(tokens);
+    REQUIRE(expected == c8::assemble(onePass).value);
+
+    c8::Parser streamed(c8::Lexer{ text });
+    REQUIRE(expected == c8::assemble(streamed).value);
+
+    c8::Parser undefined(c8::Lexer("CLR\nJMP nowhere\nCALL nowhere"));
+    const auto result = c8::assemble(undefined);
+    REQUIRE(!result.ok());
+    REQUIRE(result.diagnostics.errors() == 2);
+    REQUIRE(result.diagnostics.all()[0].message == "nowhere is a label that hasn't been defined.");
+    REQUIRE(result.diagnostics.all()[0].offset == 4);
+}
+
+TEST_CASE("DiagnosticsRecoverAtTheNextLine")
+{
+    const std::string text = "start LOAD r0, $1FF\nADD r0 $1\nbogus, CLR\nJMP nowhere\nstart CLR\nJMP $201\nRET";
+    const auto expect_all = [](const c8::Diagnostics& diagnostics) {
+        const auto& all = diagnostics.all();
+        REQUIRE(diagnostics.errors() == 5);
+        REQUIRE(all[0].message == "$1FF is out of range after ,! The most it can be is $FF.");
+        REQUIRE(all[1].message == "COMMA expected after r0!");
+        REQUIRE(all[2].message == ", is not a valid starting token! (OPERATOR|LABEL) expected!");
+        REQUIRE(all[3].message == "start label is redefined!");
+        REQUIRE(all[4].message == "nowhere is a label that hasn't been defined.");
+    };
+
+    /* Whatever follows a bad statement on its line is skipped, the next line parses as usual */
+    const c8::TokenBuffer tokens = c8::Lexer(text).tokenize();
+    auto result = c8::Parser(tokens).parse(c8::Diagnostics());
+    expect_all(result.diagnostics);
+    REQUIRE(result.value.code.size() == 4);
+    expect_all(c8::Parser(c8::Lexer{ text }).parse(c8::Diagnostics()).diagnostics);
+
+    c8::Parser assembler(tokens);
+    const auto assembled = c8::assemble(assembler);
+    REQUIRE(assembled.diagnostics.errors() == 5);
+
+    const auto limited = c8::Parser(tokens).parse(c8::Diagnostics(2));
+    REQUIRE(limited.diagnostics.full());
+    REQUIRE(limited.diagnostics.errors() == 2);
+
+    REQUIRE_THROWS_WITH(c8::Parser(tokens).parse(), "$1FF is out of range after ,! The most it can be is $FF.");
+
+    /* A statement cut short by the end of its line doesn't take the next line with it */
+    for (const std::string cut : { " JMP\n LOAD r0, $100\n", "ADD r0\nLOAD r1, $100\n" }) {
+        const auto errors = [](const c8::Diagnostics& diagnostics) {
+            return diagnostics.all().size() == 2 ? diagnostics.all()[1].message : std::string();
+        };
+        REQUIRE(errors(c8::Parser(c8::Lexer(cut).tokenize()).parse(c8::Diagnostics()).diagnostics)
+            == "$100 is out of range after ,! The most it can be is $FF.");
+        REQUIRE(errors(c8::Parser(c8::Lexer(cut)).parse(c8::Diagnostics()).diagnostics) == "$100 is out of range after ,! The most it can be is $FF.");
+        std::FILE* fp = make_stream(cut);
+        c8::StreamBuffer stream(fp, 16);
+        REQUIRE(errors(c8::Parser(c8::Lexer(stream)).parse(c8::Diagnostics()).diagnostics) == "$100 is out of range after ,! The most it can be is $FF.");
+        std::fclose(fp);
+    }
+
+    /* Warnings don't stop anything: the code still assembles past the end of memory */
+    std::string full;
+    for (int i = 0; i < 0x700; ++i) {
+        full += "CLR\n";
+    }
+    const auto past = c8::Parser(c8::Lexer(full + "RET\nRET")).parse(c8::Diagnostics());
+    REQUIRE(past.ok());
+    REQUIRE(past.value.code.size() == 0x702);
+    REQUIRE(past.diagnostics.warnings() == 1);
+    REQUIRE(past.diagnostics.all()[0].severity == c8::Severity::WARNING);
+    REQUIRE(past.diagnostics.all()[0].offset == full.size());
+}
+
+/* Every heap allocation in the test program goes through here so tests can count them */
+static size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+/* GCC takes the malloc and free inside a replaced new and delete for a mismatch once they are inlined */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+#pragma GCC diagnostic pop
+
+TEST_CASE("ArenaReusesItsBlocks")
+{
+    c8::Arena arena(64);
+    const auto a = arena.copy("start");
+    const auto b = arena.copy(std::string(100, 'x'));
+    REQUIRE(a == "start");
+    REQUIRE(b == std::string(100, 'x'));
+    REQUIRE(reinterpret_cast<uintptr_t>(arena.allocate(8, 8)) % 8 == 0);
+
+    const size_t capacity = arena.capacity();
+    arena.reset();
+    const size_t before = allocations;
+    REQUIRE(arena.copy("start").data() == a.data());
+    arena.copy(std::string_view(b));
+    REQUIRE(allocations == before);
+    REQUIRE(arena.capacity() == capacity);
+}
+
+TEST_CASE("AssemblerContextDoesNotAllocateOnceWarm")
+{
+    std::string text, half;
+    for (int i = 0; i < 50; ++i) {
+        const std::string n = std::to_string(i);
+        text += "loop" + n + " ILOAD sprite" + n + "\nLOAD r0, $A\nDRAW r0, r1, $5\nJMP loop" + n + "\nCALL after" + n + "\n";
+        text += "after" + n + " RET\nsprite" + n + " LB $F0\nLB $90\n";
+        if (i == 24) {
+            half = text;
+        }
+    }
+
+    c8::AssemblerContext context;
+    const size_t cold = allocations;
+    REQUIRE(context.assemble(text));
+    REQUIRE(allocations > cold);
+    const std::vector<uint8_t> expected = context.rom();
+
+    /* A smaller source fits in what the first run grew */
+    const size_t before = allocations;
+    REQUIRE(context.assemble(text));
+    REQUIRE(context.assemble(half));
+    REQUIRE(context.assemble(text));
+    REQUIRE(allocations == before);
+    REQUIRE(context.rom() == expected);
+    REQUIRE(context.symbols().name(0) == "loop0");
+
+    /* Errors are still reported, and the next run starts clean */
+    REQUIRE(!context.assemble("JMP nowhere"));
+    REQUIRE(context.diagnostics().errors() == 1);
+    REQUIRE(context.assemble(text));
+    REQUIRE(context.diagnostics().all().empty());
+    REQUIRE(context.rom() == expected);
+}
+
+static void write_file(const std::filesystem::path& path, const std::string& text)
+{
+    std::FILE* fp = std::fopen(path.string().c_str(), "wb");
+    REQUIRE(fp != nullptr);
+    std::fwrite(text.data(), sizeof(char), text.size(), fp);
+    std::fclose(fp);
+}
+
+/* A fresh directory under the system's temporary one */
+static std::filesystem::path test_directory(const char* name)
+{
+    const auto dir = std::filesystem::temp_directory_path() / "chip8asm-tests" / name;
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    return dir;
+}
+
+TEST_CASE("IncludeSplicesInTheFile")
+{
+    const auto dir = test_directory("include");
+    std::filesystem::create_directories(dir / "lib");
+    const std::string font = "font LB $F0\nLB $90\n.include \"util.asm\"\n";
+    const std::string util = "helper LOAD r1, $02\nJMP back\nRET\n";
+    write_file(dir / "lib" / "font.asm", font);
+    write_file(dir / "lib" / "util.asm", util);
+
+    const std::string text = "start CALL helper\nILOAD font\n.include \"lib/font.asm\"\nback JMP start\n";
+    const std::string inlined = "start CALL helper\nILOAD font\nfont LB $F0\nLB $90\n" + util + "back JMP start\n";
+    const auto expected = c8::toRom(c8::generateInstructions(c8::Parser(c8::Lexer(inlined)).parse().code));
+
+    c8::ModuleCache modules;
+    c8::Parser parser(c8::Lexer{ text });
+    parser.set_includes(modules, dir.string());
+    const auto program = parser.parse();
+    REQUIRE(c8::toRom(c8::generateInstructions(program.code)) == expected);
+
+    /* Records keep their place in the file they came from */
+    const c8::Ir& load = program.code[4];
+    REQUIRE(load.addr == 0x0206);
+    REQUIRE(modules.file(load.file).path == (dir / "lib" / "util.asm").string());
+    REQUIRE(program.statement(load).args == std::vector<std::string>{ "r1", "$02" });
+    REQUIRE(program.symbols.name(load.label) == "helper");
+    REQUIRE(program.symbols.name(program.code[2].label) == "font");
+
+    /* The one pass assembler patches jumps into and out of the included code */
+    c8::AssemblerContext context;
+    context.set_includes(modules, dir.string());
+    REQUIRE(context.assemble(text));
+    REQUIRE(context.rom() == expected);
+
+    /* Without a cache, or with a file that can't be included, it is an error */
+    REQUIRE_THROWS_AS(c8::Parser(c8::Lexer{ text }).parse(), ParseException);
+    write_file(dir / "lib" / "loop.asm", "CLR\n.include \"loop.asm\"\n");
+    c8::Parser broken(c8::Lexer{ ".include \"lib/loop.asm\"\n.include \"none.asm\"\n.include none\n" });
+    broken.set_includes(modules, dir.string());
+    const auto result = broken.parse(c8::Diagnostics());
+    const auto& all = result.diagnostics.all();
+    REQUIRE(all.size() == 3);
+    REQUIRE(all[0].message == "\"loop.asm\" includes itself!");
+    REQUIRE(modules.file(all[0].file).path == (dir / "lib" / "loop.asm").string());
+    REQUIRE(all[1].message == "The included file \"none.asm\" can't be read!");
+    REQUIRE(all[1].file == 0);
+    REQUIRE(all[2].message == "STRING expected after .include!");
+}
+
+TEST_CASE("IncludedModulesAreCached")
+{
+    const auto dir = test_directory("cache");
+    std::filesystem::create_directories(dir / "saved");
+    write_file(dir / "util.asm", "helper LOAD r1, $02\nRET\n");
+    write_file(dir / "font.asm", "font LB $F0\n.include \"util.asm\"\n");
+    const std::string a = "CALL helper\n.include \"font.asm\"\n";
+    const std::string b = "CLR\n.include \"font.asm\"\nILOAD font\n";
+
+    const auto assemble = [&dir](c8::ModuleCache& modules, const std::string& text) {
+        c8::AssemblerContext context;
+        context.set_includes(modules, dir.string());
+        REQUIRE(context.assemble(text));
+        return context.rom();
+    };
+
+    c8::ModuleCache modules((dir / "saved").string());
+    const auto romA = assemble(modules, a);
+    const auto romB = assemble(modules, b);
+    REQUIRE(modules.parsed() == 2);
+    REQUIRE(modules.hits() == 1);
+    REQUIRE(romB == std::vector<uint8_t>{ 0x00, 0xE0, 0xF0, 0x61, 0x02, 0x00, 0xEE, 0xA2, 0x02 });
+
+    /* Another run picks the modules up from the directory */
+    c8::ModuleCache later((dir / "saved").string());
+    REQUIRE(assemble(later, a) == romA);
+    REQUIRE(later.parsed() == 0);
+    REQUIRE(later.loaded() == 1);
+
+    /* A change to a file that is included in turn is noticed */
+    write_file(dir / "util.asm", "helper LOAD r1, $03\nRET\n");
+    auto changed = romB;
+    changed[4] = 0x03;
+    REQUIRE(assemble(later, b) == changed);
+    REQUIRE(later.parsed() == 2);
+    /* The first cache finds what the second one saved */
+    REQUIRE(assemble(modules, b) == changed);
+    REQUIRE(modules.parsed() == 2);
+    REQUIRE(modules.loaded() == 1);
+}
+
+static std::vector<uint8_t> rom_of(const c8::Program& program)
+{
+    return c8::toRom(c8::generateInstructions(program.code));
+}
+
+TEST_CASE("MacrosExpandInPlace")
+{
+    const std::string text = ".macro draw_at x, y, n\n  LOAD r0, x\n  LOAD r1, y ; y\n  DRAW r0, r1, n\n.endm\n"
+        "start ILOAD sprite\ndraw_at $A, $5, $5\n.rept $3\n  ADD r2, $1\n  draw_at $14, $5, $5\n.endr\n"
+        "draw_at $A, $5, $5\nend JMP end\nsprite LB $F0\n";
+    std::string unrolled = "start ILOAD sprite\nLOAD r0, $A\nLOAD r1, $5\nDRAW r0, r1, $5\n";
+    for (int i = 0; i < 3; ++i) {
+        unrolled += "ADD r2, $1\nLOAD r0, $14\nLOAD r1, $5\nDRAW r0, r1, $5\n";
+    }
+    unrolled += "LOAD r0, $A\nLOAD r1, $5\nDRAW r0, r1, $5\nend JMP end\nsprite LB $F0\n";
+    const auto expected = rom_of(c8::Parser(c8::Lexer(unrolled)).parse());
+
+    const auto tokens = c8::Lexer(text).tokenize();
+    c8::Parser parser(tokens);
+    const auto program = parser.parse();
+    REQUIRE(rom_of(program) == expected);
+    /* The same arguments give the same expansion */
+    REQUIRE(parser.macros().expansions() == 2);
+    REQUIRE(program.statement(program.code[1]).args == std::vector<std::string>{ "R0", "$A" });
+    REQUIRE(program.code[1].offset == text.find("LOAD r0, x"));
+    REQUIRE(program.symbols.name(program.code[4].label) == "start");
+
+    REQUIRE(rom_of(c8::Parser(c8::Lexer(text)).parse()) == expected);
+    std::FILE* fp = make_stream(text);
+    c8::StreamBuffer stream(fp, 64);
+    REQUIRE(rom_of(c8::Parser(c8::Lexer(stream)).parse()) == expected);
+    std::fclose(fp);
+
+    c8::AssemblerContext context;
+    REQUIRE(context.assemble(text));
+    REQUIRE(context.rom() == expected);
+
+    /* Editing a macro's arguments changes what it expands to */
+    c8::Document doc(text);
+    REQUIRE(doc.code().size() == program.code.size());
+    doc.edit(doc.text().find("$A"), 2, "$B");
+    REQUIRE(doc.code()[1].operands[1] == 0xB);
+    REQUIRE(doc.code()[16].operands[1] == 0xA);
+}
+
+TEST_CASE("MacroErrorsAreReported")
+{
+    const auto errors = [](const std::string& text) {
+        auto result = c8::Parser(c8::Lexer(text)).parse(c8::Diagnostics());
+        std::vector<std::string> messages;
+        for (const auto& d : result.diagnostics.all()) {
+            messages.push_back(d.message);
+        }
+        return messages;
+    };
+
+    /* A bad argument is reported in the body and the rest of that line of it is skipped */
+    const std::string text = ".macro load a\n  LOAD r0, a\n  CLR\n.endm\nload r1\nload $1\n";
+    auto result = c8::Parser(c8::Lexer(text)).parse(c8::Diagnostics());
+    REQUIRE(result.diagnostics.errors() == 1);
+    REQUIRE(result.diagnostics.all()[0].message == "HEX expected after ,!");
+    REQUIRE(result.diagnostics.all()[0].offset == text.find("a\n  CLR"));
+    REQUIRE(result.value.code.size() == 3);
+
+    REQUIRE(errors(".macro m\n  m\n.endm\nm\n") == std::vector<std::string>{ "m expands too deeply! Does a macro expand itself?" });
+    REQUIRE(errors(".rept $2\n  CLR\n") == std::vector<std::string>{ ".rept has no matching .endr!" });
+    REQUIRE(errors(".endm\nCLR\n") == std::vector<std::string>{ ".endm without .macro!" });
+    REQUIRE(errors(".macro m\n.endm\n.macro m\n  CLR\n.endm\n") == std::vector<std::string>{ "m macro is redefined!" });
+    REQUIRE(errors(".macro m a, b\n.endm\nm $1 $2\n") == std::vector<std::string>{ "COMMA expected after $1!" });
+}
+
+TEST_CASE("IncludedFilesDefineMacros")
+{
+    const auto dir = test_directory("macros");
+    write_file(dir / "lib.asm", ".macro set r, v\n  LOAD r, v\n.endm\n.macro clear_twice\n  CLR\n  CLR\n.endm\nhelper RET\n");
+    const std::string text = ".include \"lib.asm\"\nstart set r1, $2\nclear_twice\nCALL helper\n";
+    const std::vector<uint8_t> expected{ 0x00, 0xEE, 0x61, 0x02, 0x00, 0xE0, 0x00, 0xE0, 0x22, 0x00 };
+
+    const auto assemble = [&dir](c8::ModuleCache& modules, const std::string& source) {
+        c8::AssemblerContext context;
+        context.set_includes(modules, dir.string());
+        context.assemble(source);
+        return context.release();
+    };
+    c8::ModuleCache modules(dir.string());
+    REQUIRE(assemble(modules, text).value == expected);
+
+    /* Macros are saved with the rest of the module */
+    c8::ModuleCache later(dir.string());
+    REQUIRE(assemble(later, text).value == expected);
+    REQUIRE(later.loaded() == 1);
+
+    /* Errors in an included macro point into the file that defines it */
+    const auto result = assemble(later, ".include \"lib.asm\"\nset $1, $2\n");
+    REQUIRE(result.diagnostics.errors() == 1);
+    const auto& error = result.diagnostics.all()[0];
+    REQUIRE(error.message == "REGISTER expected after LOAD!");
+    REQUIRE(later.file(error.file).path == (dir / "lib.asm").string());
+    REQUIRE(error.offset == later.file(error.file).text.find("r, v\n.endm"));
+
+    /* A damaged module is parsed again rather than trusted */
+    std::filesystem::path saved;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() == ".c8m") {
+            saved = entry.path();
+        }
+    }
+    const std::string bytes = read_file(saved);
+    const size_t set = bytes.find(std::string("\3\0\0\0set", 7));
+    REQUIRE(set != std::string::npos);
+    /* The count of params, then the type of the first token of the body */
+    for (const size_t at : { set + 7, set + 27 }) {
+        auto damaged = bytes;
+        std::memset(&damaged[at], 0xFF, at == set + 7 ? 4 : 1);
+        write_file(saved, damaged);
+        c8::ModuleCache fresh(dir.string());
+        REQUIRE(assemble(fresh, text).value == expected);
+        REQUIRE(fresh.loaded() == 0);
+        REQUIRE(fresh.parsed() == 1);
+    }
+}
+
+TEST_CASE("ExpressionsFoldIntoOperands")
+{
+    const std::string text = "WIDTH EQU 8\n.define HEIGHT WIDTH * 2 - 1\nstart LOAD r0, WIDTH + $2\n"
+        "LOAD r1, lo(start) ; $00\nLOAD r2, hi(start)\nADD r3, -1\nDRAW r0, r1, HEIGHT >> 1\n"
+        "ILOAD sprite + 5\nJMP END - 1\n.rept WIDTH / 4\nLB (1 << 4) | $F\n.endr\nsprite LB ~0 & $FF\nEND EQU $301\n";
+    const std::vector<uint8_t> expected{ 0x60, 0x0A, 0x61, 0x00, 0x62, 0x02, 0x73, 0xFF, 0xD0, 0x17,
+        0xA2, 0x15, 0x13, 0x00, 0x1F, 0x1F, 0xFF };
+
+    const auto program = c8::Parser(c8::Lexer(text)).parse();
+    REQUIRE(rom_of(program) == expected);
+    REQUIRE(program.statement(program.code[0]).args == std::vector<std::string>{ "r0", "WIDTH + $2" });
+    REQUIRE(program.statement(program.code[1]).args == std::vector<std::string>{ "r1", "lo(start)" });
+    REQUIRE(program.statement(program.code[5]).args == std::vector<std::string>{ "0x0215" });
+    REQUIRE(program.symbols.is_constant(program.symbols.find("HEIGHT")));
+    REQUIRE(program.symbols.address(program.symbols.find("HEIGHT")) == 15);
+    REQUIRE(program.symbols.name(program.code[2].label) == "start");
+
+    std::FILE* fp = make_stream(text);
+    c8::StreamBuffer stream(fp, 64);
+    REQUIRE(rom_of(c8::Parser(c8::Lexer(stream)).parse()) == expected);
+    std::fclose(fp);
+
+    /* A jump to a constant defined later is patched with its value plus the offset */
+    c8::AssemblerContext context;
+    REQUIRE(context.assemble(text));
+    REQUIRE(context.rom() == expected);
+
+    /* Moving a label redoes the operands its address was folded into */
+    c8::Document doc(text);
+    doc.edit(doc.text().find("start"), 0, "CLR\n");
+    REQUIRE(doc.code()[2].operands[1] == 0x02);
+    REQUIRE(doc.code()[6].operands[0] == 0x217);
+}
+
+TEST_CASE("ExpressionErrorsAreReported")
+{
+    const auto errors = [](const std::string& text) {
+        auto result = c8::Parser(c8::Lexer(text)).parse(c8::Diagnostics());
+        std::vector<std::string> messages;
+        for (const auto& d : result.diagnostics.all()) {
+            messages.push_back(d.message);
+        }
+        return messages;
+    };
+
+    REQUIRE(errors("LOAD r0, $FF + 1\n") == std::vector<std::string>{ "$100 is out of range after ,! The most it can be is $FF." });
+    REQUIRE(errors("LOAD r0, 300\n") == std::vector<std::string>{ "300 is out of range after ,! The most it can be is $FF." });
+    REQUIRE(errors(".define BASE $200\nJMP BASE - $300\n") == std::vector<std::string>{ "-$100 is out of range after JMP! The most it can be is $FFF." });
+    REQUIRE(errors("ILOAD 0 - 1\n") == std::vector<std::string>{ "-$1 is out of range after ILOAD! The most it can be is $FFF." });
+    REQUIRE(errors("ADD r0, 1 / (2 - 2)\n") == std::vector<std::string>{ "/ by 0 in an expression!" });
+    REQUIRE(errors("LB (1\nCLR\n") == std::vector<std::string>{ ") expected after 1!" });
+    REQUIRE(errors("LB lo(data)\ndata LB 1\n")
+        == std::vector<std::string>{ "data must be defined before it is used here! Only an address can refer to a later label." });
+    REQUIRE(errors("N EQU 1\nN EQU 2\n") == std::vector<std::string>{ "N constant is redefined!" });
+    REQUIRE(errors("EQU 5\n") == std::vector<std::string>{ "LABEL expected before EQU!" });
+
+    /* An included file can be placed anywhere, so its labels can only be addresses */
+    const auto dir = test_directory("expressions");
+    write_file(dir / "lib.asm", "SPEED EQU 3\nhelper ILOAD table + 1\ntable LB SPEED\nLB lo(table)\n");
+    c8::ModuleCache modules;
+    c8::Parser parser(c8::Lexer(".include \"lib.asm\"\n"));
+    parser.set_includes(modules, dir.string());
+    const auto result = parser.parse(c8::Diagnostics());
+    REQUIRE(result.diagnostics.errors() == 1);
+    REQUIRE(result.diagnostics.all()[0].message == "table moves with the file it is in, so it can only be used as an address, plus or minus an offset!");
+
+    write_file(dir / "lib.asm", "SPEED EQU 3\nhelper ILOAD table + 1\ntable LB SPEED\n");
+    c8::Parser fixed(c8::Lexer(".include \"lib.asm\"\nCLR\nLB SPEED * 2\n"));
+    fixed.set_includes(modules, dir.string());
+    REQUIRE(rom_of(fixed.parse()) == std::vector<uint8_t>{ 0xA2, 0x03, 0x03, 0x00, 0xE0, 0x06 });
+}
+
+TEST_CASE("LabelOffsetsStayInReach")
+{
+    const auto errors = [](const c8::Diagnostics& diagnostics) {
+        std::vector<std::string> messages;
+        for (const auto& d : diagnostics.all()) {
+            messages.push_back(d.message);
+        }
+        return messages;
+    };
+
+    /* An offset that takes a label past what the operand holds or below zero doesn't wrap into another address */
+    const std::string backward = "start CLR\nILOAD start + $1000\nJMP start + $E00\nJMP start - $300\nJMP start + $DFF\n";
+    const std::vector<std::string> expected{ "start + $1000 is at $1200, which ILOAD can't reach! It can only reach up to $FFF.",
+        "start + $E00 is at $1000, which JMP can't reach! It can only reach up to $FFF.",
+        "start - $300 is at -$100, which JMP can't reach! It can only reach up to $FFF." };
+    const auto tokens = c8::Lexer(backward).tokenize();
+    REQUIRE(errors(c8::Parser(tokens).parse(c8::Diagnostics()).diagnostics) == expected);
+    REQUIRE(errors(c8::parse_parallel(tokens, 2).diagnostics) == expected);
+    c8::AssemblerContext context;
+    REQUIRE_FALSE(context.assemble(backward));
+    REQUIRE(errors(context.diagnostics()) == expected);
+
+    /* The one-pass assembler checks a forward label when it patches it */
+    const std::string forward = "ILOAD end + $1000\nJMP end - $300\nend CLR\n";
+    REQUIRE_FALSE(context.assemble(forward));
+    REQUIRE(errors(context.diagnostics()) == std::vector<std::string>{
+        "end + $1000 is at $1204, which ILOAD can't reach! It can only reach up to $FFF.",
+        "end - $300 is at -$FC, which JMP can't reach! It can only reach up to $FFF." });
+
+    /* An offset is kept in 16 bits */
+    REQUIRE(errors(c8::Parser(c8::Lexer("start JMP start + $8000\n")).parse(c8::Diagnostics()).diagnostics)
+        == std::vector<std::string>{ "$8000 is out of range after JMP! The most it can be is $7FFF." });
+
+    /* A document checks the labels it resolves, whether it parses all of the source or moves a label */
+    REQUIRE_THROWS_WITH(c8::Document("N EQU 1\n" + backward), expected[0]);
+    c8::Document doc("CLR\nstart CLR\nJMP start - $202\nJMP start + $DFD\n");
+    REQUIRE_THROWS_WITH(doc.edit(0, 4, ""), "start - $202 is at -$2, which JMP can't reach! It can only reach up to $FFF.");
+    doc.edit(0, 0, "CLR\n");
+    require_matches_full_parse(doc);
+    REQUIRE_THROWS_WITH(doc.edit(0, 0, "CLR\n"), "start + $DFD is at $1001, which JMP can't reach! It can only reach up to $FFF.");
+}
+
+TEST_CASE("TargetsGateInstructionsAndAddresses")
+{
+    const auto parse = [](const std::string& text, c8::Target target) {
+        c8::Parser parser{ c8::Lexer(text) };
+        parser.set_target(target);
+        return parser.parse(c8::Diagnostics());
+    };
+    const auto messages = [](const c8::Diagnostics& diagnostics) {
+        std::vector<std::string> all;
+        for (const auto& d : diagnostics.all()) {
+            all.push_back(d.message);
+        }
+        return all;
+    };
+
+    /* Each target adds to the one before it */
+    REQUIRE(messages(parse("HIGH\nSCR\nLLOAD $1234\n", c8::Target::CHIP8).diagnostics) == std::vector<std::string>{
+        "HIGH is a SUPER-CHIP instruction! Assemble with --target schip to use it.",
+        "SCR is a SUPER-CHIP instruction! Assemble with --target schip to use it.",
+        "LLOAD is a XO-CHIP instruction! Assemble with --target xochip to use it." });
+    const auto schip = parse("HIGH\nSCR\nCLR\n", c8::Target::SCHIP);
+    REQUIRE(schip.ok());
+    REQUIRE(c8::generate(schip.value.code, c8::Target::SCHIP) == std::vector<uint8_t>{ 0x00, 0xFF, 0x00, 0xFB, 0x00, 0xE0 });
+
+    /* XO-CHIP memory goes past what a 12 bit address reaches, which only LLOAD can load */
+    const std::string text = "LLOAD far\nJMP near\nnear .rept $E00\nLB $0\n.endr\nfar CLR\n";
+    const auto xochip = parse(text, c8::Target::XOCHIP);
+    REQUIRE(xochip.ok());
+    const auto rom = c8::generate(xochip.value.code, c8::Target::XOCHIP);
+    REQUIRE(rom.size() == 0xE08);
+    REQUIRE(std::vector<uint8_t>(rom.begin(), rom.begin() + 6) == std::vector<uint8_t>{ 0xF0, 0x00, 0x10, 0x06, 0x12, 0x06 });
+    REQUIRE(rom == c8::toRom(c8::generateInstructions(xochip.value.code)));
+    REQUIRE(c8::generateInstructions(xochip.value.code)[0].toString(xochip.value) == "0x0200 | 0x061000F0 ; LLOAD 0x1006");
+    REQUIRE(messages(parse(text + "JMP far\n", c8::Target::XOCHIP).diagnostics)
+        == std::vector<std::string>{ "far is at $1006, which JMP can't reach! It can only reach up to $FFF." });
+
+    /* A forward LLOAD is patched in all 16 bits in one pass */
+    c8::AssemblerContext context;
+    context.set_target(c8::Target::XOCHIP);
+    REQUIRE(context.assemble(text));
+    REQUIRE(context.rom() == rom);
+    REQUIRE_FALSE(context.assemble("JMP far\n" + text));
+    REQUIRE(messages(context.diagnostics()) == std::vector<std::string>{ "far is at $1008, which JMP can't reach! It can only reach up to $FFF." });
+    context.set_target(c8::Target::CHIP8);
+    REQUIRE_FALSE(context.assemble(text));
+
+    /* Code that runs past the end of CHIP-8 memory can put a label out of reach too, which would spill into the opcode */
+    const std::string past = "ILOAD far\n.rept $E00\nLB $0\n.endr\nfar CLR\n";
+    const auto chip8 = parse(past, c8::Target::CHIP8);
+    REQUIRE_FALSE(chip8.ok());
+    REQUIRE(messages(chip8.diagnostics).back() == "far is at $1002, which ILOAD can't reach! It can only reach up to $FFF.");
+    REQUIRE_FALSE(context.assemble(past));
+    REQUIRE(messages(context.diagnostics()).back() == "far is at $1002, which ILOAD can't reach! It can only reach up to $FFF.");
+}
+
+TEST_CASE("PeepholePassRewritesAndShrinks")
+{
+    const std::string text = "start CALL draw\nRET\nmain LOAD r1, $0\nADD r1, $1\nADD r1, $2\nADD r1, $FF\nJMP hop\nhop JMP next\n"
+        "next JMP far\nfar SKE r1, $2\nJMP skipme\nskipme JMP main\ndraw ILOAD sprite\nDRAW r0, r1, $1\nRET\nsprite LB $F0\n";
+    const std::string by_hand = "JMP draw\nmain LOAD r1, $0\nADD r1, $2\nSKE r1, $2\nJMP main\nJMP main\n"
+        "draw ILOAD sprite\nDRAW r0, r1, $1\nRET\nsprite LB $F0\n";
+    auto program = c8::Parser(c8::Lexer(text)).parse();
+    const auto saved = c8::optimize(program);
+    REQUIRE(saved.rewritten == 5);
+    REQUIRE(saved.instructions == 6);
+    REQUIRE(saved.bytes == 12);
+    REQUIRE(rom_of(program) == rom_of(c8::Parser(c8::Lexer(by_hand)).parse()));
+    REQUIRE(program.symbols.address(program.symbols.find("sprite")) == 0x212);
+    REQUIRE(program.statement(program.code[2]).args == std::vector<std::string>{ "R1", "$2" });
+
+    const auto optimized = [](const std::string& source) {
+        auto p = c8::Parser(c8::Lexer(source)).parse();
+        const auto stats = c8::optimize(p);
+        return std::make_pair(stats.rewritten, stats.instructions);
+    };
+    /* What a skip jumps over stays, and so does a return something lands on */
+    REQUIRE(optimized("SKE r0, $1\nJMP next\nnext CLR\n") == std::make_pair<size_t, size_t>(0, 0));
+    REQUIRE(optimized("SKE r0, $1\nCALL sub\nRET\nsub RET\n") == std::make_pair<size_t, size_t>(1, 0));
+    REQUIRE(optimized("ADD r0, $1\nagain ADD r0, $1\nJMP again\n") == std::make_pair<size_t, size_t>(0, 0));
+    REQUIRE(optimized("CALL sub\nback RET\nsub CLR\nJMP back\n") == std::make_pair<size_t, size_t>(1, 0));
+    /* Code that can't be moved is only rewritten in place */
+    REQUIRE(optimized("CALL sub\nRET\nJMP $206\nsub RET\n") == std::make_pair<size_t, size_t>(1, 0));
+    REQUIRE(optimized("CALL sub\nRET\nZJMP sub\nsub RET\n") == std::make_pair<size_t, size_t>(1, 0));
+    REQUIRE(optimized("data LB $1\nLB lo(data)\nCALL sub\nRET\nsub RET\n") == std::make_pair<size_t, size_t>(1, 0));
+    REQUIRE(optimized("data LB $1\nILOAD data + 1\nCALL sub\nRET\nsub RET\n") == std::make_pair<size_t, size_t>(1, 2));
+}